@@ -1,6 +1,98 @@
 #pragma once
 
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 namespace kokopuffs {
+
+// ranges at most this long are left to insertion sort
+static const int64_t kInsertionSortThreshold = 24;
+// ranges longer than this take their pivot from nine elements instead of
+// three
+static const int64_t kNintherThreshold = 128;
+
+template <typename T>
+void _heapsort(std::vector<T>& arr, const int64_t begin, const int64_t end);
+
+inline int64_t _log2(uint64_t n) {
+  int64_t log = 0;
+  while (n >>= 1)
+    ++log;
+  return log;
+}
+
+// sorts arr[lo..hi] by moving each element back past the larger ones
+template <typename T>
+void _insertion_sort(std::vector<T>& arr, const int64_t lo, const int64_t hi) {
+  for (int64_t i = lo + 1; i <= hi; ++i) {
+    if (!(arr[i] < arr[i - 1]))
+      continue;
+    T value = std::move(arr[i]);
+    int64_t j = i;
+    do {
+      arr[j] = std::move(arr[j - 1]);
+      --j;
+    } while (j > lo && value < arr[j - 1]);
+    arr[j] = std::move(value);
+  }
+}
+
+// _insertion_sort() for when arr[lo-1] is no greater than anything in
+// arr[lo..hi], so the inner loop can stop on it instead of checking bounds
+template <typename T>
+void _unguarded_insertion_sort(std::vector<T>& arr, const int64_t lo,
+                               const int64_t hi) {
+  for (int64_t i = lo; i <= hi; ++i) {
+    if (!(arr[i] < arr[i - 1]))
+      continue;
+    T value = std::move(arr[i]);
+    int64_t j = i;
+    do {
+      arr[j] = std::move(arr[j - 1]);
+      --j;
+    } while (value < arr[j - 1]);
+    arr[j] = std::move(value);
+  }
+}
+
+// orders arr[a] <= arr[b] <= arr[c]
+template <typename T>
+void _sort3(std::vector<T>& arr, const int64_t a, const int64_t b,
+            const int64_t c) {
+  if (arr[b] < arr[a])
+    std::swap(arr[a], arr[b]);
+  if (arr[c] < arr[b]) {
+    std::swap(arr[b], arr[c]);
+    if (arr[b] < arr[a])
+      std::swap(arr[a], arr[b]);
+  }
+}
+
+// Moves a pivot to arr[lo]: the median of the first, middle and last
+// element, or on long ranges Tukey's ninther, the median of three such
+// medians spread over the range. Sorted, reversed and organ pipe inputs
+// then still split near the middle.
+template <typename T>
+void _choose_pivot(std::vector<T>& arr, const int64_t lo, const int64_t hi) {
+  const int64_t n = hi - lo + 1;
+  const int64_t mid = lo + n / 2;
+  if (n > kNintherThreshold) {
+    const int64_t step = n / 8;
+    _sort3(arr, lo, lo + step, lo + 2 * step);
+    _sort3(arr, mid - step, mid, mid + step);
+    _sort3(arr, hi - 2 * step, hi - step, hi);
+    _sort3(arr, lo + step, mid, hi - step);
+  } else {
+    _sort3(arr, lo, mid, hi);
+  }
+  std::swap(arr[lo], arr[mid]);
+}
 template <typename T>
 int64_t lomuto_partition(std::vector<T>& arr, const int64_t lo, const int64_t hi) {
   const T& pivot_value = arr[hi];
@@ -15,15 +107,18 @@ int64_t lomuto_partition(std::vector<T>& arr, const int64_t lo, const int64_t hi
   return i;
 }
 
+// Partitions around arr[lo] and returns j such that arr[lo..j] are not
+// greater than it and arr[j+1..hi] not less, with lo <= j < hi. The pivot is
+// copied, since the first swap may move it.
 template <typename T>
 int64_t hoare_partition(std::vector<T>& arr, const int64_t lo, const int64_t hi) {
-  const T& pivot_value = arr[lo];
+  const T pivot_value = arr[lo];
   int64_t i = lo - 1;
   int64_t j = hi + 1;
   while (true) {
     do {
       --j;
-    } while (arr[j] > pivot_value);
+    } while (pivot_value < arr[j]);
     do {
       ++i;
     } while (arr[i] < pivot_value);
@@ -34,105 +129,874 @@ int64_t hoare_partition(std::vector<T>& arr, const int64_t lo, const int64_t hi)
   }
 }
 
+// Partitions arr[begin, end) around the pivot in arr[begin], putting
+// elements equal to it on the left, and returns where the pivot ends up.
+// Only called when the pivot equals the element before the range, which
+// is then no greater than anything in it, so everything equal to the
+// pivot is already in place.
+template <typename T>
+int64_t _partition_left(std::vector<T>& arr, const int64_t begin,
+                        const int64_t end) {
+  T pivot = std::move(arr[begin]);
+  int64_t first = begin;
+  int64_t last = end;
+
+  while (pivot < arr[--last]) {
+  }
+  if (last + 1 == end) {
+    while (first < last && !(pivot < arr[++first])) {
+    }
+  } else {
+    while (!(pivot < arr[++first])) {
+    }
+  }
+
+  while (first < last) {
+    std::swap(arr[first], arr[last]);
+    while (pivot < arr[--last]) {
+    }
+    while (!(pivot < arr[++first])) {
+    }
+  }
+
+  const int64_t pivot_pos = last;
+  arr[begin] = std::move(arr[pivot_pos]);
+  arr[pivot_pos] = std::move(pivot);
+  return pivot_pos;
+}
+
+// Reverses arr and returns true if it is strictly descending. Anything
+// else is found out within a few elements, so this costs next to nothing.
+template <typename T>
+bool _reverse_if_descending(std::vector<T>& arr) {
+  const int64_t n = arr.size();
+  int64_t descending = 1;
+  while (descending < n && arr[descending] < arr[descending - 1])
+    ++descending;
+  if (descending < n)
+    return false;
+  std::reverse(arr.begin(), arr.end());
+  return true;
+}
+
+// offsets buffered per side by _partition_right_branchless(); they have to
+// fit in a uint8_t
+static const int64_t kPdqBlockSize = 64;
+// how many element moves _partial_insertion_sort() makes before giving up
+static const int64_t kPdqPartialInsertionSortLimit = 8;
+
+// Insertion sorts arr[lo..hi] unless that takes more than
+// kPdqPartialInsertionSortLimit moves, and returns whether it finished.
+template <typename T>
+bool _partial_insertion_sort(std::vector<T>& arr, const int64_t lo,
+                             const int64_t hi) {
+  int64_t moves = 0;
+  for (int64_t i = lo + 1; i <= hi; ++i) {
+    if (!(arr[i] < arr[i - 1]))
+      continue;
+    T value = std::move(arr[i]);
+    int64_t j = i;
+    do {
+      arr[j] = std::move(arr[j - 1]);
+      --j;
+    } while (j > lo && value < arr[j - 1]);
+    arr[j] = std::move(value);
+    moves += i - j;
+    if (moves > kPdqPartialInsertionSortLimit)
+      return false;
+  }
+  return true;
+}
+
+// Partitions arr[begin, end) around the pivot in arr[begin], putting
+// elements equal to it on the right. Returns where the pivot ends up and
+// whether no element had to move, which hints that the range is sorted.
+// _choose_pivot() leaves an element not less than the pivot in the range,
+// which stops the first scan.
+template <typename T>
+std::pair<int64_t, bool> _partition_right(std::vector<T>& arr,
+                                          const int64_t begin,
+                                          const int64_t end) {
+  T pivot = std::move(arr[begin]);
+  int64_t first = begin;
+  int64_t last = end;
+
+  while (arr[++first] < pivot) {
+  }
+  // nothing before first stops the scan from the right if first has not
+  // moved
+  if (first - 1 == begin) {
+    while (first < last && !(arr[--last] < pivot)) {
+    }
+  } else {
+    while (!(arr[--last] < pivot)) {
+    }
+  }
+
+  const bool already_partitioned = first >= last;
+  while (first < last) {
+    std::swap(arr[first], arr[last]);
+    while (arr[++first] < pivot) {
+    }
+    while (!(arr[--last] < pivot)) {
+    }
+  }
+
+  const int64_t pivot_pos = first - 1;
+  arr[begin] = std::move(arr[pivot_pos]);
+  arr[pivot_pos] = std::move(pivot);
+  return std::make_pair(pivot_pos, already_partitioned);
+}
+
+// Swaps the num misplaced elements recorded in offsets_l (forward from
+// first) with those in offsets_r (back from last). When the counts differ
+// the elements are rotated through one temporary instead, which is half the
+// moves of swapping.
 template <typename T>
-void _quicksort(std::vector<T>& arr, const int64_t lo, const int64_t hi) {
-#if 0
-  if (lo < hi) {
-    int64_t mid = lomuto_partition(arr, lo, hi);
-    _quicksort(arr, lo, mid-1);
-    _quicksort(arr, mid+1, hi);
+void _swap_offsets(std::vector<T>& arr, const int64_t first,
+                   const int64_t last, const uint8_t* offsets_l,
+                   const uint8_t* offsets_r, const int64_t num,
+                   const bool use_swaps) {
+  if (use_swaps) {
+    for (int64_t i = 0; i < num; ++i)
+      std::swap(arr[first + offsets_l[i]], arr[last - offsets_r[i]]);
+  } else if (num > 0) {
+    int64_t l = first + offsets_l[0];
+    int64_t r = last - offsets_r[0];
+    T tmp(std::move(arr[l]));
+    arr[l] = std::move(arr[r]);
+    for (int64_t i = 1; i < num; ++i) {
+      l = first + offsets_l[i];
+      arr[r] = std::move(arr[l]);
+      r = last - offsets_r[i];
+      arr[l] = std::move(arr[r]);
+    }
+    arr[r] = std::move(tmp);
+  }
+}
+
+// _partition_right() without a branch per comparison, after BlockQuicksort:
+// a block of kPdqBlockSize elements from each end is scanned first,
+// recording the offsets of the ones on the wrong side, which the comparison
+// result merely increments a count over. Then as many pairs as both sides
+// found are swapped at once. Only worth it where comparisons are cheap.
+template <typename T>
+std::pair<int64_t, bool> _partition_right_branchless(std::vector<T>& arr,
+                                                     const int64_t begin,
+                                                     const int64_t end) {
+  T pivot = std::move(arr[begin]);
+  int64_t first = begin;
+  int64_t last = end;
+
+  while (arr[++first] < pivot) {
+  }
+  if (first - 1 == begin) {
+    while (first < last && !(arr[--last] < pivot)) {
+    }
+  } else {
+    while (!(arr[--last] < pivot)) {
+    }
+  }
+
+  const bool already_partitioned = first >= last;
+  if (!already_partitioned) {
+    std::swap(arr[first], arr[last]);
+    ++first;
+
+    uint8_t offsets_l[kPdqBlockSize];
+    uint8_t offsets_r[kPdqBlockSize];
+    int64_t offsets_l_base = first;
+    int64_t offsets_r_base = last;
+    int64_t num_l = 0;
+    int64_t num_r = 0;
+    int64_t start_l = 0;
+    int64_t start_r = 0;
+
+    while (first < last) {
+      // refill whichever side has run out of misplaced elements, splitting
+      // what is left between both when both have
+      const int64_t num_unknown = last - first;
+      const int64_t left_split =
+          num_l == 0 ? (num_r == 0 ? num_unknown / 2 : num_unknown) : 0;
+      const int64_t right_split = num_r == 0 ? num_unknown - left_split : 0;
+
+      if (left_split >= kPdqBlockSize) {
+        for (int64_t i = 0; i < kPdqBlockSize;) {
+          for (int64_t k = 0; k < 8; ++k) {
+            offsets_l[num_l] = static_cast<uint8_t>(i++);
+            num_l += !(arr[first] < pivot);
+            ++first;
+          }
+        }
+      } else {
+        for (int64_t i = 0; i < left_split;) {
+          offsets_l[num_l] = static_cast<uint8_t>(i++);
+          num_l += !(arr[first] < pivot);
+          ++first;
+        }
+      }
+
+      if (right_split >= kPdqBlockSize) {
+        for (int64_t i = 0; i < kPdqBlockSize;) {
+          for (int64_t k = 0; k < 8; ++k) {
+            offsets_r[num_r] = static_cast<uint8_t>(++i);
+            num_r += arr[--last] < pivot;
+          }
+        }
+      } else {
+        for (int64_t i = 0; i < right_split;) {
+          offsets_r[num_r] = static_cast<uint8_t>(++i);
+          num_r += arr[--last] < pivot;
+        }
+      }
+
+      const int64_t num = std::min(num_l, num_r);
+      _swap_offsets(arr, offsets_l_base, offsets_r_base, offsets_l + start_l,
+                    offsets_r + start_r, num, num_l == num_r);
+      num_l -= num;
+      num_r -= num;
+      start_l += num;
+      start_r += num;
+      if (num_l == 0) {
+        start_l = 0;
+        offsets_l_base = first;
+      }
+      if (num_r == 0) {
+        start_r = 0;
+        offsets_r_base = last;
+      }
+    }
+
+    // one side may still hold misplaced elements, which all go next to the
+    // middle
+    if (num_l) {
+      while (num_l--)
+        std::swap(arr[offsets_l_base + offsets_l[start_l + num_l]], arr[--last]);
+      first = last;
+    }
+    if (num_r) {
+      while (num_r--) {
+        std::swap(arr[offsets_r_base - offsets_r[start_r + num_r]], arr[first]);
+        ++first;
+      }
+      last = first;
+    }
   }
-#else
-  if (lo < hi) {
-    int64_t mid = hoare_partition(arr, lo, hi);
-    _quicksort(arr, lo, mid);
-    _quicksort(arr, mid+1, hi);
+
+  const int64_t pivot_pos = first - 1;
+  arr[begin] = std::move(arr[pivot_pos]);
+  arr[pivot_pos] = std::move(pivot);
+  return std::make_pair(pivot_pos, already_partitioned);
+}
+
+// Introsort: partitioning around a median of three or ninther pivot,
+// recursing only into the smaller side so the stack stays O(log n). Every
+// range but the first has an element before it no greater than anything in
+// it, and a pivot equal to that element splits off its duplicates. A
+// balanced partition that moved nothing is finished with insertion sort if
+// that takes only a few moves. Short ranges are left for the insertion sort
+// at the end, and a range that is still being split after depth_limit
+// partitions is heapsorted, which bounds the worst case at O(n log n).
+template <typename T, bool Branchless>
+void _quicksort(std::vector<T>& arr, int64_t lo, int64_t hi,
+                int64_t depth_limit) {
+  while (hi - lo + 1 > kInsertionSortThreshold) {
+    if (depth_limit == 0) {
+      _heapsort(arr, lo, hi + 1);
+      return;
+    }
+    --depth_limit;
+
+    _choose_pivot(arr, lo, hi);
+    // a pivot equal to the element before the range is the smallest value
+    // in it, so all its duplicates can be put aside in one pass
+    if (lo > 0 && !(arr[lo - 1] < arr[lo])) {
+      lo = _partition_left(arr, lo, hi + 1) + 1;
+      continue;
+    }
+    const std::pair<int64_t, bool> part =
+        Branchless ? _partition_right_branchless(arr, lo, hi + 1)
+                   : _partition_right(arr, lo, hi + 1);
+    const int64_t pivot_pos = part.first;
+    const int64_t size = hi - lo + 1;
+    if (part.second && pivot_pos - lo >= size / 8 &&
+        hi - pivot_pos >= size / 8 &&
+        _partial_insertion_sort(arr, lo, pivot_pos - 1) &&
+        _partial_insertion_sort(arr, pivot_pos + 1, hi))
+      return;
+    if (pivot_pos - lo < hi - pivot_pos) {
+      _quicksort<T, Branchless>(arr, lo, pivot_pos - 1, depth_limit);
+      lo = pivot_pos + 1;
+    } else {
+      _quicksort<T, Branchless>(arr, pivot_pos + 1, hi, depth_limit);
+      hi = pivot_pos - 1;
+    }
   }
-#endif
 }
 
 template <typename T>
 void quicksort(std::vector<T>& arr) {
-  if (arr.size() == 0)
+  if (arr.size() < 2 || _reverse_if_descending(arr))
+    return;
+  const int64_t n = arr.size();
+  _quicksort<T, std::is_arithmetic<T>::value>(arr, 0, n - 1, 2 * _log2(n));
+  // every range left unsorted holds nothing smaller than the ones before it
+  // and is at most kInsertionSortThreshold long, so past the first one no
+  // element moves back further than that and the bounds check can go
+  const int64_t guarded = std::min(n - 1, kInsertionSortThreshold);
+  _insertion_sort(arr, 0, guarded);
+  _unguarded_insertion_sort(arr, guarded + 1, n - 1);
+}
+
+// Swaps a few elements of a range a badly chosen pivot left nearly empty
+// with others a quarter of the way in, so that whatever pattern fooled
+// _choose_pivot() is gone next time.
+template <typename T>
+void _break_patterns(std::vector<T>& arr, const int64_t begin,
+                     const int64_t end) {
+  const int64_t size = end - begin;
+  if (size < kInsertionSortThreshold)
     return;
-  _quicksort(arr, 0, arr.size() - 1);
+  const int64_t quarter = size / 4;
+  std::swap(arr[begin], arr[begin + quarter]);
+  std::swap(arr[end - 1], arr[end - quarter]);
+  if (size > kNintherThreshold) {
+    std::swap(arr[begin + 1], arr[begin + quarter + 1]);
+    std::swap(arr[begin + 2], arr[begin + quarter + 2]);
+    std::swap(arr[end - 2], arr[end - quarter - 1]);
+    std::swap(arr[end - 3], arr[end - quarter - 2]);
+  }
+}
+
+// Sorts arr[begin, end). leftmost is false when arr[begin-1] is no greater
+// than anything in the range, which then serves as the sentinel for
+// insertion sort and tells runs of duplicates apart. bad_allowed counts
+// down the highly unbalanced partitions left before giving up on pivots
+// and heapsorting.
+template <typename T, bool Branchless>
+void _pdqsort(std::vector<T>& arr, int64_t begin, const int64_t end,
+              int64_t bad_allowed, bool leftmost) {
+  for (;;) {
+    const int64_t size = end - begin;
+    if (size <= kInsertionSortThreshold) {
+      if (leftmost)
+        _insertion_sort(arr, begin, end - 1);
+      else
+        _unguarded_insertion_sort(arr, begin, end - 1);
+      return;
+    }
+
+    _choose_pivot(arr, begin, end - 1);
+
+    // a pivot equal to the element before the range is the smallest value
+    // in it, so all its duplicates can be put aside in one pass
+    if (!leftmost && !(arr[begin - 1] < arr[begin])) {
+      begin = _partition_left(arr, begin, end) + 1;
+      continue;
+    }
+
+    const std::pair<int64_t, bool> part =
+        Branchless ? _partition_right_branchless(arr, begin, end)
+                   : _partition_right(arr, begin, end);
+    const int64_t pivot_pos = part.first;
+    const int64_t l_size = pivot_pos - begin;
+    const int64_t r_size = end - (pivot_pos + 1);
+
+    if (l_size < size / 8 || r_size < size / 8) {
+      if (--bad_allowed == 0) {
+        _heapsort(arr, begin, end);
+        return;
+      }
+      _break_patterns(arr, begin, pivot_pos);
+      _break_patterns(arr, pivot_pos + 1, end);
+    } else if (part.second &&
+               _partial_insertion_sort(arr, begin, pivot_pos - 1) &&
+               _partial_insertion_sort(arr, pivot_pos + 1, end - 1)) {
+      // a balanced partition that moved nothing was probably sorted input
+      return;
+    }
+
+    _pdqsort<T, Branchless>(arr, begin, pivot_pos, bad_allowed, leftmost);
+    begin = pivot_pos + 1;
+    leftmost = false;
+  }
+}
+
+// Pattern-defeating quicksort (Orson Peters): an introsort that partitions
+// arithmetic types without branching on comparisons, finishes sorted runs
+// with insertion sort instead of splitting them, groups runs of equal
+// elements in one pass, and shuffles ranges that split badly before giving
+// up on them. A strictly descending input is simply reversed.
+template <typename T>
+void pdqsort(std::vector<T>& arr) {
+  const int64_t n = arr.size();
+  if (n < 2)
+    return;
+  if (_reverse_if_descending(arr))
+    return;
+  _pdqsort<T, std::is_arithmetic<T>::value>(arr, 0, n, _log2(n), true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Merges src0[begin0, end0) and src1[begin1, end1) into dst starting at
+// out, moving the elements. Ties go to the first range, so merging
+// neighbouring runs is stable. dst may be src1 when the second range
+// already sits right after where the first one goes: the output never
+// catches up with the unread part of src1, and whatever is left of it once
+// the first range runs out is already in place.
 template <typename T>
-void _merge(std::vector<T>& arr, int64_t begin, int64_t mid, int64_t end,
-            std::vector<T>& scratch) {
-  int64_t list0 = begin;
-  int64_t list1 = mid;
-  for (int64_t i = begin; i < end; ++i) {
-    if (list0 < mid && (list1 >= end || arr[list0] < arr[list1])) {
-      scratch[i] = arr[list0];
-      ++list0;
+void _merge_runs(std::vector<T>& src0, int64_t begin0, const int64_t end0,
+                 std::vector<T>& src1, int64_t begin1, const int64_t end1,
+                 std::vector<T>& dst, int64_t out) {
+  while (begin0 < end0 && begin1 < end1) {
+    if (src1[begin1] < src0[begin0]) {
+      dst[out] = std::move(src1[begin1]);
+      ++begin1;
     } else {
-      scratch[i] = arr[list1];
-      ++list1;
+      dst[out] = std::move(src0[begin0]);
+      ++begin0;
     }
+    ++out;
+  }
+  for (; begin0 < end0; ++begin0, ++out)
+    dst[out] = std::move(src0[begin0]);
+  if (&src1 == &dst && out == begin1)
+    return;
+  for (; begin1 < end1; ++begin1, ++out)
+    dst[out] = std::move(src1[begin1]);
+}
+
+// merges src[begin0, end0) and src[begin1, end1) into dst starting at out
+template <typename T>
+void _merge_ranges(std::vector<T>& src, const int64_t begin0,
+                   const int64_t end0, const int64_t begin1,
+                   const int64_t end1, std::vector<T>& dst,
+                   const int64_t out) {
+  _merge_runs(src, begin0, end0, src, begin1, end1, dst, out);
+}
+
+// runs shorter than about this are extended with insertion sort
+static const int64_t kMergeSortMinRun = 32;
+// enough pending runs for any input, since the merge rules below keep each
+// run longer than the two above it together
+static const int kMergeSortMaxRuns = 128;
+
+namespace detail {
+
+// a sorted run of _mergesort(), in arr or in the buffer
+struct merge_run {
+  int64_t begin;
+  int64_t end;
+  bool in_buffer;
+
+  int64_t size() const { return end - begin; }
+};
+
+}
+
+// A run length between kMergeSortMinRun and twice that which cuts n into
+// a power of two runs, or slightly fewer, so the final merges are balanced.
+inline int64_t _min_run_length(int64_t n) {
+  int64_t odd = 0;
+  while (n >= 2 * kMergeSortMinRun) {
+    odd |= n & 1;
+    n >>= 1;
+  }
+  return n + odd;
+}
+
+// Returns the end of the run that starts at arr[begin]: the longest
+// non-descending stretch, or strictly descending one, which is reversed.
+// A run shorter than min_run is extended up to it with insertion sort.
+template <typename T>
+int64_t _next_run(std::vector<T>& arr, const int64_t begin, const int64_t end,
+                  const int64_t min_run) {
+  int64_t run_end = begin + 1;
+  if (run_end == end)
+    return end;
+  if (arr[run_end] < arr[begin]) {
+    ++run_end;
+    while (run_end < end && arr[run_end] < arr[run_end - 1])
+      ++run_end;
+    std::reverse(arr.begin() + begin, arr.begin() + run_end);
+  } else {
+    ++run_end;
+    while (run_end < end && !(arr[run_end] < arr[run_end - 1]))
+      ++run_end;
+  }
+  if (run_end - begin < min_run) {
+    run_end = std::min(end, begin + min_run);
+    _insertion_sort(arr, begin, run_end - 1);
   }
+  return run_end;
 }
 
+// Merges runs[i] with runs[i+1] and drops the latter. Two runs in the same
+// vector merge into the other one. A run in the other vector from its right
+// neighbour merges into the neighbour's vector, in place. Runs that are
+// already in order are not compared at all, and move only if they are in
+// different vectors, and then only the shorter one.
 template <typename T>
-void _copy(std::vector<T>& src, int64_t begin, int64_t end, std::vector<T>& dst) {
-  for (size_t i = begin; i < end; ++i) {
-    dst[i] = src[i];
+void _merge_at(std::vector<T>& arr, std::vector<T>& buffer,
+               detail::merge_run* runs, int& count, const int i) {
+  detail::merge_run& a = runs[i];
+  const detail::merge_run& b = runs[i + 1];
+  std::vector<T>& a_src = a.in_buffer ? buffer : arr;
+  std::vector<T>& b_src = b.in_buffer ? buffer : arr;
+
+  if (!(b_src[b.begin] < a_src[a.end - 1])) {
+    if (a.in_buffer != b.in_buffer) {
+      if (a.size() <= b.size()) {
+        std::move(a_src.begin() + a.begin, a_src.begin() + a.end,
+                  b_src.begin() + a.begin);
+        a.in_buffer = b.in_buffer;
+      } else {
+        std::move(b_src.begin() + b.begin, b_src.begin() + b.end,
+                  a_src.begin() + b.begin);
+      }
+    }
+  } else if (a.in_buffer == b.in_buffer) {
+    std::vector<T>& dst = a.in_buffer ? arr : buffer;
+    _merge_runs(a_src, a.begin, a.end, b_src, b.begin, b.end, dst, a.begin);
+    a.in_buffer = !a.in_buffer;
+  } else {
+    _merge_runs(a_src, a.begin, a.end, b_src, b.begin, b.end, b_src, a.begin);
+    a.in_buffer = b.in_buffer;
   }
+  a.end = b.end;
+
+  for (int j = i + 1; j + 1 < count; ++j)
+    runs[j] = runs[j + 1];
+  --count;
 }
 
+// Stable natural merge sort of arr[begin, end), with buffer[begin, end) as
+// scratch, after TimSort. The range is cut into existing runs, short ones
+// extended with insertion sort, and pending runs are merged while any of
+// them is not longer than the two above it together, which keeps merges
+// balanced and the stack short. Merges alternate between arr and the
+// buffer instead of copying back; the result is moved to arr only if it
+// ends up in the buffer.
 template <typename T>
-void _mergesort(std::vector<T>& arr, int64_t begin, int64_t end,
-                std::vector<T>& scratch) {
-  // trivially sorted since it is 1
-  if (end - begin <= 1)
+void _mergesort(std::vector<T>& arr, const int64_t begin, const int64_t end,
+                std::vector<T>& buffer) {
+  if (end - begin < 2)
     return;
-  int64_t mid = (begin + end) / 2;
-  _mergesort(arr, begin, mid, scratch);
-  _mergesort(arr, mid, end, scratch);
-  _merge(arr, begin, mid, end, scratch);
-  _copy(scratch, begin, end, arr);
+  const int64_t min_run = _min_run_length(end - begin);
+  detail::merge_run runs[kMergeSortMaxRuns];
+  int count = 0;
+
+  for (int64_t run_begin = begin; run_begin < end;) {
+    const int64_t run_end = _next_run(arr, run_begin, end, min_run);
+    runs[count].begin = run_begin;
+    runs[count].end = run_end;
+    runs[count].in_buffer = false;
+    ++count;
+    run_begin = run_end;
+
+    while (count > 1) {
+      int i = count - 2;
+      const bool too_short =
+          (i > 0 &&
+           runs[i - 1].size() <= runs[i].size() + runs[i + 1].size()) ||
+          (i > 1 &&
+           runs[i - 2].size() <= runs[i - 1].size() + runs[i].size());
+      if (too_short) {
+        if (runs[i - 1].size() < runs[i + 1].size())
+          --i;
+      } else if (runs[i].size() > runs[i + 1].size()) {
+        break;
+      }
+      _merge_at(arr, buffer, runs, count, i);
+    }
+  }
+
+  while (count > 1) {
+    int i = count - 2;
+    if (i > 0 && runs[i - 1].size() < runs[i + 1].size())
+      --i;
+    _merge_at(arr, buffer, runs, count, i);
+  }
+  if (runs[0].in_buffer)
+    std::move(buffer.begin() + begin, buffer.begin() + end,
+              arr.begin() + begin);
+}
+
+// Stable merge sort with buffer as scratch space, grown to arr's size if it
+// is smaller, so sorts that reuse a buffer allocate nothing.
+template <typename T>
+void mergesort(std::vector<T>& arr, std::vector<T>& buffer) {
+  if (buffer.size() < arr.size())
+    buffer.resize(arr.size());
+  _mergesort(arr, 0, arr.size(), buffer);
 }
 
 template <typename T>
 void mergesort(std::vector<T>& arr) {
-  if (arr.size() == 0)
-    return;
-  std::vector<T> scratch(arr.size());
-  _mergesort(arr, 0, arr.size(), scratch);
+  std::vector<T> buffer;
+  mergesort(arr, buffer);
 }
 
+// Sifts the parent'th element of the n element heap starting at
+// arr[begin] down to where it belongs.
 template <typename T>
-void _maxheapify(std::vector<T>& arr, const int64_t n, const int64_t parent) {
-  const int64_t left = 2 * parent + 1;
-  const int64_t right = 2 * parent + 2;
-  int64_t largest = parent;
+void _maxheapify(std::vector<T>& arr, const int64_t begin, const int64_t n,
+                 int64_t parent) {
+  for (;;) {
+    const int64_t left = 2 * parent + 1;
+    const int64_t right = 2 * parent + 2;
+    int64_t largest = parent;
 
-  if (left < n && arr[left] > arr[largest])
-    largest = left;
-  if (right < n && arr[right] > arr[largest])
-    largest = right;
+    if (left < n && arr[begin + largest] < arr[begin + left])
+      largest = left;
+    if (right < n && arr[begin + largest] < arr[begin + right])
+      largest = right;
 
-  if (largest != parent) {
-    std::swap(arr[largest], arr[parent]);
-    _maxheapify(arr, n, largest);
+    if (largest == parent)
+      return;
+    std::swap(arr[begin + largest], arr[begin + parent]);
+    parent = largest;
   }
 }
 
+// heapsorts arr[begin, end), the fallback of _quicksort()
 template <typename T>
-void heapsort(std::vector<T>& arr) {
-  if (arr.size() == 0)
+void _heapsort(std::vector<T>& arr, const int64_t begin, const int64_t end) {
+  const int64_t n = end - begin;
+  if (n <= 1)
     return;
   // build heap
-  for (int64_t i = (arr.size() - 1) / 2; i >= 0; --i) {
-    _maxheapify(arr, arr.size(), i);
+  for (int64_t i = (n - 2) / 2; i >= 0; --i) {
+    _maxheapify(arr, begin, n, i);
+  }
+
+  for (int64_t i = n - 1; i > 0; --i) {
+    std::swap(arr[begin], arr[begin + i]);
+    _maxheapify(arr, begin, i, 0);
   }
+}
+
+template <typename T>
+void heapsort(std::vector<T>& arr) {
+  _heapsort(arr, 0, arr.size());
+}
 
-  for (int64_t i = arr.size() - 1; i >= 0; --i) {
-    std::swap(arr[0], arr[i]);
-    _maxheapify(arr, i, 0);
+////////////////////////////////////////////////////////////////////////////////
+
+// digits of 11 bits sort 32-bit keys in 3 passes and 64-bit ones in 6,
+// with 2048 counts per pass, which still fit in L1
+static const int kRadixBits = 11;
+// buckets of at most this many strings are insertion sorted
+static const int64_t kRadixStringInsertionThreshold = 32;
+
+namespace detail {
+
+// Maps keys to unsigned integers of the same size and order, so that
+// radix_sort() can sort them by digits.
+template <typename Key, typename Enable = void>
+struct radix_traits;
+
+template <typename Key>
+struct radix_traits<
+    Key, typename std::enable_if<std::is_integral<Key>::value &&
+                                 !std::is_same<Key, bool>::value>::type> {
+  typedef typename std::make_unsigned<Key>::type bits_type;
+
+  static bits_type to_bits(const Key key) {
+    // flipping the sign bit puts the negative numbers first
+    const bits_type sign =
+        std::is_signed<Key>::value
+            ? static_cast<bits_type>(bits_type(1) << (sizeof(Key) * 8 - 1))
+            : bits_type(0);
+    return static_cast<bits_type>(static_cast<bits_type>(key) ^ sign);
+  }
+};
+
+// IEEE floats order like sign-magnitude integers: a negative number has all
+// its bits flipped, so larger magnitudes come first, and a positive one just
+// its sign bit. -0.0 sorts before 0.0 and NaNs go to the ends.
+template <>
+struct radix_traits<float> {
+  typedef uint32_t bits_type;
+
+  static bits_type to_bits(const float key) {
+    uint32_t bits;
+    std::memcpy(&bits, &key, sizeof(bits));
+    return bits ^ (-(bits >> 31) | 0x80000000u);
+  }
+};
+
+template <>
+struct radix_traits<double> {
+  typedef uint64_t bits_type;
+
+  static bits_type to_bits(const double key) {
+    uint64_t bits;
+    std::memcpy(&bits, &key, sizeof(bits));
+    return bits ^ (-(bits >> 63) | 0x8000000000000000ull);
+  }
+};
+
+struct radix_identity {
+  template <typename T>
+  const T& operator()(const T& value) const {
+    return value;
+  }
+};
+
+}
+
+// Stable LSD radix sort of arr by key_of(element), which has to return an
+// integer, float or double. All the digit counts come from one read of the
+// keys, which also notices keys that are already sorted, and a pass is
+// skipped when every key has the same digit there, so small keys in a wide
+// type cost few passes. Each pass moves the elements into a buffer of arr's
+// size, and the two are swapped instead of copied back.
+template <typename T, typename KeyOf>
+void radix_sort(std::vector<T>& arr, KeyOf key_of) {
+  typedef typename std::decay<decltype(key_of(arr[0]))>::type Key;
+  typedef detail::radix_traits<Key> traits;
+  typedef typename traits::bits_type Bits;
+
+  const size_t n = arr.size();
+  if (n < 2)
+    return;
+
+  const int key_bits = sizeof(Bits) * 8;
+  const int digit_bits = key_bits <= 16 ? 8 : kRadixBits;
+  const int passes = (key_bits + digit_bits - 1) / digit_bits;
+  const size_t buckets = size_t(1) << digit_bits;
+  const Bits mask = static_cast<Bits>(buckets - 1);
+
+  std::vector<size_t> counts(passes * buckets);
+  bool sorted = true;
+  Bits previous = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const Bits bits = traits::to_bits(key_of(arr[i]));
+    for (int pass = 0; pass < passes; ++pass)
+      ++counts[pass * buckets + ((bits >> (pass * digit_bits)) & mask)];
+    sorted &= !(bits < previous);
+    previous = bits;
+  }
+  if (sorted)
+    return;
+
+  std::vector<T> buffer;
+  for (int pass = 0; pass < passes; ++pass) {
+    const int shift = pass * digit_bits;
+    size_t* const count = &counts[pass * buckets];
+    // the digit of any one key tells if they all share it
+    if (count[(traits::to_bits(key_of(arr[0])) >> shift) & mask] == n)
+      continue;
+
+    size_t offset = 0;
+    for (size_t digit = 0; digit < buckets; ++digit) {
+      const size_t c = count[digit];
+      count[digit] = offset;
+      offset += c;
+    }
+    if (buffer.empty())
+      buffer.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      const size_t digit = (traits::to_bits(key_of(arr[i])) >> shift) & mask;
+      buffer[count[digit]++] = std::move(arr[i]);
+    }
+    arr.swap(buffer);
+  }
+}
+
+template <typename T>
+void radix_sort(std::vector<T>& arr) {
+  radix_sort(arr, detail::radix_identity());
+}
+
+// whether a < b, for strings that share their first depth characters
+inline bool _suffix_less(const std::string& a, const std::string& b,
+                         const size_t depth) {
+  return a.compare(depth, std::string::npos, b, depth, std::string::npos) < 0;
+}
+
+// MSD radix sort of strings, in the order of operator<. Each range is
+// bucketed by its character at one depth, the bucket of strings that end
+// there is done, and the other buckets are pushed to be sorted by the next
+// character. Small buckets are insertion sorted from the current depth on,
+// and ranges where every string has the same character go straight to the
+// next one. Stable.
+inline void radix_sort(std::vector<std::string>& arr) {
+  const size_t n = arr.size();
+  if (n < 2)
+    return;
+
+  struct range {
+    size_t begin;
+    size_t end;
+    size_t depth;
+  };
+  std::vector<range> pending;
+  pending.push_back(range{0, n, 0});
+  std::vector<std::string> buffer;
+  // 0 for a string that ends before depth, or 1 + its character
+  std::vector<uint16_t> digits(n);
+
+  while (!pending.empty()) {
+    const range r = pending.back();
+    pending.pop_back();
+
+    if (static_cast<int64_t>(r.end - r.begin) <=
+        kRadixStringInsertionThreshold) {
+      for (size_t i = r.begin + 1; i < r.end; ++i) {
+        if (!_suffix_less(arr[i], arr[i - 1], r.depth))
+          continue;
+        std::string value = std::move(arr[i]);
+        size_t j = i;
+        do {
+          arr[j] = std::move(arr[j - 1]);
+          --j;
+        } while (j > r.begin && _suffix_less(value, arr[j - 1], r.depth));
+        arr[j] = std::move(value);
+      }
+      continue;
+    }
+
+    size_t count[257] = {0};
+    for (size_t i = r.begin; i < r.end; ++i) {
+      const std::string& s = arr[i];
+      const uint16_t digit =
+          r.depth < s.size()
+              ? static_cast<uint16_t>(
+                    1 + static_cast<unsigned char>(s[r.depth]))
+              : 0;
+      digits[i] = digit;
+      ++count[digit];
+    }
+
+    const uint16_t first_digit = digits[r.begin];
+    if (count[first_digit] == r.end - r.begin) {
+      if (first_digit != 0)
+        pending.push_back(range{r.begin, r.end, r.depth + 1});
+      continue;
+    }
+
+    size_t offsets[257];
+    size_t offset = r.begin;
+    for (int digit = 0; digit < 257; ++digit) {
+      offsets[digit] = offset;
+      offset += count[digit];
+    }
+    if (buffer.empty())
+      buffer.resize(n);
+    for (size_t i = r.begin; i < r.end; ++i)
+      buffer[offsets[digits[i]]++] = std::move(arr[i]);
+    for (size_t i = r.begin; i < r.end; ++i)
+      arr[i] = std::move(buffer[i]);
+
+    // offsets[digit] now ends the digit's bucket
+    for (int digit = 1; digit < 257; ++digit) {
+      if (count[digit] > 1)
+        pending.push_back(
+            range{offsets[digit] - count[digit], offsets[digit], r.depth + 1});
+    }
   }
 }
 
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define KOKOPUFFS_HAS_MMAP
+#endif
+
+namespace kokopuffs {
+
+// Bump allocator for maps that are built, used and thrown away together, like
+// per-request scratch maps. Memory is handed out from large blocks and only
+// given back all at once by reset() or the destructor, so deallocating is
+// free, but tables left behind by resizes stay allocated until then.
+class arena {
+ public:
+  explicit arena(size_t block_size = 1 << 20)
+      : block_size_(block_size), cursor_(nullptr), end_(nullptr) {}
+
+  ~arena() {
+    reset();
+  }
+
+  void* allocate(size_t n, size_t alignment) {
+    uintptr_t p = (reinterpret_cast<uintptr_t>(cursor_) + alignment - 1) &
+                  ~(uintptr_t)(alignment - 1);
+    if (cursor_ == nullptr || p + n > reinterpret_cast<uintptr_t>(end_)) {
+      // large requests get a block of their own, so the current one is kept
+      const size_t size = std::max(block_size_, n + alignment);
+      char* block = static_cast<char*>(std::malloc(size));
+      if (block == nullptr)
+        throw std::bad_alloc();
+      blocks_.push_back(block);
+      p = (reinterpret_cast<uintptr_t>(block) + alignment - 1) &
+          ~(uintptr_t)(alignment - 1);
+      if (size == block_size_ || cursor_ == nullptr) {
+        cursor_ = reinterpret_cast<char*>(p + n);
+        end_ = block + size;
+      }
+      return reinterpret_cast<void*>(p);
+    }
+    cursor_ = reinterpret_cast<char*>(p + n);
+    return reinterpret_cast<void*>(p);
+  }
+
+  // Frees every block. Anything still allocated from the arena is gone.
+  void reset() {
+    for (size_t i = 0; i < blocks_.size(); ++i)
+      std::free(blocks_[i]);
+    blocks_.clear();
+    cursor_ = nullptr;
+    end_ = nullptr;
+  }
+
+  size_t block_count() const {
+    return blocks_.size();
+  }
+
+ private:
+  arena(const arena&);
+  arena& operator=(const arena&);
+
+  size_t block_size_;
+  char* cursor_;
+  char* end_;
+  std::vector<char*> blocks_;
+};
+
+// Standard allocator on top of an arena, which must outlive every container
+// using it.
+template <typename T>
+class arena_allocator {
+ public:
+  typedef T value_type;
+
+  explicit arena_allocator(arena& a) : arena_(&a) {}
+
+  template <typename U>
+  arena_allocator(const arena_allocator<U>& other) : arena_(other.arena_) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, size_t) {}
+
+  template <typename U>
+  bool operator==(const arena_allocator<U>& other) const {
+    return arena_ == other.arena_;
+  }
+
+  template <typename U>
+  bool operator!=(const arena_allocator<U>& other) const {
+    return arena_ != other.arena_;
+  }
+
+ private:
+  template <typename U>
+  friend class arena_allocator;
+
+  arena* arena_;
+};
+
+namespace detail {
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+inline size_t round_to_huge_page(size_t n) {
+  return (n + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+// Tries explicit huge pages first, which only works if the system has some
+// reserved, then asks for transparent huge pages on an aligned mapping.
+inline void* huge_page_alloc(size_t n) {
+#ifdef KOKOPUFFS_HAS_MMAP
+  if (n >= kHugePageSize) {
+    const size_t size = round_to_huge_page(n);
+#ifdef MAP_HUGETLB
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+      return p;
+#endif
+    // over-allocate so the mapping can be trimmed to a huge page boundary
+    char* raw = static_cast<char*>(
+        ::mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (raw == MAP_FAILED)
+      throw std::bad_alloc();
+    char* aligned = reinterpret_cast<char*>(round_to_huge_page(
+        reinterpret_cast<uintptr_t>(raw)));
+    if (aligned != raw)
+      ::munmap(raw, aligned - raw);
+    ::munmap(aligned + size, kHugePageSize - (aligned - raw));
+#ifdef MADV_HUGEPAGE
+    ::madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+  }
+#endif
+  return ::operator new(n);
+}
+
+inline void huge_page_free(void* p, size_t n) {
+#ifdef KOKOPUFFS_HAS_MMAP
+  if (n >= kHugePageSize) {
+    ::munmap(p, round_to_huge_page(n));
+    return;
+  }
+#endif
+  ::operator delete(p);
+}
+
+// Memory aligned to a cache line, freed with cache_line_free(). The pointer
+// operator new returned is kept just in front of the block.
+inline void* cache_line_alloc(size_t n) {
+  char* raw = static_cast<char*>(::operator new(n + 64 + sizeof(void*)));
+  char* block = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + 63) &
+      ~(uintptr_t)63);
+  reinterpret_cast<void**>(block)[-1] = raw;
+  return block;
+}
+
+inline void cache_line_free(void* block) {
+  if (block != nullptr)
+    ::operator delete(static_cast<void**>(block)[-1]);
+}
+
+// Value type of the maps behind kokopuffs::set and btree_set. Being empty
+// and trivial, it takes no room in their slots and leaves.
+struct set_value {};
+
+}  // namespace detail
+
+// Backs allocations of 2MB and up with huge pages where the platform has
+// them, which cuts TLB misses when probing multi-GB tables. Smaller ones
+// go through operator new.
+template <typename T>
+class huge_page_allocator {
+ public:
+  typedef T value_type;
+
+  huge_page_allocator() {}
+
+  template <typename U>
+  huge_page_allocator(const huge_page_allocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(detail::huge_page_alloc(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    detail::huge_page_free(p, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const huge_page_allocator<U>&) const {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const huge_page_allocator<U>&) const {
+    return false;
+  }
+};
+
+}
@@ -0,0 +1,1287 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+#include "allocator.hpp"
+
+namespace kokopuffs {
+
+namespace detail {
+
+inline uint32_t popcount(uint32_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return __popcnt(x);
+#else
+  return __builtin_popcount(x);
+#endif
+}
+
+// Position of key among the count sorted keys of a B-tree node. lower() is
+// how many of them are less than key, upper() how many are not greater.
+// This is a binary search whose only branch is on the remaining length, so
+// the compares become conditional moves instead of mispredicted jumps.
+template <typename Key, typename Compare, typename Enable = void>
+struct node_search {
+  static size_t lower(const Compare& comp, const Key* keys, size_t count,
+                      const Key& key) {
+    if (count == 0)
+      return 0;
+    const Key* base = keys;
+    while (count > 1) {
+      const size_t half = count / 2;
+      base = comp(base[half], key) ? base + half : base;
+      count -= half;
+    }
+    return (base - keys) + comp(*base, key);
+  }
+
+  static size_t upper(const Compare& comp, const Key* keys, size_t count,
+                      const Key& key) {
+    if (count == 0)
+      return 0;
+    const Key* base = keys;
+    while (count > 1) {
+      const size_t half = count / 2;
+      base = comp(key, base[half]) ? base : base + half;
+      count -= half;
+    }
+    return (base - keys) + !comp(key, *base);
+  }
+};
+
+// Compares a vector of integer keys at once against one key. less() and
+// greater() return a bitmask with bit i set if keys[i] is less or greater.
+// Unsigned keys get their top bit flipped, since there are only signed
+// compares.
+template <typename Key, size_t KeySize = sizeof(Key)>
+struct key_lanes {
+  static const bool kEnabled = false;
+};
+
+#if defined(__AVX2__)
+template <typename Key>
+struct key_lanes<Key, 4> {
+  typedef typename std::make_unsigned<Key>::type unsigned_key;
+
+  static const bool kEnabled = true;
+  static const size_t kWidth = 8;
+
+  static __m256i _load(const Key* keys) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+    return std::is_signed<Key>::value
+               ? v
+               : _mm256_xor_si256(v, _mm256_set1_epi32(INT32_MIN));
+  }
+
+  static __m256i _broadcast(const Key key) {
+    const unsigned_key bits = static_cast<unsigned_key>(key);
+    return _mm256_set1_epi32(static_cast<int32_t>(
+        std::is_signed<Key>::value ? bits : bits ^ (unsigned_key(1) << 31)));
+  }
+
+  static uint32_t _movemask(const __m256i v) {
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(v)));
+  }
+
+  static uint32_t less(const Key* keys, const Key key) {
+    return _movemask(_mm256_cmpgt_epi32(_broadcast(key), _load(keys)));
+  }
+
+  static uint32_t greater(const Key* keys, const Key key) {
+    return _movemask(_mm256_cmpgt_epi32(_load(keys), _broadcast(key)));
+  }
+};
+
+template <typename Key>
+struct key_lanes<Key, 8> {
+  typedef typename std::make_unsigned<Key>::type unsigned_key;
+
+  static const bool kEnabled = true;
+  static const size_t kWidth = 4;
+
+  static __m256i _load(const Key* keys) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+    return std::is_signed<Key>::value
+               ? v
+               : _mm256_xor_si256(v, _mm256_set1_epi64x(INT64_MIN));
+  }
+
+  static __m256i _broadcast(const Key key) {
+    const unsigned_key bits = static_cast<unsigned_key>(key);
+    return _mm256_set1_epi64x(static_cast<int64_t>(
+        std::is_signed<Key>::value ? bits : bits ^ (unsigned_key(1) << 63)));
+  }
+
+  static uint32_t _movemask(const __m256i v) {
+    return static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(v)));
+  }
+
+  static uint32_t less(const Key* keys, const Key key) {
+    return _movemask(_mm256_cmpgt_epi64(_broadcast(key), _load(keys)));
+  }
+
+  static uint32_t greater(const Key* keys, const Key key) {
+    return _movemask(_mm256_cmpgt_epi64(_load(keys), _broadcast(key)));
+  }
+};
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+// SSE2 has no 64-bit compare, so only 32-bit keys are done this way
+template <typename Key>
+struct key_lanes<Key, 4> {
+  typedef typename std::make_unsigned<Key>::type unsigned_key;
+
+  static const bool kEnabled = true;
+  static const size_t kWidth = 4;
+
+  static __m128i _load(const Key* keys) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+    return std::is_signed<Key>::value
+               ? v
+               : _mm_xor_si128(v, _mm_set1_epi32(INT32_MIN));
+  }
+
+  static __m128i _broadcast(const Key key) {
+    const unsigned_key bits = static_cast<unsigned_key>(key);
+    return _mm_set1_epi32(static_cast<int32_t>(
+        std::is_signed<Key>::value ? bits : bits ^ (unsigned_key(1) << 31)));
+  }
+
+  static uint32_t _movemask(const __m128i v) {
+    return static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(v)));
+  }
+
+  static uint32_t less(const Key* keys, const Key key) {
+    return _movemask(_mm_cmpgt_epi32(_broadcast(key), _load(keys)));
+  }
+
+  static uint32_t greater(const Key* keys, const Key key) {
+    return _movemask(_mm_cmpgt_epi32(_load(keys), _broadcast(key)));
+  }
+};
+#endif
+
+template <typename Key, typename Compare>
+struct use_key_lanes {
+  static const bool value = std::is_integral<Key>::value &&
+                            std::is_same<Compare, std::less<Key> >::value &&
+                            key_lanes<Key>::kEnabled;
+};
+
+// With integer keys and std::less, a node is searched by counting the keys
+// on either side of key a vector at a time. Nodes always have room for a
+// whole number of vectors, so the last one may read past count but never
+// past the node; those lanes are masked off.
+template <typename Key, typename Compare>
+struct node_search<Key, Compare, typename std::enable_if<
+                                     use_key_lanes<Key, Compare>::value>::type> {
+  typedef key_lanes<Key> lanes;
+
+  static uint32_t _valid(const size_t count, const size_t i) {
+    return count - i >= lanes::kWidth ? ~0u : (1u << (count - i)) - 1;
+  }
+
+  static size_t lower(const Compare&, const Key* keys, const size_t count,
+                      const Key& key) {
+    size_t less = 0;
+    for (size_t i = 0; i < count; i += lanes::kWidth)
+      less += popcount(lanes::less(keys + i, key) & _valid(count, i));
+    return less;
+  }
+
+  static size_t upper(const Compare&, const Key* keys, const size_t count,
+                      const Key& key) {
+    size_t greater = 0;
+    for (size_t i = 0; i < count; i += lanes::kWidth)
+      greater += popcount(lanes::greater(keys + i, key) & _valid(count, i));
+    return count - greater;
+  }
+};
+
+// Values of a leaf. Empty, trivial values like set_value share one static
+// instead of taking a byte per slot.
+template <typename Value, size_t Slots,
+          bool Elided = std::is_empty<Value>::value &&
+                        std::is_trivial<Value>::value>
+struct node_values {
+  Value& operator[](size_t i) {
+    return values_[i];
+  }
+
+  const Value& operator[](size_t i) const {
+    return values_[i];
+  }
+
+  Value values_[Slots];
+};
+
+template <typename Value, size_t Slots>
+struct node_values<Value, Slots, true> {
+  Value& operator[](size_t) {
+    return value_;
+  }
+
+  const Value& operator[](size_t) const {
+    return value_;
+  }
+
+  static Value value_;
+};
+
+template <typename Value, size_t Slots>
+Value node_values<Value, Slots, true>::value_;
+
+// Inner nodes hold count separators and count + 1 children, where child i
+// has the keys from separator i - 1 up to but not including separator i.
+template <typename Key, size_t Slots>
+struct btree_node {
+  uint32_t count;
+  bool leaf;
+  Key keys[Slots];
+};
+
+template <typename Key, typename Value, size_t Slots>
+struct btree_leaf : btree_node<Key, Slots> {
+  node_values<Value, Slots> values;
+  btree_leaf* prev;
+  btree_leaf* next;
+};
+
+template <typename Key, size_t Slots>
+struct btree_inner : btree_node<Key, Slots> {
+  btree_node<Key, Slots>* children[Slots + 1];
+};
+
+}  // namespace detail
+
+// Ordered map kept as a B+ tree, the cache friendly alternative to std::map
+// for range scans and lower_bound(). Every node is a few cache lines of keys
+// searched without branches, or with SIMD compares for integer keys under
+// std::less, and entries only live in the leaves, which are linked for
+// iteration. A leaf stores its keys and values in two arrays, so an entry
+// costs about sizeof(Key) + sizeof(Value) over the node fill, instead of
+// std::map's three pointers and a color per entry.
+//
+// Keys and values must be default constructible. Inserting and erasing
+// moves entries between nodes, so both invalidate all iterators.
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class btree_map {
+ public:
+  // keys per node, at least 256 bytes and at least 8 of them
+  static const size_t kNodeSlots =
+      (256 + sizeof(Key) - 1) / sizeof(Key) < 8
+          ? 8
+          : (256 + sizeof(Key) - 1) / sizeof(Key);
+
+ private:
+  typedef detail::btree_node<Key, kNodeSlots> node_type;
+  typedef detail::btree_leaf<Key, Value, kNodeSlots> leaf_type;
+  typedef detail::btree_inner<Key, kNodeSlots> inner_type;
+  typedef detail::node_search<Key, Compare> search;
+
+ public:
+  // Bidirectional iterator over the entries in key order. Dereferencing it
+  // gives a key and value pair of references, so it->key and it->value work
+  // like with kokopuffs::map.
+  template <bool IsConst>
+  class basic_iterator {
+   public:
+    struct reference {
+      const Key& key;
+      typename std::conditional<IsConst, const Value&, Value&>::type value;
+    };
+
+    struct pointer {
+      const reference* operator->() const {
+        return &ref;
+      }
+
+      reference ref;
+    };
+
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef reference value_type;
+    typedef std::ptrdiff_t difference_type;
+
+    basic_iterator() : tree_(nullptr), leaf_(nullptr), index_(0) {}
+
+    // lets an iterator convert to a const_iterator; a template, so copying
+    // is left to the implicit members
+    template <bool OtherConst,
+              typename = typename std::enable_if<IsConst && !OtherConst>::type>
+    basic_iterator(const basic_iterator<OtherConst>& other)
+        : tree_(other.tree_), leaf_(other.leaf_), index_(other.index_) {}
+
+    reference operator*() const {
+      reference ref = {leaf_->keys[index_], leaf_->values[index_]};
+      return ref;
+    }
+
+    pointer operator->() const {
+      pointer p = {**this};
+      return p;
+    }
+
+    basic_iterator& operator++() {
+      if (++index_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        index_ = 0;
+      }
+      return *this;
+    }
+
+    basic_iterator operator++(int) {
+      basic_iterator old(*this);
+      ++*this;
+      return old;
+    }
+
+    // end() steps back to the last entry
+    basic_iterator& operator--() {
+      if (leaf_ == nullptr) {
+        leaf_ = tree_->last_leaf_;
+        index_ = leaf_->count - 1;
+      } else if (index_ == 0) {
+        leaf_ = leaf_->prev;
+        index_ = leaf_->count - 1;
+      } else {
+        --index_;
+      }
+      return *this;
+    }
+
+    basic_iterator operator--(int) {
+      basic_iterator old(*this);
+      --*this;
+      return old;
+    }
+
+    friend bool operator==(const basic_iterator& lhs,
+                           const basic_iterator& rhs) {
+      return lhs.leaf_ == rhs.leaf_ && lhs.index_ == rhs.index_;
+    }
+
+    friend bool operator!=(const basic_iterator& lhs,
+                           const basic_iterator& rhs) {
+      return !(lhs == rhs);
+    }
+
+   private:
+    friend class btree_map;
+    friend class basic_iterator<!IsConst>;
+
+    // past the end of a leaf is the start of the next one
+    basic_iterator(const btree_map* tree, leaf_type* leaf, size_t index)
+        : tree_(tree), leaf_(leaf), index_(index) {
+      if (leaf_ != nullptr && index_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        index_ = 0;
+      }
+    }
+
+    const btree_map* tree_;
+    leaf_type* leaf_;
+    size_t index_;
+  };
+
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  explicit btree_map(const Compare& comp = Compare())
+      : comp_(comp),
+        root_(nullptr),
+        height_(0),
+        size_(0),
+        first_leaf_(nullptr),
+        last_leaf_(nullptr),
+        leaf_count_(0),
+        inner_count_(0) {}
+
+  btree_map(const btree_map& other)
+      : comp_(other.comp_),
+        root_(nullptr),
+        height_(0),
+        size_(0),
+        first_leaf_(nullptr),
+        last_leaf_(nullptr),
+        leaf_count_(0),
+        inner_count_(0) {
+    leaf_type* leaf = nullptr;
+    for (const_iterator it = other.begin(); it != other.end(); ++it)
+      _append(leaf, it->key, it->value);
+    _finish_bulk_load(leaf);
+  }
+
+  btree_map& operator=(const btree_map& other) {
+    if (&other != this) {
+      btree_map copy(other);
+      swap(copy);
+    }
+    return *this;
+  }
+
+  btree_map(btree_map&& other)
+      : comp_(other.comp_),
+        root_(nullptr),
+        height_(0),
+        size_(0),
+        first_leaf_(nullptr),
+        last_leaf_(nullptr),
+        leaf_count_(0),
+        inner_count_(0) {
+    swap(other);
+  }
+
+  btree_map& operator=(btree_map&& other) {
+    swap(other);
+    return *this;
+  }
+
+  ~btree_map() {
+    clear();
+  }
+
+  void swap(btree_map& other) {
+    std::swap(comp_, other.comp_);
+    std::swap(root_, other.root_);
+    std::swap(height_, other.height_);
+    std::swap(size_, other.size_);
+    std::swap(first_leaf_, other.first_leaf_);
+    std::swap(last_leaf_, other.last_leaf_);
+    std::swap(leaf_count_, other.leaf_count_);
+    std::swap(inner_count_, other.inner_count_);
+  }
+
+  // Replaces the contents with the (first, second) pairs of a range sorted
+  // by strictly increasing key, filling the leaves and building each level
+  // above them in one pass instead of inserting one by one. Throws
+  // std::invalid_argument, leaving the map empty, if the keys are not, and
+  // leaves it empty as well if copying an entry or allocating throws.
+  template <typename InputIt>
+  void assign_sorted(InputIt first, InputIt last) {
+    clear();
+    leaf_type* leaf = nullptr;
+    try {
+      for (; first != last; ++first) {
+        if (leaf != nullptr &&
+            !comp_(leaf->keys[leaf->count - 1], first->first))
+          throw std::invalid_argument(
+              "kokopuffs::btree_map.assign_sorted() keys not strictly "
+              "increasing");
+        _append(leaf, first->first, first->second);
+      }
+      _finish_bulk_load(leaf);
+    } catch (...) {
+      _discard_bulk_load();
+      throw;
+    }
+  }
+
+  Value& operator[](const Key& key) {
+    return try_emplace(key).first->value;
+  }
+
+  Value& operator[](Key&& key) {
+    return try_emplace(std::move(key)).first->value;
+  }
+
+  // Constructs the value from args if key is not in the map yet.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    return _try_emplace(key, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+    return _try_emplace(std::move(key), std::forward<Args>(args)...);
+  }
+
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+    std::pair<iterator, bool> result = try_emplace(key, std::forward<M>(obj));
+    if (!result.second)
+      result.first->value = std::forward<M>(obj);
+    return result;
+  }
+
+  size_t erase(const Key& key) {
+    if (root_ == nullptr)
+      return 0;
+    path_entry path[kMaxHeight];
+    leaf_type* leaf = _descend(key, path);
+    const size_t pos = search::lower(comp_, leaf->keys, leaf->count, key);
+    if (pos == leaf->count || comp_(key, leaf->keys[pos]))
+      return 0;
+
+    _leaf_remove(leaf, pos);
+    --size_;
+    if (height_ == 1) {
+      if (leaf->count == 0)
+        clear();
+      return 1;
+    }
+    if (leaf->count < kMinSlots)
+      _rebalance(path, height_ - 1);
+    return 1;
+  }
+
+  void clear() {
+    if (root_ != nullptr)
+      _destroy(root_, height_);
+    root_ = nullptr;
+    height_ = 0;
+    size_ = 0;
+    first_leaf_ = nullptr;
+    last_leaf_ = nullptr;
+    leaf_count_ = 0;
+    inner_count_ = 0;
+  }
+
+  iterator begin() {
+    return iterator(this, first_leaf_, 0);
+  }
+
+  const_iterator begin() const {
+    return const_iterator(this, first_leaf_, 0);
+  }
+
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  iterator end() {
+    return iterator(this, nullptr, 0);
+  }
+
+  const_iterator end() const {
+    return const_iterator(this, nullptr, 0);
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+  iterator find(const Key& key) {
+    return _find(key);
+  }
+
+  const_iterator find(const Key& key) const {
+    return _find(key);
+  }
+
+  Value& at(const Key& key) {
+    const iterator it = find(key);
+    if (it == end())
+      throw std::out_of_range("kokopuffs::btree_map.at() key not found");
+    return it->value;
+  }
+
+  const Value& at(const Key& key) const {
+    const const_iterator it = find(key);
+    if (it == end())
+      throw std::out_of_range("kokopuffs::btree_map.at() key not found");
+    return it->value;
+  }
+
+  bool contains(const Key& key) const {
+    return _find(key) != end();
+  }
+
+  size_t count(const Key& key) const {
+    return contains(key) ? 1 : 0;
+  }
+
+  // First entry whose key is not less than key.
+  iterator lower_bound(const Key& key) {
+    return _lower_bound(key);
+  }
+
+  const_iterator lower_bound(const Key& key) const {
+    return _lower_bound(key);
+  }
+
+  // First entry whose key is greater than key.
+  iterator upper_bound(const Key& key) {
+    return _upper_bound(key);
+  }
+
+  const_iterator upper_bound(const Key& key) const {
+    return _upper_bound(key);
+  }
+
+  size_t size() const noexcept {
+    return size_;
+  }
+
+  bool empty() const noexcept {
+    return size_ == 0;
+  }
+
+  // The map and its nodes, including what aligning each node to a cache
+  // line costs, but not memory the keys and values own.
+  size_t bytes_used() const noexcept {
+    const size_t overhead = 64 + sizeof(void*);
+    return sizeof(*this) + leaf_count_ * (sizeof(leaf_type) + overhead) +
+           inner_count_ * (sizeof(inner_type) + overhead);
+  }
+
+  Compare key_comp() const {
+    return comp_;
+  }
+
+ private:
+  // a node that drops below this many keys takes some from a sibling or
+  // merges with one
+  static const size_t kMinSlots = kNodeSlots / 2;
+  // every node below the root but those along the right edge is at least
+  // half full, so this is never reached
+  static const size_t kMaxHeight = 64;
+
+  // an inner node passed on the way down, and the child taken
+  struct path_entry {
+    inner_type* node;
+    size_t index;
+  };
+
+  leaf_type* _new_leaf() {
+    ++leaf_count_;
+    leaf_type* leaf =
+        new (detail::cache_line_alloc(sizeof(leaf_type))) leaf_type();
+    leaf->leaf = true;
+    return leaf;
+  }
+
+  inner_type* _new_inner() {
+    ++inner_count_;
+    return new (detail::cache_line_alloc(sizeof(inner_type))) inner_type();
+  }
+
+  void _free_leaf(leaf_type* leaf) {
+    --leaf_count_;
+    leaf->~leaf_type();
+    detail::cache_line_free(leaf);
+  }
+
+  void _free_inner(inner_type* inner) {
+    --inner_count_;
+    inner->~inner_type();
+    detail::cache_line_free(inner);
+  }
+
+  // frees a node and the levels - 1 levels below it
+  void _destroy(node_type* node, const size_t levels) {
+    if (levels == 1) {
+      _free_leaf(static_cast<leaf_type*>(node));
+      return;
+    }
+    inner_type* inner = static_cast<inner_type*>(node);
+    for (size_t i = 0; i <= inner->count; ++i)
+      _destroy(inner->children[i], levels - 1);
+    _free_inner(inner);
+  }
+
+  // Walks down to the leaf that would hold key, recording the way in path
+  // if it is given.
+  leaf_type* _descend(const Key& key, path_entry* path) const {
+    node_type* node = root_;
+    for (size_t level = 0; level + 1 < height_; ++level) {
+      inner_type* inner = static_cast<inner_type*>(node);
+      const size_t i = search::upper(comp_, inner->keys, inner->count, key);
+      if (path != nullptr) {
+        path[level].node = inner;
+        path[level].index = i;
+      }
+      node = inner->children[i];
+    }
+    return static_cast<leaf_type*>(node);
+  }
+
+  iterator _find(const Key& key) const {
+    if (root_ == nullptr)
+      return iterator(this, nullptr, 0);
+    leaf_type* leaf = _descend(key, nullptr);
+    const size_t pos = search::lower(comp_, leaf->keys, leaf->count, key);
+    if (pos == leaf->count || comp_(key, leaf->keys[pos]))
+      return iterator(this, nullptr, 0);
+    return iterator(this, leaf, pos);
+  }
+
+  // Keys equal to a separator are in the child to its right, so the leaf
+  // _descend() finds has every key before the bound, or ends right before
+  // it.
+  iterator _lower_bound(const Key& key) const {
+    if (root_ == nullptr)
+      return iterator(this, nullptr, 0);
+    leaf_type* leaf = _descend(key, nullptr);
+    return iterator(this, leaf,
+                    search::lower(comp_, leaf->keys, leaf->count, key));
+  }
+
+  iterator _upper_bound(const Key& key) const {
+    if (root_ == nullptr)
+      return iterator(this, nullptr, 0);
+    leaf_type* leaf = _descend(key, nullptr);
+    return iterator(this, leaf,
+                    search::upper(comp_, leaf->keys, leaf->count, key));
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> _try_emplace(K&& key, Args&&... args) {
+    if (root_ == nullptr) {
+      first_leaf_ = last_leaf_ = _new_leaf();
+      root_ = first_leaf_;
+      height_ = 1;
+    }
+    path_entry path[kMaxHeight];
+    leaf_type* leaf = _descend(key, path);
+    size_t pos = search::lower(comp_, leaf->keys, leaf->count, key);
+    if (pos < leaf->count && !comp_(key, leaf->keys[pos]))
+      return std::make_pair(iterator(this, leaf, pos), false);
+
+    Value value(std::forward<Args>(args)...);
+    leaf_type* right = nullptr;
+    // A key past the end of the last leaf leaves it full and starts a new
+    // one, so keys inserted in order fill every node instead of half.
+    const bool append = pos == kNodeSlots && leaf->next == nullptr;
+    if (leaf->count == kNodeSlots) {
+      right = _split_leaf(leaf, append ? kNodeSlots : kNodeSlots / 2);
+      // the key goes left if it sorts before right's first key, and into
+      // the empty right leaf when appending
+      if (pos > leaf->count || append) {
+        pos -= leaf->count;
+        leaf = right;
+      }
+    }
+
+    std::move_backward(leaf->keys + pos, leaf->keys + leaf->count,
+                       leaf->keys + leaf->count + 1);
+    for (size_t i = leaf->count; i > pos; --i)
+      leaf->values[i] = std::move(leaf->values[i - 1]);
+    leaf->keys[pos] = std::forward<K>(key);
+    leaf->values[pos] = std::move(value);
+    ++leaf->count;
+    ++size_;
+    if (right != nullptr)
+      _insert_separator(path, height_ - 1, right->keys[0], right, append);
+    return std::make_pair(iterator(this, leaf, pos), true);
+  }
+
+  // Moves the entries of a full leaf from mid on into a new one linked in
+  // after it.
+  leaf_type* _split_leaf(leaf_type* leaf, const size_t mid) {
+    leaf_type* right = _new_leaf();
+    for (size_t i = mid; i < kNodeSlots; ++i) {
+      right->keys[i - mid] = std::move(leaf->keys[i]);
+      right->values[i - mid] = std::move(leaf->values[i]);
+    }
+    right->count = kNodeSlots - mid;
+    leaf->count = mid;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != nullptr)
+      leaf->next->prev = right;
+    else
+      last_leaf_ = right;
+    leaf->next = right;
+    return right;
+  }
+
+  // Adds separator and the new node right after the child path[depth - 1]
+  // went down, splitting full inner nodes on the way up. When appending,
+  // path runs down the right edge of the tree and a full node only gives
+  // up its last child.
+  void _insert_separator(path_entry* path, size_t depth, Key separator,
+                         node_type* right, const bool append) {
+    for (;;) {
+      if (depth == 0) {
+        inner_type* root = _new_inner();
+        root->count = 1;
+        root->keys[0] = std::move(separator);
+        root->children[0] = root_;
+        root->children[1] = right;
+        root_ = root;
+        ++height_;
+        return;
+      }
+
+      inner_type* parent = path[depth - 1].node;
+      const size_t pos = path[depth - 1].index;
+      if (parent->count < kNodeSlots) {
+        _inner_insert(parent, pos, std::move(separator), right);
+        return;
+      }
+
+      // the middle separator moves up, the ones after it to the new node
+      inner_type* sibling = _new_inner();
+      const size_t mid = append ? kNodeSlots - 1 : kNodeSlots / 2;
+      Key up = std::move(parent->keys[mid]);
+      for (size_t i = mid + 1; i < kNodeSlots; ++i)
+        sibling->keys[i - mid - 1] = std::move(parent->keys[i]);
+      for (size_t i = mid + 1; i <= kNodeSlots; ++i)
+        sibling->children[i - mid - 1] = parent->children[i];
+      sibling->count = kNodeSlots - mid - 1;
+      parent->count = mid;
+      if (pos <= mid)
+        _inner_insert(parent, pos, std::move(separator), right);
+      else
+        _inner_insert(sibling, pos - mid - 1, std::move(separator), right);
+
+      separator = std::move(up);
+      right = sibling;
+      --depth;
+    }
+  }
+
+  static void _inner_insert(inner_type* inner, const size_t pos,
+                            Key&& separator, node_type* child) {
+    std::move_backward(inner->keys + pos, inner->keys + inner->count,
+                       inner->keys + inner->count + 1);
+    std::copy_backward(inner->children + pos + 1,
+                       inner->children + inner->count + 1,
+                       inner->children + inner->count + 2);
+    inner->keys[pos] = std::move(separator);
+    inner->children[pos + 1] = child;
+    ++inner->count;
+  }
+
+  // Shifts the entries after pos down over it and resets the slot freed at
+  // the end, so it holds on to nothing.
+  static void _leaf_remove(leaf_type* leaf, const size_t pos) {
+    std::move(leaf->keys + pos + 1, leaf->keys + leaf->count,
+              leaf->keys + pos);
+    for (size_t i = pos + 1; i < leaf->count; ++i)
+      leaf->values[i - 1] = std::move(leaf->values[i]);
+    --leaf->count;
+    leaf->keys[leaf->count] = Key();
+    leaf->values[leaf->count] = Value();
+  }
+
+  // Refills the child path[depth - 1] went down from a sibling that can
+  // spare a key, or else merges it with one. A merge takes a separator from
+  // the parent, which may then need the same.
+  void _rebalance(path_entry* path, size_t depth) {
+    for (;;) {
+      inner_type* parent = path[depth - 1].node;
+      const size_t index = path[depth - 1].index;
+      if (index > 0 && parent->children[index - 1]->count > kMinSlots) {
+        _borrow_from_left(parent, index);
+        return;
+      }
+      if (index < parent->count &&
+          parent->children[index + 1]->count > kMinSlots) {
+        _borrow_from_right(parent, index);
+        return;
+      }
+      _merge(parent, index > 0 ? index - 1 : index);
+
+      if (depth == 1) {
+        // a root with a single child is replaced by it
+        if (parent->count == 0) {
+          root_ = parent->children[0];
+          _free_inner(parent);
+          --height_;
+        }
+        return;
+      }
+      if (parent->count >= kMinSlots)
+        return;
+      --depth;
+    }
+  }
+
+  void _borrow_from_left(inner_type* parent, const size_t index) {
+    node_type* node = parent->children[index];
+    node_type* left = parent->children[index - 1];
+    const size_t left_count = left->count;
+    std::move_backward(node->keys, node->keys + node->count,
+                       node->keys + node->count + 1);
+    if (node->leaf) {
+      leaf_type* leaf = static_cast<leaf_type*>(node);
+      leaf_type* left_leaf = static_cast<leaf_type*>(left);
+      for (size_t i = leaf->count; i > 0; --i)
+        leaf->values[i] = std::move(leaf->values[i - 1]);
+      leaf->keys[0] = std::move(left_leaf->keys[left_count - 1]);
+      leaf->values[0] = std::move(left_leaf->values[left_count - 1]);
+      left_leaf->keys[left_count - 1] = Key();
+      left_leaf->values[left_count - 1] = Value();
+      parent->keys[index - 1] = leaf->keys[0];
+    } else {
+      inner_type* inner = static_cast<inner_type*>(node);
+      inner_type* left_inner = static_cast<inner_type*>(left);
+      std::copy_backward(inner->children, inner->children + inner->count + 1,
+                         inner->children + inner->count + 2);
+      inner->keys[0] = std::move(parent->keys[index - 1]);
+      inner->children[0] = left_inner->children[left_count];
+      parent->keys[index - 1] = std::move(left_inner->keys[left_count - 1]);
+    }
+    --left->count;
+    ++node->count;
+  }
+
+  void _borrow_from_right(inner_type* parent, const size_t index) {
+    node_type* node = parent->children[index];
+    node_type* right = parent->children[index + 1];
+    const size_t count = node->count;
+    if (node->leaf) {
+      leaf_type* leaf = static_cast<leaf_type*>(node);
+      leaf_type* right_leaf = static_cast<leaf_type*>(right);
+      leaf->keys[count] = std::move(right_leaf->keys[0]);
+      leaf->values[count] = std::move(right_leaf->values[0]);
+      ++leaf->count;
+      _leaf_remove(right_leaf, 0);
+      parent->keys[index] = right_leaf->keys[0];
+      return;
+    }
+    inner_type* inner = static_cast<inner_type*>(node);
+    inner_type* right_inner = static_cast<inner_type*>(right);
+    inner->keys[count] = std::move(parent->keys[index]);
+    inner->children[count + 1] = right_inner->children[0];
+    parent->keys[index] = std::move(right_inner->keys[0]);
+    std::move(right_inner->keys + 1, right_inner->keys + right_inner->count,
+              right_inner->keys);
+    std::copy(right_inner->children + 1,
+              right_inner->children + right_inner->count + 1,
+              right_inner->children);
+    --right_inner->count;
+    ++inner->count;
+  }
+
+  // Moves child separator + 1 into child separator and drops it and the
+  // separator between them from parent.
+  void _merge(inner_type* parent, const size_t separator) {
+    node_type* left = parent->children[separator];
+    node_type* right = parent->children[separator + 1];
+    const size_t left_count = left->count;
+    if (left->leaf) {
+      leaf_type* left_leaf = static_cast<leaf_type*>(left);
+      leaf_type* right_leaf = static_cast<leaf_type*>(right);
+      for (size_t i = 0; i < right_leaf->count; ++i) {
+        left_leaf->keys[left_count + i] = std::move(right_leaf->keys[i]);
+        left_leaf->values[left_count + i] = std::move(right_leaf->values[i]);
+      }
+      left_leaf->count += right_leaf->count;
+      left_leaf->next = right_leaf->next;
+      if (right_leaf->next != nullptr)
+        right_leaf->next->prev = left_leaf;
+      else
+        last_leaf_ = left_leaf;
+      _free_leaf(right_leaf);
+    } else {
+      inner_type* left_inner = static_cast<inner_type*>(left);
+      inner_type* right_inner = static_cast<inner_type*>(right);
+      left_inner->keys[left_count] = std::move(parent->keys[separator]);
+      for (size_t i = 0; i < right_inner->count; ++i)
+        left_inner->keys[left_count + 1 + i] = std::move(right_inner->keys[i]);
+      for (size_t i = 0; i <= right_inner->count; ++i)
+        left_inner->children[left_count + 1 + i] = right_inner->children[i];
+      left_inner->count += right_inner->count + 1;
+      _free_inner(right_inner);
+    }
+
+    std::move(parent->keys + separator + 1, parent->keys + parent->count,
+              parent->keys + separator);
+    std::copy(parent->children + separator + 2,
+              parent->children + parent->count + 1,
+              parent->children + separator + 1);
+    --parent->count;
+    parent->keys[parent->count] = Key();
+  }
+
+  // Adds an entry after all others during a bulk load, starting a new leaf
+  // once the last one is full.
+  void _append(leaf_type*& leaf, const Key& key, const Value& value) {
+    if (leaf == nullptr || leaf->count == kNodeSlots) {
+      leaf_type* next = _new_leaf();
+      next->prev = leaf;
+      if (leaf != nullptr)
+        leaf->next = next;
+      else
+        first_leaf_ = next;
+      last_leaf_ = next;
+      leaf = next;
+    }
+    leaf->keys[leaf->count] = key;
+    leaf->values[leaf->count] = value;
+    ++leaf->count;
+    ++size_;
+  }
+
+  // Frees the leaves of a bulk load that threw. root_ is only set once the
+  // load is done, so clear() would not find them.
+  void _discard_bulk_load() {
+    for (leaf_type* leaf = first_leaf_; leaf != nullptr;) {
+      leaf_type* next = leaf->next;
+      _free_leaf(leaf);
+      leaf = next;
+    }
+    first_leaf_ = nullptr;
+    clear();
+  }
+
+  // frees the inner nodes of a node levels levels high, but not the leaves
+  void _free_inner_levels(node_type* node, const size_t levels) {
+    if (levels == 1)
+      return;
+    inner_type* inner = static_cast<inner_type*>(node);
+    for (size_t i = 0; i <= inner->count; ++i)
+      _free_inner_levels(inner->children[i], levels - 1);
+    _free_inner(inner);
+  }
+
+  // Evens out the last two leaves if the last one came up short, then
+  // builds the inner levels bottom up, spreading each level's nodes evenly
+  // over as few parents as will hold them. If that throws, the inner nodes
+  // built so far are freed and the leaves are left to the caller.
+  void _finish_bulk_load(leaf_type* last) {
+    if (last == nullptr)
+      return;
+    leaf_type* prev = last->prev;
+    if (prev != nullptr && last->count < kMinSlots) {
+      const size_t moved = (prev->count + last->count) / 2 - last->count;
+      for (size_t i = last->count; i > 0; --i) {
+        last->keys[i - 1 + moved] = std::move(last->keys[i - 1]);
+        last->values[i - 1 + moved] = std::move(last->values[i - 1]);
+      }
+      for (size_t i = 0; i < moved; ++i) {
+        const size_t from = prev->count - moved + i;
+        last->keys[i] = std::move(prev->keys[from]);
+        last->values[i] = std::move(prev->values[from]);
+        prev->keys[from] = Key();
+        prev->values[from] = Value();
+      }
+      prev->count -= moved;
+      last->count += moved;
+    }
+
+    std::vector<node_type*> level;
+    // the smallest key under each node of level
+    std::vector<Key> lowest;
+    // the level being built, null past the nodes allocated so far
+    std::vector<node_type*> next_level;
+    try {
+      for (leaf_type* leaf = first_leaf_; leaf != nullptr; leaf = leaf->next) {
+        level.push_back(leaf);
+        lowest.push_back(leaf->keys[0]);
+      }
+      height_ = 1;
+      while (level.size() > 1) {
+        const size_t count = level.size();
+        const size_t parents = (count + kNodeSlots) / (kNodeSlots + 1);
+        next_level.assign(parents, nullptr);
+        std::vector<Key> next_lowest(parents);
+        for (size_t p = 0; p < parents; ++p) {
+          const size_t begin = count * p / parents;
+          const size_t end = count * (p + 1) / parents;
+          inner_type* inner = _new_inner();
+          next_level[p] = inner;
+          for (size_t i = begin; i < end; ++i) {
+            inner->children[i - begin] = level[i];
+            if (i > begin)
+              inner->keys[i - begin - 1] = std::move(lowest[i]);
+          }
+          inner->count = static_cast<uint32_t>(end - begin - 1);
+          next_lowest[p] = std::move(lowest[begin]);
+        }
+        level.swap(next_level);
+        next_level.clear();
+        lowest.swap(next_lowest);
+        ++height_;
+      }
+    } catch (...) {
+      for (size_t i = 0; height_ > 1 && i < level.size(); ++i)
+        _free_inner_levels(level[i], height_);
+      for (size_t i = 0; i < next_level.size() && next_level[i]; ++i)
+        _free_inner(static_cast<inner_type*>(next_level[i]));
+      throw;
+    }
+    root_ = level[0];
+  }
+
+  Compare comp_;
+  node_type* root_;
+  // levels of nodes, 1 when the root is a leaf and 0 when there is no root
+  size_t height_;
+  size_t size_;
+  leaf_type* first_leaf_;
+  leaf_type* last_leaf_;
+  size_t leaf_count_;
+  size_t inner_count_;
+};
+
+template <typename Key, typename Value, typename Compare>
+const size_t btree_map<Key, Value, Compare>::kNodeSlots;
+
+template <typename Key, typename Value, typename Compare>
+const size_t btree_map<Key, Value, Compare>::kMinSlots;
+
+// Ordered set on btree_map. Its leaves hold only the keys.
+template <typename Key, typename Compare = std::less<Key> >
+class btree_set {
+ public:
+  typedef btree_map<Key, detail::set_value, Compare> map_type;
+
+  // Bidirectional iterator over the keys, which cannot be modified through
+  // it.
+  class const_iterator {
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef Key value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Key* pointer;
+    typedef const Key& reference;
+
+    const_iterator() {}
+
+    reference operator*() const {
+      return it_->key;
+    }
+
+    pointer operator->() const {
+      return &it_->key;
+    }
+
+    const_iterator& operator++() {
+      ++it_;
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator old(*this);
+      ++it_;
+      return old;
+    }
+
+    const_iterator& operator--() {
+      --it_;
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator old(*this);
+      --it_;
+      return old;
+    }
+
+    friend bool operator==(const const_iterator& lhs,
+                           const const_iterator& rhs) {
+      return lhs.it_ == rhs.it_;
+    }
+
+    friend bool operator!=(const const_iterator& lhs,
+                           const const_iterator& rhs) {
+      return lhs.it_ != rhs.it_;
+    }
+
+   private:
+    friend class btree_set;
+
+    explicit const_iterator(typename map_type::const_iterator it) : it_(it) {}
+
+    typename map_type::const_iterator it_;
+  };
+
+  typedef const_iterator iterator;
+
+  explicit btree_set(const Compare& comp = Compare()) : map_(comp) {}
+
+  // Returns the key's position and whether it was inserted.
+  std::pair<iterator, bool> insert(const Key& key) {
+    return _wrap(map_.try_emplace(key));
+  }
+
+  std::pair<iterator, bool> insert(Key&& key) {
+    return _wrap(map_.try_emplace(std::move(key)));
+  }
+
+  // Replaces the contents with a range of strictly increasing keys.
+  template <typename InputIt>
+  void assign_sorted(InputIt first, InputIt last) {
+    std::vector<std::pair<Key, detail::set_value> > entries;
+    for (; first != last; ++first)
+      entries.push_back(std::make_pair(*first, detail::set_value()));
+    map_.assign_sorted(entries.begin(), entries.end());
+  }
+
+  size_t erase(const Key& key) {
+    return map_.erase(key);
+  }
+
+  void clear() {
+    map_.clear();
+  }
+
+  const_iterator begin() const {
+    return const_iterator(map_.begin());
+  }
+
+  const_iterator end() const {
+    return const_iterator(map_.end());
+  }
+
+  const_iterator find(const Key& key) const {
+    return const_iterator(map_.find(key));
+  }
+
+  const_iterator lower_bound(const Key& key) const {
+    return const_iterator(map_.lower_bound(key));
+  }
+
+  const_iterator upper_bound(const Key& key) const {
+    return const_iterator(map_.upper_bound(key));
+  }
+
+  bool contains(const Key& key) const {
+    return map_.contains(key);
+  }
+
+  size_t count(const Key& key) const {
+    return map_.count(key);
+  }
+
+  size_t size() const noexcept {
+    return map_.size();
+  }
+
+  bool empty() const noexcept {
+    return map_.empty();
+  }
+
+  size_t bytes_used() const noexcept {
+    return map_.bytes_used();
+  }
+
+  void swap(btree_set& other) {
+    map_.swap(other.map_);
+  }
+
+ private:
+  static std::pair<iterator, bool> _wrap(
+      const std::pair<typename map_type::iterator, bool>& result) {
+    return std::make_pair(iterator(result.first), result.second);
+  }
+
+  map_type map_;
+};
+
+}
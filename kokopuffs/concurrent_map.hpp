@@ -0,0 +1,339 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+#include "allocator.hpp"
+#include "map.hpp"
+
+namespace kokopuffs {
+
+namespace detail {
+
+// Index of the calling thread's reader slot in every rw_spinlock. Threads
+// are handed slots round robin as they first take a lock.
+inline size_t reader_slot_index(const size_t slot_count) {
+  static std::atomic<size_t> next_slot(0);
+  static thread_local size_t slot =
+      next_slot.fetch_add(1, std::memory_order_relaxed);
+  return slot & (slot_count - 1);
+}
+
+// Reader-writer spinlock with a reader count per slot, each on its own
+// cache line. A reader only counts itself in on its thread's slot, so
+// lookups from different cores land on different lines instead of all
+// bouncing one shared word, and only threads that drew the same slot share
+// one. A writer raises the writer flag and then waits for every slot to
+// drain. A waiting writer keeps new readers out, so a steady stream of
+// lookups cannot starve it.
+//
+// Each lock is kReaderSlots + 1 cache lines and has to be placed on a cache
+// line boundary to keep them apart.
+class rw_spinlock {
+ public:
+  static const size_t kReaderSlots = 8;
+
+  rw_spinlock() : writer_(false) {
+    for (size_t i = 0; i < kReaderSlots; ++i)
+      slots_[i].readers.store(0, std::memory_order_relaxed);
+  }
+
+  // The count goes up before the writer flag is read and the flag before
+  // the counts are, so a reader and a writer arriving together cannot both
+  // miss each other.
+  void lock_shared() {
+    std::atomic<uint32_t>& readers =
+        slots_[reader_slot_index(kReaderSlots)].readers;
+    for (unsigned spins = 0; ; ) {
+      readers.fetch_add(1, std::memory_order_seq_cst);
+      if (!writer_.load(std::memory_order_seq_cst))
+        return;
+      readers.fetch_sub(1, std::memory_order_release);
+      while (writer_.load(std::memory_order_relaxed))
+        _pause(spins++);
+    }
+  }
+
+  void unlock_shared() {
+    slots_[reader_slot_index(kReaderSlots)].readers.fetch_sub(
+        1, std::memory_order_release);
+  }
+
+  void lock() {
+    for (unsigned spins = 0; ; ++spins) {
+      bool writer = false;
+      if (!writer_.load(std::memory_order_relaxed) &&
+          writer_.compare_exchange_weak(writer, true,
+                                        std::memory_order_seq_cst))
+        break;
+      _pause(spins);
+    }
+    for (size_t i = 0; i < kReaderSlots; ++i) {
+      for (unsigned spins = 0;
+           slots_[i].readers.load(std::memory_order_seq_cst) != 0; ++spins)
+        _pause(spins);
+    }
+  }
+
+  void unlock() {
+    writer_.store(false, std::memory_order_release);
+  }
+
+ private:
+  struct alignas(64) reader_count {
+    std::atomic<uint32_t> readers;
+  };
+
+  rw_spinlock(const rw_spinlock&);
+  rw_spinlock& operator=(const rw_spinlock&);
+
+  static void _pause(unsigned spins) {
+    // give the lock holder the core if it got preempted
+    if (spins >= 64) {
+      std::this_thread::yield();
+      return;
+    }
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+
+  reader_count slots_[kReaderSlots];
+  alignas(64) std::atomic<bool> writer_;
+};
+
+template <typename Lock>
+class shared_guard {
+ public:
+  explicit shared_guard(Lock& lock) : lock_(lock) {
+    lock_.lock_shared();
+  }
+
+  ~shared_guard() {
+    lock_.unlock_shared();
+  }
+
+ private:
+  shared_guard(const shared_guard&);
+  shared_guard& operator=(const shared_guard&);
+
+  Lock& lock_;
+};
+
+template <typename Lock>
+class unique_guard {
+ public:
+  explicit unique_guard(Lock& lock) : lock_(lock) {
+    lock_.lock();
+  }
+
+  ~unique_guard() {
+    lock_.unlock();
+  }
+
+ private:
+  unique_guard(const unique_guard&);
+  unique_guard& operator=(const unique_guard&);
+
+  Lock& lock_;
+};
+
+}  // namespace detail
+
+// kokopuffs::map split into independently locked shards, so threads only
+// contend when they touch the same shard. Lookups take a shard's lock in
+// shared mode and never block each other, each counting itself in on a
+// cache line of its own; writers lock a single shard. A key is hashed once, to pick
+// its shard, and the shard's map probes with that same hash.
+//
+// Values are copied out by find(), or read in place under the lock with
+// visit(), since a reference could be invalidated by another thread's
+// insert as soon as the lock is released.
+template<typename Key, typename Value,
+         typename Hash = kokopuffs::hash<Key>,
+         typename KeyEqual = kokopuffs::equal_to<Key>,
+         typename Policy = map_policy<group_probing>,
+         typename Allocator = std::allocator<std::pair<const Key, Value> > >
+class concurrent_map {
+ public:
+  typedef kokopuffs::map<Key, Value, Hash, KeyEqual, Policy, Allocator>
+      map_type;
+
+  // shard_count is rounded up to a power of two, initial_table_size is per
+  // shard
+  explicit concurrent_map(size_t shard_count = 64,
+                          size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE,
+                          const Hash& hash = Hash(),
+                          const KeyEqual& equal = KeyEqual(),
+                          const Allocator& alloc = Allocator())
+      : hasher_(hash),
+        shard_bits_(0) {
+    while ((size_t(1) << shard_bits_) < shard_count)
+      ++shard_bits_;
+    // constructed in place, since the locks cannot be moved, and on cache
+    // line boundaries, which the locks need
+    shards_ = static_cast<shard*>(
+        detail::cache_line_alloc(sizeof(shard) * this->shard_count()));
+    size_t i = 0;
+    try {
+      for (; i < this->shard_count(); ++i)
+        new (&shards_[i]) shard(initial_table_size, hash, equal, alloc);
+    } catch (...) {
+      _destroy_shards(i);
+      throw;
+    }
+  }
+
+  ~concurrent_map() {
+    _destroy_shards(shard_count());
+  }
+
+  // Only needed with quadratic_probing, and only before any other thread
+  // uses the map.
+  void set_empty_key(const Key& key) {
+    for (size_t i = 0; i < shard_count(); ++i)
+      shards_[i].map.set_empty_key(key);
+  }
+
+  void set_deleted_key(const Key& key) {
+    for (size_t i = 0; i < shard_count(); ++i)
+      shards_[i].map.set_deleted_key(key);
+  }
+
+  // Copies key's value into value and returns true if it is in the map.
+  bool find(const Key& key, Value& value) const {
+    const size_t hash = hasher_(key);
+    const shard& s = _shard_for(hash);
+    detail::shared_guard<detail::rw_spinlock> guard(s.lock);
+    const size_t index = s.map._find_index_hashed(key, hash);
+    if (index == s.map._end_index())
+      return false;
+    value = s.map._entry_at(index).value;
+    return true;
+  }
+
+  bool contains(const Key& key) const {
+    const size_t hash = hasher_(key);
+    const shard& s = _shard_for(hash);
+    detail::shared_guard<detail::rw_spinlock> guard(s.lock);
+    return s.map._find_index_hashed(key, hash) != s.map._end_index();
+  }
+
+  // Calls f(const Value&) with the shard still locked, so f must not call
+  // back into this map. Returns false if key is not in the map.
+  template <typename F>
+  bool visit(const Key& key, F f) const {
+    const size_t hash = hasher_(key);
+    const shard& s = _shard_for(hash);
+    detail::shared_guard<detail::rw_spinlock> guard(s.lock);
+    const size_t index = s.map._find_index_hashed(key, hash);
+    if (index == s.map._end_index())
+      return false;
+    f(static_cast<const Value&>(s.map._entry_at(index).value));
+    return true;
+  }
+
+  // Calls f(const Key&, const Value&) for every entry, one shard at a time,
+  // so it sees each shard at a single point in time but not the whole map.
+  template <typename F>
+  void visit_all(F f) const {
+    for (size_t i = 0; i < shard_count(); ++i) {
+      const shard& s = shards_[i];
+      detail::shared_guard<detail::rw_spinlock> guard(s.lock);
+      for (typename map_type::const_iterator it = s.map.begin();
+           it != s.map.end(); ++it)
+        f(it->key, it->value);
+    }
+  }
+
+  // Returns true if key was inserted, false if an existing value was
+  // replaced.
+  template <typename M>
+  bool insert_or_assign(const Key& key, M&& obj) {
+    const size_t hash = hasher_(key);
+    shard& s = _shard_for(hash);
+    detail::unique_guard<detail::rw_spinlock> guard(s.lock);
+    return s.map._insert_or_assign_hashed(hash, key, std::forward<M>(obj))
+        .second;
+  }
+
+  size_t erase(const Key& key) {
+    const size_t hash = hasher_(key);
+    shard& s = _shard_for(hash);
+    detail::unique_guard<detail::rw_spinlock> guard(s.lock);
+    return s.map._erase_hashed(key, hash);
+  }
+
+  // Exact only while no other thread is writing.
+  size_t size() const {
+    size_t n = 0;
+    for (size_t i = 0; i < shard_count(); ++i) {
+      const shard& s = shards_[i];
+      detail::shared_guard<detail::rw_spinlock> guard(s.lock);
+      n += s.map.size();
+    }
+    return n;
+  }
+
+  size_t shard_count() const {
+    return size_t(1) << shard_bits_;
+  }
+
+ private:
+  struct shard {
+    shard(size_t initial_table_size, const Hash& hash, const KeyEqual& equal,
+          const Allocator& alloc)
+        : map(initial_table_size, hash, equal, alloc) {}
+
+    // cache line aligned, which also keeps the next shard's lock off the
+    // map's last line
+    mutable detail::rw_spinlock lock;
+    map_type map;
+  };
+
+  concurrent_map(const concurrent_map&);
+  concurrent_map& operator=(const concurrent_map&);
+
+  void _destroy_shards(size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      shards_[i].~shard();
+    detail::cache_line_free(shards_);
+  }
+
+  // The low bits of the hash pick the bucket and the top 7 are the
+  // group_probing tag, so the shard comes from the bits just below the tag.
+  // Keys in one shard then still differ in both. Every shard's map hashes
+  // with a copy of hasher_, so the same hash is passed on to it instead of
+  // hashing the key a second time.
+  size_t _shard_index(const size_t hash) const {
+    return (hash >> (sizeof(size_t) * 8 - 7 - shard_bits_)) &
+           (shard_count() - 1);
+  }
+
+  shard& _shard_for(const size_t hash) {
+    return shards_[_shard_index(hash)];
+  }
+
+  const shard& _shard_for(const size_t hash) const {
+    return shards_[_shard_index(hash)];
+  }
+
+  Hash hasher_;
+  size_t shard_bits_;
+  shard* shards_;
+};
+
+}
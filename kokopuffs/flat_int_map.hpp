@@ -0,0 +1,599 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "allocator.hpp"
+#include "map.hpp"
+#include "set.hpp"
+
+namespace kokopuffs {
+
+namespace detail {
+
+// Values of a flat_int_map, kept in their own array. Empty, trivial values
+// like set_value get no array at all.
+template <typename Value,
+          bool Elided = std::is_empty<Value>::value &&
+                        std::is_trivial<Value>::value>
+class value_array {
+ public:
+  value_array() : values_(nullptr) {}
+
+  void allocate(size_t n) {
+    values_ = static_cast<Value*>(::operator new(n * sizeof(Value)));
+  }
+
+  void deallocate() {
+    ::operator delete(values_);
+    values_ = nullptr;
+  }
+
+  Value& operator[](size_t i) {
+    return values_[i];
+  }
+
+  const Value& operator[](size_t i) const {
+    return values_[i];
+  }
+
+  void swap(value_array& other) {
+    std::swap(values_, other.values_);
+  }
+
+ private:
+  Value* values_;
+};
+
+template <typename Value>
+class value_array<Value, true> {
+ public:
+  void allocate(size_t) {}
+
+  void deallocate() {}
+
+  Value& operator[](size_t) {
+    return value_;
+  }
+
+  const Value& operator[](size_t) const {
+    return value_;
+  }
+
+  void swap(value_array&) {}
+
+ private:
+  Value value_;
+};
+
+// A cache line of keys, loaded at once like ctrl_group. match() returns a
+// bitmask with bit i set if key i matches.
+template <typename Key, size_t KeySize = sizeof(Key)>
+struct key_window {
+  static const size_t kWidth = 64 / sizeof(Key);
+
+  explicit key_window(const Key* keys) : keys_(keys) {}
+
+  uint32_t match(const Key key) const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kWidth; ++i)
+      mask |= static_cast<uint32_t>(keys_[i] == key) << i;
+    return mask;
+  }
+
+  const Key* keys_;
+};
+
+#if defined(__AVX2__)
+template <typename Key>
+struct key_window<Key, 4> {
+  static const size_t kWidth = 16;
+
+  explicit key_window(const Key* keys)
+      : lo_(_mm256_load_si256(reinterpret_cast<const __m256i*>(keys))),
+        hi_(_mm256_load_si256(reinterpret_cast<const __m256i*>(keys) + 1)) {}
+
+  uint32_t match(const Key key) const {
+    const __m256i k = _mm256_set1_epi32(static_cast<int32_t>(key));
+    return _movemask(_mm256_cmpeq_epi32(lo_, k)) |
+           _movemask(_mm256_cmpeq_epi32(hi_, k)) << 8;
+  }
+
+  static uint32_t _movemask(const __m256i eq) {
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+  }
+
+  __m256i lo_;
+  __m256i hi_;
+};
+
+template <typename Key>
+struct key_window<Key, 8> {
+  static const size_t kWidth = 8;
+
+  explicit key_window(const Key* keys)
+      : lo_(_mm256_load_si256(reinterpret_cast<const __m256i*>(keys))),
+        hi_(_mm256_load_si256(reinterpret_cast<const __m256i*>(keys) + 1)) {}
+
+  uint32_t match(const Key key) const {
+    const __m256i k = _mm256_set1_epi64x(static_cast<int64_t>(key));
+    return _movemask(_mm256_cmpeq_epi64(lo_, k)) |
+           _movemask(_mm256_cmpeq_epi64(hi_, k)) << 4;
+  }
+
+  static uint32_t _movemask(const __m256i eq) {
+    return static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(eq)));
+  }
+
+  __m256i lo_;
+  __m256i hi_;
+};
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+template <typename Key>
+struct key_window<Key, 4> {
+  static const size_t kWidth = 16;
+
+  explicit key_window(const Key* keys) {
+    for (size_t i = 0; i < 4; ++i)
+      keys_[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(keys) + i);
+  }
+
+  uint32_t match(const Key key) const {
+    const __m128i k = _mm_set1_epi32(static_cast<int32_t>(key));
+    uint32_t mask = 0;
+    for (size_t i = 0; i < 4; ++i) {
+      const __m128 eq = _mm_castsi128_ps(_mm_cmpeq_epi32(keys_[i], k));
+      mask |= static_cast<uint32_t>(_mm_movemask_ps(eq)) << (i * 4);
+    }
+    return mask;
+  }
+
+  __m128i keys_[4];
+};
+
+// SSE2 has no 64-bit compare, so both halves are compared separately and
+// each result is ANDed with its swapped neighbour.
+template <typename Key>
+struct key_window<Key, 8> {
+  static const size_t kWidth = 8;
+
+  explicit key_window(const Key* keys) {
+    for (size_t i = 0; i < 4; ++i)
+      keys_[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(keys) + i);
+  }
+
+  uint32_t match(const Key key) const {
+    const __m128i k = _mm_set1_epi64x(static_cast<int64_t>(key));
+    uint32_t mask = 0;
+    for (size_t i = 0; i < 4; ++i) {
+      const __m128i halves = _mm_cmpeq_epi32(keys_[i], k);
+      const __m128i eq = _mm_and_si128(
+          halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+      mask |= static_cast<uint32_t>(
+                  _mm_movemask_pd(_mm_castsi128_pd(eq))) << (i * 2);
+    }
+    return mask;
+  }
+
+  __m128i keys_[4];
+};
+#endif
+
+}  // namespace detail
+
+// Map from 32 or 64-bit integers, laid out as a plain array of keys and a
+// separate array of values. A reserved key, the largest one by default,
+// marks empty slots, so a slot costs exactly sizeof(Key) plus sizeof(Value)
+// and there is no control array.
+//
+// It uses linear probing without wrapping around: the key array runs a few
+// windows past the last bucket instead. A lookup compares a whole cache line
+// of keys at a time, starting with the line its home slot is on, against the
+// key and the empty marker, with AVX2 or SSE2 compares where available.
+// Erasing shifts the following keys back, so there are no tombstones
+// either. The table is kept at most 3/4 full.
+template <typename Key, typename Value, typename Hash = kokopuffs::hash<Key> >
+class flat_int_map {
+  static_assert(std::is_integral<Key>::value &&
+                    (sizeof(Key) == 4 || sizeof(Key) == 8),
+                "kokopuffs::flat_int_map needs 32 or 64-bit integer keys");
+
+ public:
+  explicit flat_int_map(size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE,
+                        Key empty_key = std::numeric_limits<Key>::max(),
+                        const Hash& hash = Hash())
+      : hasher_(hash),
+        empty_key_(empty_key),
+        bucket_count_(std::max(detail::next_power_of_two(initial_table_size),
+                               size_t(KOKOPUFFS_MAP_INTIAL_SIZE))),
+        item_count_(0) {
+    _create_table();
+  }
+
+  flat_int_map(const flat_int_map& other)
+      : hasher_(other.hasher_),
+        empty_key_(other.empty_key_),
+        bucket_count_(other.bucket_count_),
+        item_count_(other.item_count_) {
+    _create_table();
+    std::copy(other.keys_, other.keys_ + _slot_count(), keys_);
+    for (size_t i = 0; i < _slot_count(); ++i) {
+      if (keys_[i] != empty_key_)
+        new (&values_[i]) Value(other.values_[i]);
+    }
+  }
+
+  flat_int_map& operator=(const flat_int_map& other) {
+    if (&other != this) {
+      flat_int_map copy(other);
+      swap(copy);
+    }
+    return *this;
+  }
+
+  flat_int_map(flat_int_map&& other)
+      : hasher_(other.hasher_),
+        empty_key_(other.empty_key_),
+        bucket_count_(0),
+        item_count_(0),
+        keys_(nullptr) {
+    swap(other);
+  }
+
+  flat_int_map& operator=(flat_int_map&& other) {
+    swap(other);
+    return *this;
+  }
+
+  ~flat_int_map() {
+    _delete_table(keys_, values_, _slot_count());
+  }
+
+  void swap(flat_int_map& other) {
+    std::swap(hasher_, other.hasher_);
+    std::swap(empty_key_, other.empty_key_);
+    std::swap(bucket_count_, other.bucket_count_);
+    std::swap(item_count_, other.item_count_);
+    std::swap(keys_, other.keys_);
+    values_.swap(other.values_);
+  }
+
+  Value& operator[](const Key key) {
+    // the insert may resize, so values_ must only be read afterwards
+    const size_t index = _find_or_insert(key).first;
+    return values_[index];
+  }
+
+  // Returns true if key was inserted, false if its value was replaced.
+  template <typename M>
+  bool insert_or_assign(const Key key, M&& obj) {
+    const std::pair<size_t, bool> result =
+        _find_or_insert(key, std::forward<M>(obj));
+    if (!result.second)
+      values_[result.first] = std::forward<M>(obj);
+    return result.second;
+  }
+
+  // Pointer to key's value, or nullptr if it is missing. Inserts and erases
+  // may move values, so it is only valid until the next one.
+  Value* find(const Key key) {
+    const size_t index = _find_index(key);
+    return index == kNotFound ? nullptr : &values_[index];
+  }
+
+  const Value* find(const Key key) const {
+    const size_t index = _find_index(key);
+    return index == kNotFound ? nullptr : &values_[index];
+  }
+
+  Value& at(const Key key) {
+    Value* value = find(key);
+    if (value == nullptr)
+      throw std::out_of_range("kokopuffs::flat_int_map.at() key not found");
+    return *value;
+  }
+
+  const Value& at(const Key key) const {
+    const Value* value = find(key);
+    if (value == nullptr)
+      throw std::out_of_range("kokopuffs::flat_int_map.at() key not found");
+    return *value;
+  }
+
+  // Unlike find() this never needs the key's position, only whether any key
+  // in a window matched.
+  bool contains(const Key key) const {
+    if (key == empty_key_)
+      return false;
+    const size_t home = _home(key);
+    size_t first = home & (kWindow - 1);
+    for (const Key* window = keys_ + (home - first); ; window += kWindow) {
+      const detail::key_window<Key> w(window);
+      if (w.match(key))
+        return true;
+      if (_match_empty(w, first))
+        return false;
+      first = 0;
+    }
+  }
+
+  size_t count(const Key key) const {
+    return contains(key) ? 1 : 0;
+  }
+
+  size_t erase(const Key key) {
+    size_t hole = _find_index(key);
+    if (hole == kNotFound)
+      return 0;
+    values_[hole].~Value();
+    // Knuth's algorithm R: a later key in the run may fill the hole if its
+    // home is at or before it, and then leaves a hole of its own
+    for (size_t next = hole + 1; keys_[next] != empty_key_; ++next) {
+      if (_home(keys_[next]) <= hole) {
+        keys_[hole] = keys_[next];
+        new (&values_[hole]) Value(std::move(values_[next]));
+        values_[next].~Value();
+        hole = next;
+      }
+    }
+    keys_[hole] = empty_key_;
+    --item_count_;
+    return 1;
+  }
+
+  // Calls f(Key key, const Value& value) for every entry.
+  template <typename F>
+  void visit_all(F f) const {
+    for (size_t i = 0; i < _slot_count(); ++i) {
+      if (keys_[i] != empty_key_)
+        f(keys_[i], values_[i]);
+    }
+  }
+
+  // Makes room for n keys in total without any further resize.
+  void reserve(size_t n) {
+    const size_t count = detail::next_power_of_two(n + n / 3 + 1);
+    if (count > bucket_count_)
+      _resize(count);
+  }
+
+  size_t size() const noexcept {
+    return item_count_;
+  }
+
+  bool empty() const noexcept {
+    return item_count_ == 0;
+  }
+
+  size_t bucket_count() const noexcept {
+    return bucket_count_;
+  }
+
+  float load_factor() const noexcept {
+    return item_count_ / static_cast<float>(bucket_count_);
+  }
+
+  Key empty_key() const noexcept {
+    return empty_key_;
+  }
+
+ private:
+  static const size_t kNotFound = static_cast<size_t>(-1);
+  // keys compared per step, one cache line's worth
+  static const size_t kWindow = detail::key_window<Key>::kWidth;
+  // slots past the last bucket that a run may spill into; a run that would
+  // go any further forces a resize
+  static const size_t kOverflow = 4 * kWindow;
+
+  // The overflow slots, then one more window that always stays empty so a
+  // window never reads past the end.
+  size_t _slot_count() const {
+    return bucket_count_ + kOverflow + kWindow;
+  }
+
+  size_t _home(const Key key) const {
+    return hasher_(key) & (bucket_count_ - 1);
+  }
+
+  void _create_table() {
+    keys_ = static_cast<Key*>(
+        detail::cache_line_alloc(_slot_count() * sizeof(Key)));
+    std::fill(keys_, keys_ + _slot_count(), empty_key_);
+    values_.allocate(_slot_count());
+  }
+
+  void _delete_table(Key* keys, detail::value_array<Value>& values,
+                     const size_t slot_count) {
+    if (keys == nullptr)
+      return;
+    for (size_t i = 0; i < slot_count; ++i) {
+      if (keys[i] != empty_key_)
+        values[i].~Value();
+    }
+    detail::cache_line_free(keys);
+    values.deallocate();
+  }
+
+  // Empty slots in the window from first on. The ones before it belong to
+  // runs that end before the key's home.
+  uint32_t _match_empty(const detail::key_window<Key>& w,
+                        const size_t first) const {
+    return w.match(empty_key_) >> first;
+  }
+
+  // Keys are unique, so a match anywhere in a window, even before the home
+  // slot, is the key. A run never has an empty slot in it, so an empty one
+  // at or after the home slot means the key is not in the table.
+  size_t _find_index(const Key key) const {
+    if (key == empty_key_)
+      return kNotFound;
+    const size_t home = _home(key);
+    size_t first = home & (kWindow - 1);
+    for (size_t base = home - first; ; base += kWindow) {
+      const detail::key_window<Key> w(keys_ + base);
+      const uint32_t found = w.match(key);
+      if (found)
+        return base + detail::count_trailing_zeros(found);
+      if (_match_empty(w, first))
+        return kNotFound;
+      first = 0;
+    }
+  }
+
+  // First empty slot at or after key's home, or kNotFound if the run ends
+  // past the overflow slots.
+  size_t _find_empty_slot(const Key key) const {
+    const size_t end = bucket_count_ + kOverflow;
+    for (size_t i = _home(key); i < end; ++i) {
+      if (keys_[i] == empty_key_)
+        return i;
+    }
+    return kNotFound;
+  }
+
+  template <typename... Args>
+  std::pair<size_t, bool> _find_or_insert(const Key key, Args&&... args) {
+    if (key == empty_key_)
+      throw std::runtime_error(
+          "kokopuffs::flat_int_map key is the empty key");
+    const size_t found = _find_index(key);
+    if (found != kNotFound)
+      return std::make_pair(found, false);
+
+    if ((item_count_ + 1) * 4 > bucket_count_ * 3)
+      _resize(bucket_count_ * 2);
+    size_t index = _find_empty_slot(key);
+    while (index == kNotFound) {
+      _resize(bucket_count_ * 2);
+      index = _find_empty_slot(key);
+    }
+    new (&values_[index]) Value(std::forward<Args>(args)...);
+    keys_[index] = key;
+    ++item_count_;
+    return std::make_pair(index, true);
+  }
+
+  void _resize(const size_t new_bucket_count) {
+    Key* old_keys = keys_;
+    detail::value_array<Value> old_values;
+    old_values.swap(values_);
+    const size_t old_slot_count = _slot_count();
+
+    // keys go first, since a run spilling past the overflow slots, however
+    // unlikely, means starting over with a bigger table
+    bucket_count_ = new_bucket_count;
+    _create_table();
+    while (!_place_keys(old_keys, old_slot_count)) {
+      detail::cache_line_free(keys_);
+      values_.deallocate();
+      bucket_count_ *= 2;
+      _create_table();
+    }
+
+    for (size_t i = 0; i < old_slot_count; ++i) {
+      if (old_keys[i] == empty_key_)
+        continue;
+      Value& value = values_[_find_index(old_keys[i])];
+      new (&value) Value(std::move(old_values[i]));
+      old_values[i].~Value();
+    }
+    detail::cache_line_free(old_keys);
+    old_values.deallocate();
+  }
+
+  bool _place_keys(const Key* keys, const size_t slot_count) {
+    for (size_t i = 0; i < slot_count; ++i) {
+      if (keys[i] == empty_key_)
+        continue;
+      const size_t index = _find_empty_slot(keys[i]);
+      if (index == kNotFound)
+        return false;
+      keys_[index] = keys[i];
+    }
+    return true;
+  }
+
+  Hash hasher_;
+  Key empty_key_;
+  size_t bucket_count_;
+  size_t item_count_;
+  // _slot_count() keys, empty_key_ in the empty slots, cache line aligned so
+  // every window is one line
+  Key* keys_;
+  detail::value_array<Value> values_;
+};
+
+template <typename Key, typename Value, typename Hash>
+const size_t flat_int_map<Key, Value, Hash>::kWindow;
+
+template <typename Key, typename Value, typename Hash>
+const size_t flat_int_map<Key, Value, Hash>::kOverflow;
+
+// Set of 32 or 64-bit integers on flat_int_map, just the array of keys.
+template <typename Key, typename Hash = kokopuffs::hash<Key> >
+class flat_int_set {
+ public:
+  explicit flat_int_set(size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE,
+                        Key empty_key = std::numeric_limits<Key>::max(),
+                        const Hash& hash = Hash())
+      : map_(initial_table_size, empty_key, hash) {}
+
+  // Returns true if key was inserted.
+  bool insert(const Key key) {
+    return map_.insert_or_assign(key, detail::set_value());
+  }
+
+  bool contains(const Key key) const {
+    return map_.contains(key);
+  }
+
+  size_t count(const Key key) const {
+    return map_.count(key);
+  }
+
+  size_t erase(const Key key) {
+    return map_.erase(key);
+  }
+
+  // Calls f(Key key) for every key.
+  template <typename F>
+  void visit_all(F f) const {
+    map_.visit_all([&f](const Key key, const detail::set_value&) { f(key); });
+  }
+
+  void reserve(size_t n) {
+    map_.reserve(n);
+  }
+
+  size_t size() const noexcept {
+    return map_.size();
+  }
+
+  bool empty() const noexcept {
+    return map_.empty();
+  }
+
+  size_t bucket_count() const noexcept {
+    return map_.bucket_count();
+  }
+
+  float load_factor() const noexcept {
+    return map_.load_factor();
+  }
+
+  void swap(flat_int_set& other) {
+    map_.swap(other.map_);
+  }
+
+ private:
+  flat_int_map<Key, detail::set_value, Hash> map_;
+};
+
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define KOKOPUFFS_HAS_STRING_VIEW
+#include <string_view>
+#endif
+
+namespace kokopuffs {
+
+namespace detail {
+
+// wyhash's default secret
+static const uint64_t kHashSecret0 = 0xa0761d6478bd642full;
+static const uint64_t kHashSecret1 = 0xe7037ed1a0b428dbull;
+static const uint64_t kHashSecret2 = 0x8ebc6af09c88c6e3ull;
+static const uint64_t kHashSecret3 = 0x589965cc75374cc3ull;
+
+// Full 64x64 -> 128 bit multiply. One instruction on most 64-bit targets.
+inline void mul128(uint64_t a, uint64_t b, uint64_t& lo, uint64_t& hi) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  lo = static_cast<uint64_t>(r);
+  hi = static_cast<uint64_t>(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  lo = _umul128(a, b, &hi);
+#else
+  const uint64_t ha = a >> 32, hb = b >> 32;
+  const uint64_t la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+  const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  const uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+// Multiply and fold the 128 bit product back to 64 bits. This mixes both the
+// low and the high bits of the inputs, which matters because the map masks
+// off the low bits for the bucket and uses the top bits for the
+// group_probing tag.
+inline uint64_t mum(uint64_t a, uint64_t b) {
+  uint64_t lo, hi;
+  mul128(a, b, lo, hi);
+  return lo ^ hi;
+}
+
+inline uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t read32(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t read_small(const uint8_t* p, size_t n) {
+  return (static_cast<uint64_t>(p[0]) << 16) |
+         (static_cast<uint64_t>(p[n >> 1]) << 8) | p[n - 1];
+}
+
+}  // namespace detail
+
+// wyhash (final version 4). Reads 8 or 16 bytes per step instead of FNV-1a's
+// one, and keeps three independent lanes for long keys.
+inline uint64_t wyhash(const void* data, size_t n, uint64_t seed = 0) {
+  using namespace detail;
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  seed ^= mum(seed ^ kHashSecret0, kHashSecret1);
+  uint64_t a, b;
+  if (n <= 16) {
+    if (n >= 4) {
+      a = (read32(p) << 32) | read32(p + ((n >> 3) << 2));
+      b = (read32(p + n - 4) << 32) | read32(p + n - 4 - ((n >> 3) << 2));
+    } else if (n > 0) {
+      a = read_small(p, n);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = n;
+    if (i > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = mum(read64(p) ^ kHashSecret1, read64(p + 8) ^ seed);
+        seed1 = mum(read64(p + 16) ^ kHashSecret2, read64(p + 24) ^ seed1);
+        seed2 = mum(read64(p + 32) ^ kHashSecret3, read64(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = mum(read64(p) ^ kHashSecret1, read64(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = read64(p + i - 16);
+    b = read64(p + i - 8);
+  }
+  uint64_t lo, hi;
+  mul128(a ^ kHashSecret1, b ^ seed, lo, hi);
+  return mum(lo ^ kHashSecret0 ^ n, hi ^ kHashSecret1);
+}
+
+// Multiply-shift style mixer for integer keys.
+inline uint64_t hash_int(uint64_t x) {
+  return detail::mum(x ^ detail::kHashSecret0, detail::kHashSecret1);
+}
+
+// Default hasher for kokopuffs::map.
+//
+// Integers, enums and pointers go through hash_int(), strings through
+// wyhash(), and everything else through std::hash<T> followed by hash_int()
+// since std::hash is usually the identity and the map only keeps the low bits.
+template <typename T>
+struct hash {
+  size_t operator()(const T& key) const {
+    return _hash(key, std::integral_constant<bool,
+        std::is_integral<T>::value || std::is_enum<T>::value>());
+  }
+
+ private:
+  static size_t _hash(const T& key, std::true_type) {
+    return static_cast<size_t>(hash_int(static_cast<uint64_t>(key)));
+  }
+
+  static size_t _hash(const T& key, std::false_type) {
+    return static_cast<size_t>(hash_int(std::hash<T>()(key)));
+  }
+};
+
+template <typename T>
+struct hash<T*> {
+  size_t operator()(T* key) const {
+    return static_cast<size_t>(hash_int(reinterpret_cast<uintptr_t>(key)));
+  }
+};
+
+// Transparent, so maps keyed by strings can be probed with a const CharT*
+// or a string_view without building a temporary string.
+template <typename CharT, typename Traits, typename Alloc>
+struct hash<std::basic_string<CharT, Traits, Alloc> > {
+  typedef void is_transparent;
+
+  size_t operator()(const std::basic_string<CharT, Traits, Alloc>& key) const {
+    return static_cast<size_t>(wyhash(key.data(), key.size() * sizeof(CharT)));
+  }
+
+  size_t operator()(const CharT* key) const {
+    return static_cast<size_t>(wyhash(key, Traits::length(key) * sizeof(CharT)));
+  }
+
+#ifdef KOKOPUFFS_HAS_STRING_VIEW
+  size_t operator()(std::basic_string_view<CharT, Traits> key) const {
+    return static_cast<size_t>(wyhash(key.data(), key.size() * sizeof(CharT)));
+  }
+#endif
+};
+
+// Default key equality for kokopuffs::map. Like std::equal_to, except that
+// strings compare transparently against anything they have an operator==
+// for, to go with the transparent string hash above.
+template <typename T>
+struct equal_to {
+  bool operator()(const T& lhs, const T& rhs) const {
+    return lhs == rhs;
+  }
+};
+
+template <typename CharT, typename Traits, typename Alloc>
+struct equal_to<std::basic_string<CharT, Traits, Alloc> > {
+  typedef void is_transparent;
+
+  template <typename Lhs, typename Rhs>
+  bool operator()(const Lhs& lhs, const Rhs& rhs) const {
+    return lhs == rhs;
+  }
+};
+
+namespace detail {
+
+template <typename T>
+struct void_type {
+  typedef void type;
+};
+
+template <typename T, typename = void>
+struct is_transparent : std::false_type {};
+
+template <typename T>
+struct is_transparent<T, typename void_type<typename T::is_transparent>::type>
+    : std::true_type {};
+
+// enable_if for the heterogeneous lookup overloads, only enabled when both
+// the hasher and the key equality accept other key types. K is unused but
+// keeps the condition dependent on the member template.
+template <typename Hash, typename KeyEqual, typename K, typename Result>
+struct enable_transparent
+    : std::enable_if<is_transparent<Hash>::value &&
+                     is_transparent<KeyEqual>::value, Result> {};
+
+// The characters of anything a string key can be looked up with, for the
+// containers that store string keys as raw bytes.
+inline std::pair<const char*, size_t> string_chars(const std::string& key) {
+  return std::make_pair(key.data(), key.size());
+}
+
+inline std::pair<const char*, size_t> string_chars(const char* key) {
+  return std::make_pair(key, std::strlen(key));
+}
+
+#ifdef KOKOPUFFS_HAS_STRING_VIEW
+inline std::pair<const char*, size_t> string_chars(std::string_view key) {
+  return std::make_pair(key.data(), key.size());
+}
+#endif
+
+}  // namespace detail
+
+}
@@ -1,19 +1,49 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iterator>
 #include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <exception>
+#include <stdexcept>
+#include <type_traits>
 #include <cassert>
 #include <cstring>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
 
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 
+#include "hash.hpp"
+#include "allocator.hpp"
+
 #if defined(_DEBUG) || defined(DEBUG) && !defined(NDEBUG) && !defined(_NDEBUG)
 #define KOKOPUFFS_DEBUG
 #endif
-#define KOKOPUFFS_MAP_COLLISION_DEBUG
+
+// Define KOKOPUFFS_MAP_COLLISION_DEBUG before including this header to record
+// each entry's home bucket and print it in _debug().
+
+// Define KOKOPUFFS_MAP_STATS before including this header to also count
+// lookups and their probe steps for stats(). The counters are not
+// synchronized, so concurrent readers of one map must not use them.
 
 // default factor used in Google's densehashtable.h
 #define KOKOPUFFS_MAP_INTIAL_SIZE 16
@@ -23,141 +53,552 @@
 
 namespace kokopuffs {
 
-template<typename Key, typename Value>
+// Probing policies for kokopuffs::map.
+//
+// quadratic_probing is the original densehash-style layout: slot state is kept
+// in the keys themselves, so set_empty_key() (and set_deleted_key() before
+// erasing) must be called, and every probe compares against the sentinels.
+//
+// group_probing keeps a separate one byte per slot control array (empty,
+// deleted, or 7 bits of the hash) and scans a whole group of slots with one
+// SIMD compare, so full key compares only happen on tag matches. No sentinel
+// keys are needed; set_empty_key() and set_deleted_key() are accepted and
+// ignored.
+//
+// robin_hood_probing is linear probing where an insert takes the slot of any
+// entry that is closer to its home bucket than the new one would be, which
+// keeps probe lengths short and even. Erasing shifts the following entries
+// back instead of leaving a tombstone. The control array holds each slot's
+// probe distance, and no sentinel keys are needed either.
+struct quadratic_probing {};
+struct group_probing {};
+struct robin_hood_probing {};
+
+// Whether every slot also keeps the full hash of its key. Resizing then never
+// calls the hash function again, and probes reject most non-matching slots
+// with one integer compare before calling KeyEqual. store_hash_auto does this
+// for anything that is not a scalar, since those are the keys that are
+// expensive to hash and compare.
+enum store_hash_mode {
+  store_hash_auto,
+  store_hash_always,
+  store_hash_never
+};
+
+// Bundles the layout options of kokopuffs::map, its fifth template parameter.
+//
+// With IncrementalRehash a resize only allocates the new table. The old one
+// is kept alongside it and a few of its slots are moved over on every insert
+// and erase, so no single operation pays for rehashing the whole map. Until
+// the old table is empty, lookups that miss the new table probe it as well.
+template <typename Probing = quadratic_probing,
+          store_hash_mode StoreHash = store_hash_auto,
+          bool IncrementalRehash = false>
+struct map_policy {
+  typedef Probing probing;
+  static const store_hash_mode store_hash = StoreHash;
+  static const bool incremental_rehash = IncrementalRehash;
+};
+
+// What kokopuffs::map::stats() reports. A probe length is how many steps
+// past its home slot (home group with group_probing) an entry's probe has to
+// go before it reaches it, so a well spread table is mostly zeros.
+struct map_stats {
+  size_t size;
+  size_t bucket_count;
+  // erased slots that still make probes go on past them
+  size_t tombstones;
+  float load_factor;
+  // the map itself and its tables, not memory the keys and values own
+  size_t bytes_used;
+  // probe_length_histogram[d] entries have a probe length of d
+  std::vector<size_t> probe_length_histogram;
+  size_t max_probe_length;
+  double mean_probe_length;
+  // resizes and rehash() calls since the table was built, and the time spent
+  // in them, including incremental migration steps
+  size_t rehash_count;
+  uint64_t rehash_nanoseconds;
+  // only counted when KOKOPUFFS_MAP_STATS is defined, zero otherwise
+  size_t lookups;
+  size_t lookup_probe_steps;
+};
+
+namespace detail {
+
+typedef int8_t ctrl_t;
+// Full slots have the high bit clear and hold 7 bits of the hash, so both
+// special values can be found with a single movemask.
+static const ctrl_t kCtrlEmpty = -128;  // 0b10000000
+static const ctrl_t kCtrlDeleted = -2;  // 0b11111110
+
+inline bool ctrl_is_full(ctrl_t ctrl) {
+  return ctrl >= 0;
+}
+
+// The top 7 bits of the hash go into the control byte, the low bits pick
+// the first group, which then probes other groups in triangular steps.
+inline ctrl_t h2(const size_t hash) {
+  return static_cast<ctrl_t>(hash >> (sizeof(size_t) * 8 - 7));
+}
+
+// bucket_count_ - 1 is used as the index mask, so counts have to be powers
+// of two
+inline size_t next_power_of_two(size_t n) {
+  size_t power = 1;
+  while (power < n)
+    power <<= 1;
+  return power;
+}
+
+inline uint32_t count_trailing_zeros(uint32_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return index;
+#else
+  return __builtin_ctz(x);
+#endif
+}
+
+inline void prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(p);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#else
+  (void)p;
+#endif
+}
+
+// A group of control bytes loaded at once. The match functions return a
+// bitmask with bit i set if control byte i matches.
+#if defined(__AVX2__)
+static const size_t kGroupWidth = 32;
+
+struct ctrl_group {
+  explicit ctrl_group(const ctrl_t* ctrl)
+      : ctrl_(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ctrl))) {}
+
+  uint32_t match(ctrl_t h2) const {
+    return static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl_)));
+  }
+
+  uint32_t match_empty() const {
+    return match(kCtrlEmpty);
+  }
+
+  uint32_t match_empty_or_deleted() const {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(ctrl_));
+  }
+
+  __m256i ctrl_;
+};
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+static const size_t kGroupWidth = 16;
+
+struct ctrl_group {
+  explicit ctrl_group(const ctrl_t* ctrl)
+      : ctrl_(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl))) {}
+
+  uint32_t match(ctrl_t h2) const {
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl_)));
+  }
+
+  uint32_t match_empty() const {
+    return match(kCtrlEmpty);
+  }
+
+  uint32_t match_empty_or_deleted() const {
+    return static_cast<uint32_t>(_mm_movemask_epi8(ctrl_));
+  }
+
+  __m128i ctrl_;
+};
+#else
+static const size_t kGroupWidth = 16;
+
+struct ctrl_group {
+  explicit ctrl_group(const ctrl_t* ctrl) : ctrl_(ctrl) {}
+
+  uint32_t match(ctrl_t h2) const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      if (ctrl_[i] == h2)
+        mask |= 1u << i;
+    }
+    return mask;
+  }
+
+  uint32_t match_empty() const {
+    return match(kCtrlEmpty);
+  }
+
+  uint32_t match_empty_or_deleted() const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      if (!ctrl_is_full(ctrl_[i]))
+        mask |= 1u << i;
+    }
+    return mask;
+  }
+
+  const ctrl_t* ctrl_;
+};
+#endif
+
+// Runs f(0) to f(count - 1) on count threads, f(0) on the calling one, and
+// rethrows the first exception any of them threw once they have all
+// finished.
+template <typename F>
+void run_threads(const unsigned count, F f) {
+  std::vector<std::exception_ptr> errors(count);
+  std::vector<std::thread> threads;
+  threads.reserve(count - 1);
+  for (unsigned t = 1; t < count; ++t) {
+    threads.push_back(std::thread([&f, &errors, t]() {
+      try {
+        f(t);
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    }));
+  }
+  try {
+    f(0);
+  } catch (...) {
+    errors[0] = std::current_exception();
+  }
+  for (size_t t = 0; t < threads.size(); ++t)
+    threads[t].join();
+  for (unsigned t = 0; t < count; ++t) {
+    if (errors[t])
+      std::rethrow_exception(errors[t]);
+  }
+}
+
+template <bool StoreHash>
+struct entry_hash {};
+
+template <>
+struct entry_hash<true> {
+  size_t hash;
+};
+
+// The key and value of a slot. An empty, trivial value type like the one
+// kokopuffs::set uses has no state to keep, so it becomes a static member
+// that every entry shares instead of a byte plus padding in each slot.
+template <typename Key, typename Value,
+          bool StaticValue = std::is_empty<Value>::value &&
+                             std::is_trivial<Value>::value>
+struct entry_fields {
+  Key key;
+  Value value;
+};
+
+template <typename Key, typename Value>
+struct entry_fields<Key, Value, true> {
+  Key key;
+  static Value value;
+};
+
+template <typename Key, typename Value>
+Value entry_fields<Key, Value, true>::value;
+
+// the KOKOPUFFS_MAP_STATS lookup counters
+struct map_counters {
+  map_counters() : lookups(0), probe_steps(0) {}
+
+  size_t lookups;
+  size_t probe_steps;
+};
+
+}  // namespace detail
+
+template<typename Key, typename Value,
+         typename Hash = kokopuffs::hash<Key>,
+         typename KeyEqual = kokopuffs::equal_to<Key>,
+         typename Policy = map_policy<>,
+         typename Allocator = std::allocator<std::pair<const Key, Value> > >
 class map {
+  static const bool kGroupProbing =
+      std::is_same<typename Policy::probing, group_probing>::value;
+  static const bool kRobinHood =
+      std::is_same<typename Policy::probing, robin_hood_probing>::value;
+  // only quadratic_probing keeps the slot state in the keys themselves
+  static const bool kSentinelKeys = !kGroupProbing && !kRobinHood;
+  static const bool kStoreHash =
+      Policy::store_hash == store_hash_always ||
+      (Policy::store_hash == store_hash_auto && !std::is_scalar<Key>::value);
+  static const bool kIncremental = Policy::incremental_rehash;
+  // an empty, trivial value is the one static every entry shares, so it is
+  // never constructed or destroyed per entry
+  static const bool kStaticValue =
+      std::is_empty<Value>::value && std::is_trivial<Value>::value;
+
  public:
-  struct Entry {
-    Key key;
-    Value value;
+  // has a size_t hash member as well when the policy stores hashes
+  struct Entry : detail::entry_hash<kStoreHash>,
+                 detail::entry_fields<Key, Value> {
 #ifdef KOKOPUFFS_MAP_COLLISION_DEBUG
     size_t intended_bucket;
 #endif
   };
 
-  map(const size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE)
-      : bucket_count_(initial_table_size),
+  // Forward iterator over the full slots, skipping empty and deleted ones.
+  // Insertions that resize the table invalidate all iterators; the key of an
+  // entry must not be modified through one.
+  template <bool IsConst>
+  class basic_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Entry value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef typename std::conditional<IsConst, const Entry*, Entry*>::type
+        pointer;
+    typedef typename std::conditional<IsConst, const Entry&, Entry&>::type
+        reference;
+
+    basic_iterator() : map_(nullptr), index_(0) {}
+
+    // lets an iterator convert to a const_iterator; a template, so copying
+    // is left to the implicit members
+    template <bool OtherConst,
+              typename = typename std::enable_if<IsConst && !OtherConst>::type>
+    basic_iterator(const basic_iterator<OtherConst>& other)
+        : map_(other.map_), index_(other.index_) {}
+
+    reference operator*() const {
+      return map_->_entry_at(index_);
+    }
+
+    pointer operator->() const {
+      return &map_->_entry_at(index_);
+    }
+
+    basic_iterator& operator++() {
+      ++index_;
+      _skip_unused();
+      return *this;
+    }
+
+    basic_iterator operator++(int) {
+      basic_iterator old(*this);
+      ++*this;
+      return old;
+    }
+
+    friend bool operator==(const basic_iterator& lhs,
+                           const basic_iterator& rhs) {
+      return lhs.index_ == rhs.index_ && lhs.map_ == rhs.map_;
+    }
+
+    friend bool operator!=(const basic_iterator& lhs,
+                           const basic_iterator& rhs) {
+      return !(lhs == rhs);
+    }
+
+   private:
+    friend class map;
+    friend class basic_iterator<!IsConst>;
+
+    basic_iterator(const map* m, size_t index) : map_(m), index_(index) {}
+
+    void _skip_unused() {
+      while (index_ < map_->_end_index() && !map_->_is_full_at(index_))
+        ++index_;
+    }
+
+    const map* map_;
+    size_t index_;
+  };
+
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  map(const size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE,
+      const Hash& hash = Hash(),
+      const KeyEqual& equal = KeyEqual(),
+      const Allocator& alloc = Allocator())
+      : hasher_(hash),
+        equal_(equal),
+        allocator_(alloc),
+        bucket_count_(std::max(detail::next_power_of_two(initial_table_size),
+                               kMinBucketCount)),
+        min_bucket_count_(bucket_count_),
         item_count_(0),
+        tombstone_count_(0),
         max_load_factor_(KOKOPUFFS_MAP_DEFAULT_MAX_LOAD_FACTOR),
-        min_load_factor_(KOKOPUFFS_MAP_DEFAULT_MIN_LOAD_FACTOR)
+        min_load_factor_(KOKOPUFFS_MAP_DEFAULT_MIN_LOAD_FACTOR),
+        old_table_(nullptr),
+        old_ctrl_(nullptr),
+        old_bucket_count_(0),
+        migrated_(0),
+        rehash_count_(0),
+        rehash_nanoseconds_(0)
 #ifdef KOKOPUFFS_DEBUG
         , has_set_empty_key_(false)
         , has_set_deleted_key_(false)
 #endif
   {
     table_ = create_table(bucket_count_);
+    ctrl_ = create_ctrl(bucket_count_);
   }
 
-  map(const map<Key, Value>& other)
-      : bucket_count_(other.bucket_count_),
+  map(const map& other)
+      : hasher_(other.hasher_),
+        equal_(other.equal_),
+        allocator_(alloc_traits::select_on_container_copy_construction(
+            other.allocator_)),
+        bucket_count_(other.bucket_count_),
+        min_bucket_count_(other.min_bucket_count_),
         item_count_(0),
+        tombstone_count_(0),
         max_load_factor_(other.max_load_factor_),
-        min_load_factor_(other.min_load_factor_)
+        min_load_factor_(other.min_load_factor_),
+        old_table_(nullptr),
+        old_ctrl_(nullptr),
+        old_bucket_count_(0),
+        migrated_(0),
+        rehash_count_(0),
+        rehash_nanoseconds_(0)
 #ifdef KOKOPUFFS_DEBUG
         , has_set_empty_key_(other.has_set_empty_key_)
         , has_set_deleted_key_(other.has_set_deleted_key_)
 #endif
   {
 #ifdef KOKOPUFFS_DEBUG
-    if (!other.has_set_empty_key_)
+    if (kSentinelKeys && !other.has_set_empty_key_)
       throw std::runtime_error(
           "kokopuffs::map.map(map&) other empty_key_ not set");
 #endif
     table_ = create_table(bucket_count_);
-    this->set_empty_key(*other.empty_key_);
-    if (other.deleted_key_) {
-      deleted_key_ = std::unique_ptr<Key>(new Key(*other.deleted_key_));
-    }
-    _copy_elements_from_table(
-        other.table_, other.bucket_count_,
-        *other.empty_key_,
-        static_cast<bool>(other.deleted_key_),
-        other.deleted_key_.get());
+    ctrl_ = create_ctrl(bucket_count_);
+    _copy_keys_from(other);
+    _copy_elements_from_table(other.table_, other.ctrl_, other.bucket_count_);
+    _copy_elements_from_table(other.old_table_, other.old_ctrl_,
+                              other.old_bucket_count_);
   }
 
-  map<Key, Value>& operator=(const map<Key, Value>& other) {
+  map& operator=(const map& other) {
     if (&other == this)
       return *this;
 
 #ifdef KOKOPUFFS_DEBUG
-    if (!has_set_empty_key_)
+    if (kSentinelKeys && !has_set_empty_key_)
       throw std::runtime_error(
           "kokopuffs::map.operator=(map&) empty_key_ not set");
-    if (!has_set_empty_key_)
+    if (kSentinelKeys && !other.has_set_empty_key_)
       throw std::runtime_error(
           "kokopuffs::map.operator=(map&) other empty_key_ not set");
 #endif
-    delete_table(table_, bucket_count_,
-                 *empty_key_,
-                 static_cast<bool>(deleted_key_),
-                 deleted_key_.get());
+    _delete_tables();
 
+    hasher_ = other.hasher_;
+    equal_ = other.equal_;
+    if (alloc_traits::propagate_on_container_copy_assignment::value)
+      allocator_ = other.allocator_;
     bucket_count_ = other.bucket_count_;
+    min_bucket_count_ = other.min_bucket_count_;
     item_count_ = 0;
+    tombstone_count_ = 0;
     max_load_factor_ = other.max_load_factor_;
     min_load_factor_ = other.min_load_factor_;
+    rehash_count_ = 0;
+    rehash_nanoseconds_ = 0;
 #ifdef KOKOPUFFS_DEBUG
     has_set_empty_key_ = other.has_set_empty_key_;
     has_set_deleted_key_ = other.has_set_deleted_key_;
 #endif
 
     table_ = create_table(bucket_count_);
-    this->set_empty_key(*other.empty_key_);
-    if (other.deleted_key_) {
-      deleted_key_ = std::unique_ptr<Key>(new Key(*other.deleted_key_));
-    }
-    _copy_elements_from_table(
-        other.table_, other.bucket_count_,
-        *other.empty_key_,
-        static_cast<bool>(other.deleted_key_),
-        other.deleted_key_.get());
+    ctrl_ = create_ctrl(bucket_count_);
+    _copy_keys_from(other);
+    _copy_elements_from_table(other.table_, other.ctrl_, other.bucket_count_);
+    _copy_elements_from_table(other.old_table_, other.old_ctrl_,
+                              other.old_bucket_count_);
 
     return *this;
   }
 
-  map(map<Key, Value>&& other)
-      : bucket_count_(other.bucket_count_),
+  // The tables are always freed through the allocator that made them, so
+  // moving a map takes its allocator along with them.
+  map(map&& other)
+      : hasher_(std::move(other.hasher_)),
+        equal_(std::move(other.equal_)),
+        allocator_(other.allocator_),
+        bucket_count_(other.bucket_count_),
+        min_bucket_count_(other.min_bucket_count_),
         item_count_(other.item_count_),
+        tombstone_count_(other.tombstone_count_),
         max_load_factor_(other.max_load_factor_),
         min_load_factor_(other.min_load_factor_),
-        table_(other.table_)
+        table_(other.table_),
+        ctrl_(other.ctrl_),
+        old_table_(other.old_table_),
+        old_ctrl_(other.old_ctrl_),
+        old_bucket_count_(other.old_bucket_count_),
+        migrated_(other.migrated_),
+        rehash_count_(other.rehash_count_),
+        rehash_nanoseconds_(other.rehash_nanoseconds_)
 #ifdef KOKOPUFFS_DEBUG
         , has_set_empty_key_(other.has_set_empty_key_)
         , has_set_deleted_key_(other.has_set_deleted_key_)
 #endif
   {
     other.table_ = nullptr;
-    // this cheat will basically skip over key and value destructor, and we are
-    // luck that free() works with null pointers.
+    other.ctrl_ = nullptr;
+    other.old_table_ = nullptr;
+    other.old_ctrl_ = nullptr;
+    other.old_bucket_count_ = 0;
+    // this cheat will basically skip over key and value destructor, and
+    // delete_table() skips the null tables.
     other.bucket_count_ = 0;
 
     other.empty_key_.swap(empty_key_);
     other.deleted_key_.swap(deleted_key_);
   }
 
-  map<Key, Value>& operator=(map<Key, Value>&& other) {
+  map& operator=(map&& other) {
     if (&other == this)
       return *this;
 
 #ifdef KOKOPUFFS_DEBUG
-    if (!has_set_empty_key_)
+    if (kSentinelKeys && !has_set_empty_key_)
       throw std::runtime_error("kokopuffs::map.operator=(map&&) empty_key_ not set");
 #endif
-    delete_table(table_, bucket_count_,
-                 *empty_key_,
-                 static_cast<bool>(deleted_key_),
-                 deleted_key_.get());
+    _delete_tables();
 
+    hasher_ = std::move(other.hasher_);
+    equal_ = std::move(other.equal_);
+    allocator_ = other.allocator_;
     bucket_count_ = other.bucket_count_;
+    min_bucket_count_ = other.min_bucket_count_;
     item_count_ = other.item_count_;
+    tombstone_count_ = other.tombstone_count_;
     max_load_factor_ = other.max_load_factor_;
     min_load_factor_ = other.min_load_factor_;
     table_ = other.table_;
+    ctrl_ = other.ctrl_;
+    old_table_ = other.old_table_;
+    old_ctrl_ = other.old_ctrl_;
+    old_bucket_count_ = other.old_bucket_count_;
+    migrated_ = other.migrated_;
+    rehash_count_ = other.rehash_count_;
+    rehash_nanoseconds_ = other.rehash_nanoseconds_;
 #ifdef KOKOPUFFS_DEBUG
     has_set_empty_key_ = other.has_set_empty_key_;
     has_set_deleted_key_ = other.has_set_deleted_key_;
 #endif
 
     other.table_ = nullptr;
+    other.ctrl_ = nullptr;
+    other.old_table_ = nullptr;
+    other.old_ctrl_ = nullptr;
+    other.old_bucket_count_ = 0;
     // see move constructor above
     other.bucket_count_ = 0;
 
@@ -169,21 +610,21 @@ class map {
 
   ~map() {
 #ifdef KOKOPUFFS_DEBUG
-    if (!has_set_empty_key_)
+    if (kSentinelKeys && !has_set_empty_key_)
       throw std::runtime_error("kokopuffs::map.~map() empty_key_ not set");
 #endif
-    delete_table(table_, bucket_count_,
-                 *empty_key_,
-                 static_cast<bool>(deleted_key_),
-                 deleted_key_.get());
+    _delete_tables();
   }
 
   void set_empty_key(const Key& key) {
-    empty_key_ = std::unique_ptr<Key>(new Key(key));
 #ifdef KOKOPUFFS_DEBUG
     has_set_empty_key_ = true;
 #endif
+    // slot state lives in ctrl_, so there is nothing to fill the table with
+    if (!kSentinelKeys)
+      return;
 
+    empty_key_ = std::unique_ptr<Key>(new Key(key));
     for (size_t i = 0; i < bucket_count_; ++i) {
       Entry& entry = table_[i];
       new (&entry.key) Key(*empty_key_);
@@ -192,46 +633,222 @@ class map {
 
 
   void set_deleted_key(const Key& key) {
-    deleted_key_ = std::unique_ptr<Key>(new Key(key));
 #ifdef KOKOPUFFS_DEBUG
     has_set_deleted_key_ = true;
 #endif
+    if (!kSentinelKeys)
+      return;
+
+    deleted_key_ = std::unique_ptr<Key>(new Key(key));
   }
 
   Value& operator[](const Key& key) {
-#ifdef KOKOPUFFS_DEBUG
-    if (!has_set_empty_key_)
-      throw std::runtime_error("kokopuffs::map.operator[] empty_key_ not set");
-#endif
+    // the insert may resize, so table_ must only be read afterwards
+    const size_t index = _find_or_insert(key).first;
+    return _entry_at(index).value;
+  }
 
-    const uint32_t hash = get_hash(key);
-    return _find_or_insert(key, hash);
+  Value& operator[](Key&& key) {
+    const size_t index = _find_or_insert(std::move(key)).first;
+    return _entry_at(index).value;
+  }
+
+  // Constructs the value in place from args if key is not in the map yet.
+  // Nothing is moved from key or args when it already is.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    return _to_iterator(_find_or_insert(key, std::forward<Args>(args)...));
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+    return _to_iterator(
+        _find_or_insert(std::move(key), std::forward<Args>(args)...));
+  }
+
+  // Same as try_emplace(), the key is always looked up before anything is
+  // constructed.
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(const Key& key, Args&&... args) {
+    return try_emplace(key, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(Key&& key, Args&&... args) {
+    return try_emplace(std::move(key), std::forward<Args>(args)...);
+  }
+
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+    return _insert_or_assign(key, std::forward<M>(obj));
+  }
+
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+    return _insert_or_assign(std::move(key), std::forward<M>(obj));
+  }
+
+  // Inserts every (first, second) pair that is not in the map yet. Forward
+  // ranges reserve room for all of them up front, so the table is resized at
+  // most once.
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+    _reserve_for(first, last,
+                 typename std::iterator_traits<InputIt>::iterator_category());
+    for (; first != last; ++first)
+      try_emplace(first->first, first->second);
+  }
+
+  // Inserts keys[i] with values[i] for every key that is not in the map yet,
+  // like the range insert, and returns how many were. The table is grown for
+  // all n up front, then keys are hashed and their home buckets prefetched
+  // kBatchSize at a time, so the cache misses of a batch overlap instead of
+  // being taken one after another.
+  size_t insert_batch(const Key* keys, const Value* values, const size_t n) {
+    reserve(size() + n);
+    size_t inserted = 0;
+    size_t hashes[kBatchSize];
+    for (size_t begin = 0; begin < n; begin += kBatchSize) {
+      const size_t count = std::min(n - begin, kBatchSize);
+      _prefetch_batch(keys + begin, count, hashes);
+      for (size_t i = 0; i < count; ++i) {
+        inserted += _find_or_insert_hashed(hashes[i], keys[begin + i],
+                                           values[begin + i]).second;
+      }
+    }
+    return inserted;
   }
 
   size_t erase(const Key& key) {
-#ifdef KOKOPUFFS_DEBUG
-    if (!has_set_deleted_key_)
-      throw std::runtime_error("kokopuffs::map.erase() deleted_key_ not set");
-#endif
+    return _erase(key);
+  }
 
-    const uint32_t hash = get_hash(key);
-    size_t index = (size_t)-1;
-    if (!_find_bucket(key, hash, index)) {
-      return 0;
+  // Heterogeneous erase, only available when both Hash and KeyEqual are
+  // transparent (the defaults are for string keys).
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, size_t>::type
+  erase(const K& key) {
+    return _erase(key);
+  }
+
+  iterator begin() {
+    iterator it(this, 0);
+    it._skip_unused();
+    return it;
+  }
+
+  const_iterator begin() const {
+    const_iterator it(this, 0);
+    it._skip_unused();
+    return it;
+  }
+
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  iterator end() {
+    return iterator(this, _end_index());
+  }
+
+  const_iterator end() const {
+    return const_iterator(this, _end_index());
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+  // Unlike operator[], find(), at(), count() and contains() never insert or
+  // resize the table.
+  iterator find(const Key& key) {
+    return iterator(this, _find_index(key));
+  }
+
+  const_iterator find(const Key& key) const {
+    return const_iterator(this, _find_index(key));
+  }
+
+  // Stores find(keys[i]) in out[i] for every i < n. Keys are hashed and
+  // their home buckets prefetched kBatchSize at a time before any of them is
+  // probed, so a batch costs about one cache miss instead of one per key.
+  void find_batch(const Key* keys, const size_t n, iterator* out) {
+    size_t hashes[kBatchSize];
+    for (size_t begin = 0; begin < n; begin += kBatchSize) {
+      const size_t count = std::min(n - begin, kBatchSize);
+      _prefetch_batch(keys + begin, count, hashes);
+      for (size_t i = 0; i < count; ++i)
+        out[begin + i] = iterator(this, _find_index_hashed(keys[begin + i],
+                                                           hashes[i]));
     }
+  }
 
-    Entry& entry = table_[index];
-    entry.key = *deleted_key_;
-    entry.value.~Value();
+  void find_batch(const Key* keys, const size_t n, const_iterator* out) const {
+    size_t hashes[kBatchSize];
+    for (size_t begin = 0; begin < n; begin += kBatchSize) {
+      const size_t count = std::min(n - begin, kBatchSize);
+      _prefetch_batch(keys + begin, count, hashes);
+      for (size_t i = 0; i < count; ++i)
+        out[begin + i] = const_iterator(
+            this, _find_index_hashed(keys[begin + i], hashes[i]));
+    }
+  }
 
-    --item_count_;
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, iterator>::type
+  find(const K& key) {
+    return iterator(this, _find_index(key));
+  }
 
-    return 1;
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, const_iterator>::type
+  find(const K& key) const {
+    return const_iterator(this, _find_index(key));
+  }
+
+  Value& at(const Key& key) {
+    return _entry_at(_at_index(key)).value;
+  }
+
+  const Value& at(const Key& key) const {
+    return _entry_at(_at_index(key)).value;
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, Value&>::type
+  at(const K& key) {
+    return _entry_at(_at_index(key)).value;
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, const Value&>::type
+  at(const K& key) const {
+    return _entry_at(_at_index(key)).value;
+  }
+
+  size_t count(const Key& key) const {
+    return contains(key) ? 1 : 0;
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, size_t>::type
+  count(const K& key) const {
+    return contains(key) ? 1 : 0;
+  }
+
+  bool contains(const Key& key) const {
+    return _find_index(key) != _end_index();
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, bool>::type
+  contains(const K& key) const {
+    return _find_index(key) != _end_index();
   }
 
   void _debug() {
 #ifdef KOKOPUFFS_DEBUG
-    if (!has_set_empty_key_)
+    if (kSentinelKeys && !has_set_empty_key_)
       throw std::runtime_error("kokopuffs::map._debug() empty_key_ not set");
 #endif
 
@@ -244,16 +861,24 @@ class map {
     ss << "item_count_: " << item_count_ << "\n";
     ss << "bucket_count_: " << bucket_count_ << "\n";
     ss << "load: " << load_factor() << "\n";
+    if (_migrating()) {
+      ss << "migrating from " << old_bucket_count_ << " buckets, "
+         << migrated_ << " done\n";
+    }
     for (size_t i = 0; i < bucket_count_; ++i) {
       Entry& entry = table_[i];
       ss << "bucket " << i << ": ";
-      if (entry.key == *empty_key_) {
+      if (_is_empty(table_, ctrl_, i)) {
           ss << "empty ";
-      } else if (deleted_key_ && entry.key == *deleted_key_) {
+      } else if (!_is_full(table_, ctrl_, i)) {
           ss << "deleted ";
       } else {
         ss << "key: " << entry.key << " ";
         ss << "value: " << entry.value << " ";
+        if (kGroupProbing)
+          ss << "ctrl: " << static_cast<int>(ctrl_[i]) << " ";
+        if (kRobinHood)
+          ss << "distance: " << _robin_hood_distance(i) << " ";
 #ifdef KOKOPUFFS_MAP_COLLISION_DEBUG
         ss << "intended_bucket: " << entry.intended_bucket << " ";
 #endif
@@ -264,27 +889,139 @@ class map {
     cout << ss.str();
   }
 
-  uint32_t fnv1a(const uint8_t* data, size_t n) {
-    uint32_t hash = 2166136261; // offset_basis
-    for (size_t i = 0; i < n; ++i) {
-      hash ^= data[i];
-      hash *= 16777619; // FNV_prime
-    }
-    return hash;
+  // Walks the slots once without printing anything, so unlike _debug() it
+  // is fine on big tables. Keys are hashed again unless their hashes are
+  // stored.
+  map_stats stats() const {
+#ifdef KOKOPUFFS_DEBUG
+    if (kSentinelKeys && !has_set_empty_key_)
+      throw std::runtime_error("kokopuffs::map.stats() empty_key_ not set");
+#endif
+
+    map_stats s;
+    s.size = item_count_;
+    s.bucket_count = bucket_count_;
+    s.tombstones = 0;
+    s.load_factor = load_factor();
+    s.bytes_used = sizeof(*this) + _table_bytes(bucket_count_) +
+                   _table_bytes(old_bucket_count_);
+    s.max_probe_length = 0;
+    size_t total_probe_length = 0;
+    _add_slot_stats(table_, ctrl_, bucket_count_, s, total_probe_length);
+    _add_slot_stats(old_table_, old_ctrl_, old_bucket_count_, s,
+                    total_probe_length);
+    s.mean_probe_length =
+        item_count_ ? total_probe_length / static_cast<double>(item_count_) : 0;
+    s.rehash_count = rehash_count_;
+    s.rehash_nanoseconds = rehash_nanoseconds_;
+#ifdef KOKOPUFFS_MAP_STATS
+    s.lookups = counters_.lookups;
+    s.lookup_probe_steps = counters_.probe_steps;
+#else
+    s.lookups = 0;
+    s.lookup_probe_steps = 0;
+#endif
+    return s;
+  }
+
+  template <typename K>
+  size_t get_hash(const K& key) const {
+    return hasher_(key);
+  }
+
+  Hash hash_function() const {
+    return hasher_;
   }
 
-  uint32_t get_hash(const Key& key) {
-    return fnv1a(reinterpret_cast<const uint8_t*>(&key[0]), key.size());
+  KeyEqual key_eq() const {
+    return equal_;
+  }
+
+  Allocator get_allocator() const {
+    return allocator_;
   }
 
   size_t size() const noexcept {
     return item_count_;
   }
 
+  bool empty() const noexcept {
+    return item_count_ == 0;
+  }
+
+  size_t bucket_count() const noexcept {
+    return bucket_count_;
+  }
+
   float load_factor() const noexcept {
     return this->size() / static_cast<float>(bucket_count_);
   }
 
+  // Sets the bucket count to at least n, and at least enough for size() under
+  // the max load factor, rounded up to a power of two. The table never
+  // shrinks below that on its own afterwards. rehash(0) shrinks it to fit,
+  // which lowers that floor to the fitted size rather than removing it.
+  void rehash(size_t n) {
+    const size_t new_bucket_count = _rehash_bucket_count(n);
+    min_bucket_count_ = new_bucket_count;
+    if (new_bucket_count != bucket_count_)
+      _resize(new_bucket_count);
+  }
+
+  // rehash() on threads threads, hardware_concurrency() of them if 0. The
+  // new table is cut into contiguous bucket ranges, and each thread moves
+  // over the entries whose probes start in the ranges it takes. The few
+  // whose probes would run out of their range are inserted afterwards on
+  // the calling thread. Tables under a few ranges' worth of buckets are
+  // rehashed on the calling thread alone.
+  void parallel_rehash(size_t n, unsigned threads = 0) {
+    const size_t new_bucket_count = _rehash_bucket_count(n);
+    min_bucket_count_ = new_bucket_count;
+    if (new_bucket_count != bucket_count_)
+      _parallel_rebuild(new_bucket_count,
+                        static_cast<const std::pair<Key, Value>*>(nullptr), 0,
+                        threads);
+  }
+
+  // Makes room for n elements in total without any further resize. Unlike
+  // rehash() this never shrinks the table.
+  void reserve(size_t n) {
+    const size_t count = static_cast<size_t>(
+        std::ceil(n / static_cast<double>(max_load_factor_)));
+    if (count > bucket_count_)
+      rehash(count);
+    else
+      min_bucket_count_ = std::max(min_bucket_count_,
+                                   detail::next_power_of_two(count));
+  }
+
+  // The range insert on threads threads, for building big maps from random
+  // access ranges of pairs. The existing entries and the range go into a
+  // table sized for both at once, split up like in parallel_rehash(). Keys
+  // already in the map are skipped, and of keys repeated in the range the
+  // first one wins, like with insert(first, last).
+  template <typename RandomIt>
+  void parallel_insert(RandomIt first, RandomIt last, unsigned threads = 0) {
+    const size_t n = static_cast<size_t>(last - first);
+    const size_t count = static_cast<size_t>(
+        std::ceil((size() + n) / static_cast<double>(max_load_factor_)));
+    const size_t new_bucket_count =
+        std::max(bucket_count_, detail::next_power_of_two(count));
+    min_bucket_count_ = std::max(min_bucket_count_, new_bucket_count);
+    _parallel_rebuild(new_bucket_count, first, n, threads);
+  }
+
+  // Rebuilds the table at its current size, which drops every tombstone and
+  // with them the probe steps erased entries still cost. Inserts do this on
+  // their own once live entries and tombstones together fill too much of
+  // the table.
+  void compact() {
+    if (_migrating())
+      _migrate(old_bucket_count_);
+    if (tombstone_count_ != 0)
+      _resize(bucket_count_);
+  }
+
   void max_load_factor(float z) {
     max_load_factor_ = std::max(0.001f, std::min(z, 1.0f));
     _maybe_resize();
@@ -296,69 +1033,420 @@ class map {
   }
 
  private:
-  static Entry* create_table(size_t bucket_count) {
-    size_t n = bucket_count * sizeof(Entry);
-    Entry* table  = (Entry*)malloc(n);
-    ::memset(table, 0, n);
+  // concurrent_map hashes each key once, to pick its shard, and hands the
+  // hash on to the _hashed() lookups
+  template <typename, typename, typename, typename, typename, typename>
+  friend class concurrent_map;
+
+  // group_probing works on whole groups, so the table is never smaller than
+  // one group
+  static const size_t kMinBucketCount = kGroupProbing ? detail::kGroupWidth : 1;
+  // largest distance robin_hood_probing can store in a control byte, which
+  // with IncrementalRehash also has to leave room for kRobinHoodErased
+  static const size_t kMaxProbeDistance = kIncremental ? 253 : 254;
+  // robin_hood_probing control byte of an entry erased from old_table_, where
+  // entries must not be shifted while it is being migrated
+  static const detail::ctrl_t kRobinHoodErased = -1;
+  // slots of old_table_ moved over per insert or erase. With the default
+  // load factors, growing leaves room for old_bucket_count_ / 2 more inserts
+  // before the next resize and shrinking for a tenth of that, so migrating
+  // finishes well ahead of either.
+  static const size_t kMigrateSlots = 64;
+  // keys hashed and prefetched together by find_batch() and insert_batch(),
+  // about as many misses as a core can have in flight
+  static const size_t kBatchSize = 32;
+  // smallest bucket range a parallel rebuild gives a thread at once. Only
+  // probes that start near its end can run out of it.
+  static const size_t kMinRegionSize = 1 << 14;
+  // sources each thread of a parallel rebuild hashes and sorts at once; its
+  // buffers, 32 bytes a source, are most of the extra memory a rebuild takes
+  static const size_t kRebuildSlice = 1 << 16;
+
+  typedef std::allocator_traits<Allocator> alloc_traits;
+  typedef typename alloc_traits::template rebind_alloc<Entry> entry_allocator;
+  typedef typename alloc_traits::template rebind_alloc<detail::ctrl_t>
+      ctrl_allocator;
+
+  Entry* create_table(size_t bucket_count) {
+    entry_allocator alloc(allocator_);
+    Entry* table = std::allocator_traits<entry_allocator>::allocate(
+        alloc, bucket_count);
+    // the ctrl_ based modes only construct keys in full slots
+    if (kSentinelKeys)
+      ::memset(table, 0, bucket_count * sizeof(Entry));
     return table;
   }
 
-  static void delete_table(Entry* table,
-                           const size_t bucket_count,
-                           const Key& empty_key,
-                           const bool has_delete,
-                           const Key* deleted_key)
-  {
+  detail::ctrl_t* create_ctrl(size_t bucket_count) {
+    if (kSentinelKeys)
+      return nullptr;
+    ctrl_allocator alloc(allocator_);
+    detail::ctrl_t* ctrl = std::allocator_traits<ctrl_allocator>::allocate(
+        alloc, bucket_count);
+    ::memset(ctrl, _empty_ctrl(), bucket_count);
+    return ctrl;
+  }
+
+  static detail::ctrl_t _empty_ctrl() {
+    return kRobinHood ? 0 : detail::kCtrlEmpty;
+  }
+
+  void delete_table(Entry* table, detail::ctrl_t* ctrl,
+                    const size_t bucket_count) {
     for (size_t i = 0; i < bucket_count; ++i) {
       Entry& entry = table[i];
-      if (entry.key != empty_key) {
-        if (!has_delete || (has_delete && entry.key != *deleted_key)) {
-          entry.value.~Value();
-        }
+      const bool full = _is_full(table, ctrl, i);
+      if (full && !kStaticValue)
+        entry.value.~Value();
+      if (full || kSentinelKeys)
+        entry.key.~Key();
+    }
+    // moved-from maps have neither
+    if (table) {
+      entry_allocator alloc(allocator_);
+      std::allocator_traits<entry_allocator>::deallocate(
+          alloc, table, bucket_count);
+    }
+    if (ctrl) {
+      ctrl_allocator alloc(allocator_);
+      std::allocator_traits<ctrl_allocator>::deallocate(
+          alloc, ctrl, bucket_count);
+    }
+  }
+
+  void _delete_tables() {
+    delete_table(table_, ctrl_, bucket_count_);
+    delete_table(old_table_, old_ctrl_, old_bucket_count_);
+    old_table_ = nullptr;
+    old_ctrl_ = nullptr;
+    old_bucket_count_ = 0;
+    migrated_ = 0;
+  }
+
+  bool _is_empty(const Entry* table, const detail::ctrl_t* ctrl,
+                 size_t i) const {
+    if (!kSentinelKeys)
+      return ctrl[i] == _empty_ctrl();
+    return equal_(table[i].key, *empty_key_);
+  }
+
+  bool _is_full(const Entry* table, const detail::ctrl_t* ctrl,
+                size_t i) const {
+    if (kGroupProbing)
+      return detail::ctrl_is_full(ctrl[i]);
+    if (kRobinHood)
+      return ctrl[i] != 0 && (!kIncremental || ctrl[i] != kRobinHoodErased);
+    const Key& key = table[i].key;
+    if (equal_(key, *empty_key_))
+      return false;
+    return !deleted_key_ || !equal_(key, *deleted_key_);
+  }
+
+  void _copy_keys_from(const map& other) {
+    if (!kSentinelKeys)
+      return;
+    this->set_empty_key(*other.empty_key_);
+    if (other.deleted_key_) {
+      deleted_key_ = std::unique_ptr<Key>(new Key(*other.deleted_key_));
+    }
+  }
+
+  size_t _table_bytes(const size_t bucket_count) const {
+    return bucket_count * (sizeof(Entry) + (kSentinelKeys ? 0 : 1));
+  }
+
+  void _add_slot_stats(const Entry* table, const detail::ctrl_t* ctrl,
+                       const size_t bucket_count, map_stats& s,
+                       size_t& total_probe_length) const {
+    for (size_t i = 0; i < bucket_count; ++i) {
+      if (!_is_full(table, ctrl, i)) {
+        if (!_is_empty(table, ctrl, i))
+          ++s.tombstones;
+        continue;
       }
+      const size_t length =
+          _probe_length(bucket_count, i, _entry_hash(table[i]));
+      if (length >= s.probe_length_histogram.size())
+        s.probe_length_histogram.resize(length + 1);
+      ++s.probe_length_histogram[length];
+      s.max_probe_length = std::max(s.max_probe_length, length);
+      total_probe_length += length;
+    }
+  }
+
+  // Steps along hash's probe sequence until it reaches slot index, which
+  // every sequence does in a power of two sized table.
+  size_t _probe_length(const size_t bucket_count, const size_t index,
+                       const size_t hash) const {
+    if (kRobinHood)
+      return (index - hash) & (bucket_count - 1);
+
+    if (kGroupProbing) {
+      const size_t group_mask = bucket_count / detail::kGroupWidth - 1;
+      const size_t target = index / detail::kGroupWidth;
+      size_t group = hash & group_mask;
+      size_t steps = 0;
+      while (group != target) {
+        ++steps;
+        group = (group + steps) & group_mask;
+      }
+      return steps;
+    }
+
+    const size_t mask = bucket_count - 1;
+    const size_t start_index = hash & mask;
+    size_t steps = 0;
+    while (((start_index + (steps * (steps + 1)) / 2) & mask) != index)
+      ++steps;
+    return steps;
+  }
+
+  // the KOKOPUFFS_MAP_STATS counters, which compile away without it
+  void _count_lookup() const {
+#ifdef KOKOPUFFS_MAP_STATS
+    ++counters_.lookups;
+#endif
+  }
+
+  void _count_probe_step() const {
+#ifdef KOKOPUFFS_MAP_STATS
+    ++counters_.probe_steps;
+#endif
+  }
+
+  void _add_rehash_time(const std::chrono::steady_clock::time_point start) {
+    rehash_nanoseconds_ += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+  }
+
+  template <typename K>
+  size_t _erase(const K& key) {
+    return _erase_hashed(key, get_hash(key));
+  }
+
+  template <typename K>
+  size_t _erase_hashed(const K& key, const size_t hash) {
+#ifdef KOKOPUFFS_DEBUG
+    if (kSentinelKeys && !has_set_deleted_key_)
+      throw std::runtime_error("kokopuffs::map.erase() deleted_key_ not set");
+#endif
+
+    if (_migrating())
+      _migrate(kMigrateSlots);
+
+    size_t index = (size_t)-1;
+    if (!_find_bucket(key, hash, index)) {
+      if (!_find_old_bucket(key, hash, index))
+        return 0;
+      _erase_old(index);
+      --item_count_;
+      return 1;
+    }
+
+    Entry& entry = table_[index];
+    if (kRobinHood) {
+      _robin_hood_erase(index);
+    } else if (kGroupProbing) {
       entry.key.~Key();
+      if (!kStaticValue)
+        entry.value.~Value();
+      ctrl_[index] = _erased_ctrl(index);
+      if (ctrl_[index] == detail::kCtrlDeleted)
+        ++tombstone_count_;
+    } else {
+      entry.key = *deleted_key_;
+      if (!kStaticValue)
+        entry.value.~Value();
+      ++tombstone_count_;
     }
-    ::free(table);
+
+    --item_count_;
+
+    return 1;
   }
 
-  Value& _find_or_insert(const Key& key, uint32_t hash) {
+  // index of key's slot, or _end_index() if missing
+  template <typename K>
+  size_t _find_index(const K& key) const {
+    return _find_index_hashed(key, get_hash(key));
+  }
+
+  template <typename K>
+  size_t _find_index_hashed(const K& key, const size_t hash) const {
+#ifdef KOKOPUFFS_DEBUG
+    if (kSentinelKeys && !has_set_empty_key_)
+      throw std::runtime_error("kokopuffs::map.find() empty_key_ not set");
+#endif
+
+    size_t index = (size_t)-1;
+    if (_find_bucket(key, hash, index))
+      return index;
+    if (_find_old_bucket(key, hash, index))
+      return bucket_count_ + index;
+    return _end_index();
+  }
+
+  // Hashes count keys into hashes and prefetches the slots their probes
+  // start at. With group_probing the control bytes come first, and once
+  // they have arrived the first slot whose tag matches is prefetched too,
+  // which is where a hit will be found.
+  void _prefetch_batch(const Key* keys, const size_t count,
+                       size_t* hashes) const {
+    for (size_t i = 0; i < count; ++i) {
+      hashes[i] = get_hash(keys[i]);
+      const size_t home = _home_slot(hashes[i]);
+      if (!kSentinelKeys)
+        detail::prefetch(ctrl_ + home);
+      if (!kGroupProbing)
+        detail::prefetch(table_ + home);
+    }
+    if (!kGroupProbing)
+      return;
+    for (size_t i = 0; i < count; ++i) {
+      const size_t home = _home_slot(hashes[i]);
+      const uint32_t match =
+          detail::ctrl_group(ctrl_ + home).match(detail::h2(hashes[i]));
+      if (match)
+        detail::prefetch(table_ + home + detail::count_trailing_zeros(match));
+    }
+  }
+
+  // First slot a probe for hash looks at, the start of its group with
+  // group_probing.
+  size_t _home_slot(const size_t hash) const {
+    if (kGroupProbing)
+      return (hash & (bucket_count_ / detail::kGroupWidth - 1)) *
+             detail::kGroupWidth;
+    return hash & (bucket_count_ - 1);
+  }
+
+  template <typename K>
+  size_t _at_index(const K& key) const {
+    const size_t index = _find_index(key);
+    if (index == _end_index())
+      throw std::out_of_range("kokopuffs::map.at() key not found");
+    return index;
+  }
+
+  // Returns the index of key's slot, and whether it was inserted with a
+  // value constructed from args.
+  template <typename K, typename... Args>
+  std::pair<size_t, bool> _find_or_insert(K&& key, Args&&... args) {
+    const size_t hash = get_hash(key);
+    return _find_or_insert_hashed(hash, std::forward<K>(key),
+                                  std::forward<Args>(args)...);
+  }
+
+  template <typename K, typename... Args>
+  std::pair<size_t, bool> _find_or_insert_hashed(const size_t hash, K&& key,
+                                                 Args&&... args) {
+#ifdef KOKOPUFFS_DEBUG
+    if (kSentinelKeys && !has_set_empty_key_)
+      throw std::runtime_error("kokopuffs::map.operator[] empty_key_ not set");
+#endif
+
+    if (_migrating())
+      _migrate(kMigrateSlots);
+
 refind_slot:
     size_t index = (size_t)-1;
     if (_find_bucket(key, hash, index)) {
-      return table_[index].value;
+      return std::make_pair(index, false);
+    }
+    size_t old_index;
+    if (_find_old_bucket(key, hash, old_index)) {
+      return std::make_pair(bucket_count_ + old_index, false);
     }
 
     if (_maybe_resize()) {
       goto refind_slot;
     }
+    if (index == (size_t)-1)
+      throw std::runtime_error("kokopuffs::map hash table completely full");
+
+    // A probe distance that does not fit in the control byte is treated
+    // like a full table. If the table is already sparse, the hash puts too
+    // many keys in the same place for growing to help, and the grown table
+    // would just shrink back on the next insert.
+    if (kRobinHood && !_robin_hood_make_room(index, hash)) {
+      if (item_count_ * 8 < bucket_count_ ||
+          load_factor() / 2 < min_load_factor_)
+        throw std::overflow_error("kokopuffs::map probe distance overflow");
+      _resize(bucket_count_ * 2);
+      goto refind_slot;
+    }
 
-    Entry& entry = table_[index];
-    _emplace_entry(entry, key, hash);
-    return entry.value;
+    // _find_bucket() hands out the first tombstone on the probe if it saw one
+    if (!kRobinHood && !_is_empty(table_, ctrl_, index))
+      --tombstone_count_;
+    _emplace_entry(index, std::forward<K>(key), hash,
+                   std::forward<Args>(args)...);
+    return std::make_pair(index, true);
   }
 
-  template <typename... Args>
-  void _emplace_entry(Entry& entry,
-                      const Key& key, uint32_t hash, Args&&... args) {
+  template <typename K, typename M>
+  std::pair<iterator, bool> _insert_or_assign(K&& key, M&& obj) {
+    const size_t hash = get_hash(key);
+    return _insert_or_assign_hashed(hash, std::forward<K>(key),
+                                    std::forward<M>(obj));
+  }
+
+  template <typename K, typename M>
+  std::pair<iterator, bool> _insert_or_assign_hashed(const size_t hash,
+                                                     K&& key, M&& obj) {
+    const std::pair<size_t, bool> result = _find_or_insert_hashed(
+        hash, std::forward<K>(key), std::forward<M>(obj));
+    if (!result.second)
+      _entry_at(result.first).value = std::forward<M>(obj);
+    return _to_iterator(result);
+  }
+
+  template <typename InputIt>
+  void _reserve_for(InputIt first, InputIt last, std::forward_iterator_tag) {
+    reserve(size() + static_cast<size_t>(std::distance(first, last)));
+  }
+
+  template <typename InputIt>
+  void _reserve_for(InputIt, InputIt, std::input_iterator_tag) {}
+
+  std::pair<iterator, bool> _to_iterator(
+      const std::pair<size_t, bool>& result) {
+    return std::make_pair(iterator(this, result.first), result.second);
+  }
+
+  template <typename K, typename... Args>
+  void _emplace_entry(const size_t index,
+                      K&& key, size_t hash, Args&&... args) {
 #ifdef KOKOPUFFS_DEBUG
-    if (!has_set_empty_key_)
+    if (kSentinelKeys && !has_set_empty_key_)
       throw std::runtime_error("kokopuffs::map.deleted_key_ not set");
 #endif
 
-    if (entry.key != *empty_key_) {
-      if (!deleted_key_) {
-        return;
-      } else {
-        if (entry.key != *deleted_key_) {
-          return;
-        }
-      }
-    }
+    if (_is_full(table_, ctrl_, index))
+      return;
 
     item_count_++;
-    entry.key.~Key();
-    new (&entry.key) Key(key);
-    new (&entry.value) Value(args...);
+    _construct_entry(index, std::forward<K>(key), hash,
+                     std::forward<Args>(args)...);
+  }
+
+  // Fills the free slot index without counting the entry.
+  template <typename K, typename... Args>
+  void _construct_entry(const size_t index, K&& key, const size_t hash,
+                        Args&&... args) {
+    Entry& entry = table_[index];
+    _set_entry_hash(entry, hash, std::integral_constant<bool, kStoreHash>());
+    if (kGroupProbing)
+      ctrl_[index] = detail::h2(hash);
+    else if (kRobinHood)
+      ctrl_[index] = static_cast<detail::ctrl_t>(
+          _probe_distance(index, hash) + 1);
+    else
+      entry.key.~Key();
+    new (&entry.key) Key(std::forward<K>(key));
+    if (!kStaticValue)
+      new (&entry.value) Value(std::forward<Args>(args)...);
 #ifdef KOKOPUFFS_MAP_COLLISION_DEBUG
     entry.intended_bucket = hash & (bucket_count_ - 1);
 #endif
@@ -370,68 +1458,524 @@ refind_slot:
     if (load > max_load_factor_) {
       new_bucket_count = bucket_count_ * 2;
     } else if (bucket_count_ > KOKOPUFFS_MAP_INTIAL_SIZE &&
+               bucket_count_ / 2 >= min_bucket_count_ &&
                load < min_load_factor_) {
       new_bucket_count = bucket_count_ / 2;
+    } else if (item_count_ + tombstone_count_ >
+               bucket_count_ * (1 + max_load_factor_) / 2) {
+      // insert and erase churn at a steady size fills the table with
+      // tombstones, so it is rebuilt at the same size before probes get long
+      new_bucket_count = bucket_count_;
     } else {
       return false;
     }
 
+    if (kIncremental)
+      _begin_migration(new_bucket_count);
+    else
+      _resize(new_bucket_count);
+    return true;
+  }
+
+  void _resize(const size_t new_bucket_count) {
+    _begin_migration(new_bucket_count);
+    _migrate(old_bucket_count_);
+  }
+
+  // Swaps in an empty table of new_bucket_count slots, keeping the current
+  // one as old_table_ until _migrate() has moved all of its elements over.
+  void _begin_migration(const size_t new_bucket_count) {
+    if (old_table_)
+      _migrate(old_bucket_count_);
+
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    ++rehash_count_;
+    old_table_ = table_;
+    old_ctrl_ = ctrl_;
+    old_bucket_count_ = bucket_count_;
+    migrated_ = 0;
+
+    bucket_count_ = new_bucket_count;
+    table_ = create_table(bucket_count_);
+    ctrl_ = create_ctrl(bucket_count_);
+    tombstone_count_ = 0;
+    if (kSentinelKeys)
+      set_empty_key(*empty_key_);
+    _add_rehash_time(start);
+  }
+
+  // Moves the next n slots of old_table_ into the current table, and frees
+  // old_table_ once all of them have been. The moved slots are left empty,
+  // so delete_table() only has to free the memory.
+  void _migrate(const size_t n) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    const size_t end = migrated_ + std::min(n, old_bucket_count_ - migrated_);
+    for (; migrated_ < end; ++migrated_) {
+      const size_t i = migrated_;
+      if (!_is_full(old_table_, old_ctrl_, i))
+        continue;
+      Entry& old_entry = old_table_[i];
+
+      const size_t hash = _entry_hash(old_entry);
+      const size_t new_index = _find_empty_slot(hash);
+      _emplace_entry(new_index, std::move(old_entry.key), hash,
+                     std::move(old_entry.value));
+      // it was counted again by _emplace_entry()
+      --item_count_;
+      _clear_moved_from(old_table_, old_ctrl_, i);
+    }
+
+    if (migrated_ == old_bucket_count_) {
+      delete_table(old_table_, old_ctrl_, old_bucket_count_);
+      old_table_ = nullptr;
+      old_ctrl_ = nullptr;
+      old_bucket_count_ = 0;
+      migrated_ = 0;
+    }
+    _add_rehash_time(start);
+  }
+
+  // Marks slot i of a table empty once its entry has been moved out.
+  void _clear_moved_from(Entry* table, detail::ctrl_t* ctrl, const size_t i) {
+    Entry& entry = table[i];
+    if (!kStaticValue)
+      entry.value.~Value();
+    if (!kSentinelKeys) {
+      entry.key.~Key();
+      ctrl[i] = _empty_ctrl();
+    } else {
+      // a moved-from key could look like anything, sentinels included
+      entry.key = *empty_key_;
+    }
+  }
+
+  size_t _rehash_bucket_count(const size_t n) const {
+    const size_t needed = static_cast<size_t>(
+        std::ceil(item_count_ / static_cast<double>(max_load_factor_)));
+    return std::max(detail::next_power_of_two(std::max(n, needed)),
+                    kMinBucketCount);
+  }
+
+  // Moves every entry, together with the n pairs from first on that are not
+  // in the map yet, into a new table of new_bucket_count slots.
+  //
+  // Sources are taken kRebuildSlice per thread at a time. Each thread hashes
+  // its slice and counting sorts it by the range of the new table the probe
+  // starts in, into a buffer of its own. Threads then claim whole ranges and
+  // insert that range's part of every buffer in source order, probing only
+  // inside the range, so no two threads ever touch the same slot. A source
+  // whose probe would leave its range is put aside and inserted by the
+  // calling thread once all the others are in.
+  template <typename RandomIt>
+  void _parallel_rebuild(const size_t new_bucket_count, RandomIt first,
+                         const size_t n, unsigned threads) {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    if (_migrating())
+      _migrate(old_bucket_count_);
+
+    size_t region_count = 1;
+    while (region_count < threads * 16 &&
+           new_bucket_count / (region_count * 2) >= kMinRegionSize)
+      region_count *= 2;
+    if (threads == 1 || region_count == 1) {
+      if (new_bucket_count != bucket_count_)
+        _resize(new_bucket_count);
+      for (size_t i = 0; i < n; ++i)
+        try_emplace((first + i)->first, (first + i)->second);
+      return;
+    }
+
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    ++rehash_count_;
     Entry* old_table = table_;
+    detail::ctrl_t* old_ctrl = ctrl_;
     const size_t old_bucket_count = bucket_count_;
-
+    const size_t source_count = old_bucket_count + n;
     bucket_count_ = new_bucket_count;
-    item_count_ = 0;
     table_ = create_table(bucket_count_);
-    set_empty_key(*empty_key_);
-
-    _copy_elements_from_table(
-        old_table, old_bucket_count,
-        *empty_key_,
-        static_cast<bool>(deleted_key_),
-        deleted_key_.get());
-    delete_table(old_table, old_bucket_count,
-                 *empty_key_,
-                 static_cast<bool>(deleted_key_),
-                 deleted_key_.get());
+    ctrl_ = create_ctrl(bucket_count_);
+    item_count_ = 0;
+    tombstone_count_ = 0;
+
+    const size_t region_size = bucket_count_ / region_count;
+    if (kSentinelKeys) {
+      const size_t slice = bucket_count_ / threads + 1;
+      detail::run_threads(threads, [&](unsigned t) {
+        const size_t end = std::min(bucket_count_, (t + 1) * slice);
+        for (size_t i = std::min(end, t * slice); i < end; ++i)
+          new (&table_[i].key) Key(*empty_key_);
+      });
+    }
 
-    return true;
+    typedef std::pair<size_t, size_t> hashed_source;
+    std::vector<std::vector<hashed_source> > hashed(threads);
+    // per thread: its slice by range, and where each range starts in it
+    std::vector<std::vector<hashed_source> > sorted(threads);
+    std::vector<std::vector<size_t> > region_begin(
+        threads, std::vector<size_t>(region_count + 1));
+    std::vector<std::vector<hashed_source> > deferred(threads);
+    std::vector<hashed_source> all_deferred;
+    std::vector<size_t> inserted(threads);
+    const size_t chunk = kRebuildSlice * threads;
+    for (size_t chunk_begin = 0; chunk_begin < source_count;
+         chunk_begin += chunk) {
+      const size_t chunk_end = std::min(source_count, chunk_begin + chunk);
+      detail::run_threads(threads, [&](unsigned t) {
+        const size_t begin =
+            std::min(chunk_end, chunk_begin + t * kRebuildSlice);
+        const size_t end = std::min(chunk_end, begin + kRebuildSlice);
+        std::vector<size_t>& offsets = region_begin[t];
+        std::fill(offsets.begin(), offsets.end(), 0);
+        hashed[t].clear();
+        for (size_t s = begin; s < end; ++s) {
+          size_t hash;
+          if (s < old_bucket_count) {
+            if (!_is_full(old_table, old_ctrl, s))
+              continue;
+            hash = _entry_hash(old_table[s]);
+          } else {
+            hash = get_hash((first + (s - old_bucket_count))->first);
+          }
+          hashed[t].push_back(hashed_source(s, hash));
+          ++offsets[_home_slot(hash) / region_size + 1];
+        }
+        for (size_t r = 0; r < region_count; ++r)
+          offsets[r + 1] += offsets[r];
+        sorted[t].resize(hashed[t].size());
+        for (size_t i = 0; i < hashed[t].size(); ++i) {
+          const size_t r = _home_slot(hashed[t][i].second) / region_size;
+          sorted[t][offsets[r]++] = hashed[t][i];
+        }
+        // the scatter left each range's offset at the start of the next
+        for (size_t r = region_count; r > 0; --r)
+          offsets[r] = offsets[r - 1];
+        offsets[0] = 0;
+      });
+
+      std::atomic<size_t> next_region(0);
+      detail::run_threads(threads, [&](unsigned t) {
+        for (size_t r; (r = next_region.fetch_add(1)) < region_count; ) {
+          const size_t lo = r * region_size;
+          const size_t hi = lo + region_size;
+          for (unsigned u = 0; u < threads; ++u) {
+            for (size_t i = region_begin[u][r]; i < region_begin[u][r + 1];
+                 ++i) {
+              const size_t s = sorted[u][i].first;
+              const size_t hash = sorted[u][i].second;
+              bool found = false;
+              if (s < old_bucket_count) {
+                Entry& old_entry = old_table[s];
+                const size_t index =
+                    _region_slot(old_entry.key, hash, lo, hi, found);
+                if (index == (size_t)-1) {
+                  deferred[t].push_back(sorted[u][i]);
+                  continue;
+                }
+                _construct_entry(index, std::move(old_entry.key), hash,
+                                 std::move(old_entry.value));
+                _clear_moved_from(old_table, old_ctrl, s);
+                ++inserted[t];
+              } else {
+                const RandomIt it = first + (s - old_bucket_count);
+                const size_t index =
+                    _region_slot(it->first, hash, lo, hi, found);
+                if (index == (size_t)-1) {
+                  deferred[t].push_back(sorted[u][i]);
+                } else if (!found) {
+                  _construct_entry(index, it->first, hash, it->second);
+                  ++inserted[t];
+                }
+              }
+            }
+          }
+        }
+      });
+      // A key always lands in the same range, but not with the same thread
+      // from one chunk to the next, so leftovers are gathered chunk by chunk
+      // to keep repeats of a key in source order.
+      for (unsigned t = 0; t < threads; ++t) {
+        all_deferred.insert(all_deferred.end(), deferred[t].begin(),
+                            deferred[t].end());
+        deferred[t].clear();
+      }
+    }
+
+    for (unsigned t = 0; t < threads; ++t)
+      item_count_ += inserted[t];
+    for (size_t i = 0; i < all_deferred.size(); ++i) {
+      const size_t s = all_deferred[i].first;
+      const size_t hash = all_deferred[i].second;
+      if (s < old_bucket_count) {
+        Entry& old_entry = old_table[s];
+        _find_or_insert_hashed(hash, std::move(old_entry.key),
+                               std::move(old_entry.value));
+        _clear_moved_from(old_table, old_ctrl, s);
+      } else {
+        const RandomIt it = first + (s - old_bucket_count);
+        _find_or_insert_hashed(hash, it->first, it->second);
+      }
+    }
+    delete_table(old_table, old_ctrl, old_bucket_count);
+    _add_rehash_time(start);
+  }
+
+  // Like a probe for an insert, but one that only looks at slots in [lo, hi)
+  // of a table nothing has been erased from. Returns the slot key is in,
+  // setting found, or the one it should go in, and (size_t)-1 if the probe
+  // would leave the range first. For robin_hood_probing the slot is also
+  // made room in.
+  template <typename K>
+  size_t _region_slot(const K& key, const size_t hash, const size_t lo,
+                      const size_t hi, bool& found) {
+    found = false;
+    if (kGroupProbing) {
+      const size_t group_mask = bucket_count_ / detail::kGroupWidth - 1;
+      const detail::ctrl_t h2 = detail::h2(hash);
+      size_t group = hash & group_mask;
+      for (size_t probe_count = 0; probe_count <= group_mask; ++probe_count) {
+        group = (group + probe_count) & group_mask;
+        const size_t base = group * detail::kGroupWidth;
+        if (base < lo || base >= hi)
+          return (size_t)-1;
+        const detail::ctrl_group g(ctrl_ + base);
+        for (uint32_t match = g.match(h2); match; match &= match - 1) {
+          const size_t index = base + detail::count_trailing_zeros(match);
+          const Entry& entry = table_[index];
+          if (_hash_matches(entry, hash) && equal_(entry.key, key)) {
+            found = true;
+            return index;
+          }
+        }
+        const uint32_t empty = g.match_empty();
+        if (empty)
+          return base + detail::count_trailing_zeros(empty);
+      }
+      return (size_t)-1;
+    }
+
+    if (kRobinHood) {
+      // a probe starts in its own range and never wraps before leaving it
+      size_t index = hash & (bucket_count_ - 1);
+      for (size_t distance = 0; ; ++distance, ++index) {
+        if (index >= hi)
+          return (size_t)-1;
+        const size_t info = _robin_hood_info(index);
+        if (info == 0 || info - 1 < distance)
+          break;
+        const Entry& entry = table_[index];
+        if (_hash_matches(entry, hash) && equal_(entry.key, key)) {
+          found = true;
+          return index;
+        }
+      }
+      // the run that gets pushed along has to end inside the range too
+      size_t empty = index;
+      while (empty < hi && _robin_hood_info(empty) != 0)
+        ++empty;
+      if (empty >= hi || !_robin_hood_make_room(index, hash))
+        return (size_t)-1;
+      return index;
+    }
+
+    const size_t mask = bucket_count_ - 1;
+    const size_t start_index = hash & mask;
+    for (size_t probe_count = 0; probe_count <= bucket_count_; ++probe_count) {
+      const size_t triangle_number = (probe_count * (probe_count + 1)) / 2;
+      const size_t index = (start_index + triangle_number) & mask;
+      if (index < lo || index >= hi)
+        return (size_t)-1;
+      const Entry& entry = table_[index];
+      if (equal_(entry.key, *empty_key_))
+        return index;
+      if (_hash_matches(entry, hash) && equal_(entry.key, key)) {
+        found = true;
+        return index;
+      }
+    }
+    return (size_t)-1;
+  }
+
+  // Only true between resizes with IncrementalRehash, so the extra checks
+  // compile away otherwise.
+  bool _migrating() const {
+    return kIncremental && old_table_ != nullptr;
+  }
+
+  // Slots of old_table_ follow those of the current table in the index space
+  // of iterators and _find_index().
+  size_t _end_index() const {
+    return kIncremental ? bucket_count_ + old_bucket_count_ : bucket_count_;
+  }
+
+  Entry& _entry_at(const size_t index) const {
+    if (kIncremental && index >= bucket_count_)
+      return old_table_[index - bucket_count_];
+    return table_[index];
+  }
+
+  bool _is_full_at(const size_t index) const {
+    if (kIncremental && index >= bucket_count_)
+      return _is_full(old_table_, old_ctrl_, index - bucket_count_);
+    return _is_full(table_, ctrl_, index);
+  }
+
+  template <typename K>
+  bool _find_old_bucket(const K& key, const size_t hash,
+                        size_t& found_index) const {
+    return _migrating() &&
+           _find_bucket_in(old_table_, old_ctrl_, old_bucket_count_,
+                           migrated_, key, hash, found_index);
+  }
+
+  // Leaves a tombstone even with robin_hood_probing, since shifting entries
+  // back could move them into the part of old_table_ already migrated.
+  void _erase_old(const size_t index) {
+    Entry& entry = old_table_[index];
+    if (!kStaticValue)
+      entry.value.~Value();
+    if (kSentinelKeys) {
+      entry.key = *deleted_key_;
+      return;
+    }
+    entry.key.~Key();
+    old_ctrl_[index] = kRobinHood ? kRobinHoodErased : detail::kCtrlDeleted;
   }
 
+  // Slot state in old_table is judged with this map's sentinels, so callers
+  // must have copied other's empty and deleted keys first.
   void _copy_elements_from_table(Entry* old_table,
-                                 const size_t old_bucket_count,
-                                 const Key& old_empty_key,
-                                 const bool old_has_delete,
-                                 const Key* old_deleted_key) {
+                                 const detail::ctrl_t* old_ctrl,
+                                 const size_t old_bucket_count) {
     for (size_t i = 0; i < old_bucket_count; ++i) {
-      const Entry& old_entry = old_table[i];
-      if (old_entry.key == old_empty_key)
-        continue;
-      if (old_has_delete && old_entry.key == *old_deleted_key)
+      if (!_is_full(old_table, old_ctrl, i))
         continue;
+      const Entry& old_entry = old_table[i];
 
-      const uint32_t hash = get_hash(old_entry.key);
-      size_t new_index = (size_t)-1;
-      // assume that this will always be successful since we are resizing and
-      // this it will always fit
-      _find_bucket(old_entry.key, hash, new_index);
-      Entry& new_entry = table_[new_index];
-      _emplace_entry(new_entry, old_entry.key, hash, old_entry.value);
+      const size_t hash = _entry_hash(old_entry);
+      const size_t new_index = _find_empty_slot(hash);
+      _emplace_entry(new_index, old_entry.key, hash, old_entry.value);
     }
   }
 
-  bool _find_bucket(const Key& key, const uint32_t hash, size_t& found_index) {
+  size_t _entry_hash(const Entry& entry) const {
+    return _entry_hash(entry, std::integral_constant<bool, kStoreHash>());
+  }
+
+  size_t _entry_hash(const Entry& entry, std::true_type) const {
+    return entry.hash;
+  }
+
+  size_t _entry_hash(const Entry& entry, std::false_type) const {
+    return get_hash(entry.key);
+  }
+
+  static void _set_entry_hash(Entry& entry, size_t hash, std::true_type) {
+    entry.hash = hash;
+  }
+
+  static void _set_entry_hash(Entry&, size_t, std::false_type) {}
+
+  // cheap pre-check before KeyEqual when the hash is stored in the entry
+  static bool _hash_matches(const Entry& entry, size_t hash) {
+    return _hash_matches(entry, hash,
+                         std::integral_constant<bool, kStoreHash>());
+  }
+
+  static bool _hash_matches(const Entry& entry, size_t hash, std::true_type) {
+    return entry.hash == hash;
+  }
+
+  static bool _hash_matches(const Entry&, size_t, std::false_type) {
+    return true;
+  }
+
+  // First empty slot on hash's probe sequence. Only for moving elements into
+  // a fresh table, which holds no tombstones or duplicates, so no key has to
+  // be compared and it will always fit. With robin_hood_probing this is the
+  // slot the entry belongs in, after shifting poorer entries out of it.
+  size_t _find_empty_slot(const size_t hash) {
+    if (kRobinHood) {
+      const size_t mask = bucket_count_ - 1;
+      size_t index = hash & mask;
+      for (size_t distance = 0; ; ++distance) {
+        const size_t info = _robin_hood_info(index);
+        if (info == 0 || info - 1 < distance)
+          break;
+        index = (index + 1) & mask;
+      }
+      if (!_robin_hood_make_room(index, hash))
+        throw std::overflow_error("kokopuffs::map probe distance overflow");
+      return index;
+    }
+
+    if (kGroupProbing) {
+      const size_t group_mask = bucket_count_ / detail::kGroupWidth - 1;
+      size_t group = hash & group_mask;
+      for (size_t probe_count = 0; ; ++probe_count) {
+        group = (group + probe_count) & group_mask;
+        const size_t base = group * detail::kGroupWidth;
+        const uint32_t empty = detail::ctrl_group(ctrl_ + base).match_empty();
+        if (empty)
+          return base + detail::count_trailing_zeros(empty);
+      }
+    }
+
     const size_t mask = bucket_count_ - 1;
     const size_t start_index = hash & mask;
+    for (size_t probe_count = 0; ; ++probe_count) {
+      size_t triangle_number = (probe_count * (probe_count + 1)) / 2;
+      size_t index = (start_index + triangle_number) & mask;
+      if (equal_(table_[index].key, *empty_key_))
+        return index;
+    }
+  }
+
+  // On a miss found_index is where key should be inserted, or -1 if the
+  // table is completely full.
+  template <typename K>
+  bool _find_bucket(const K& key, const size_t hash,
+                    size_t& found_index) const {
+    return _find_bucket_in(table_, ctrl_, bucket_count_, 0, key, hash,
+                           found_index);
+  }
+
+  // Also probes old_table_ while migrating. Its first `migrated` slots have
+  // been emptied, but entries further on may have probed past them, so they
+  // are skipped instead of ending the probe.
+  template <typename K>
+  bool _find_bucket_in(const Entry* table, const detail::ctrl_t* ctrl,
+                       const size_t bucket_count, const size_t migrated,
+                       const K& key, const size_t hash,
+                       size_t& found_index) const {
+    _count_lookup();
+    if (kGroupProbing)
+      return _find_bucket_group(table, ctrl, bucket_count, migrated, key, hash,
+                                found_index);
+    if (kRobinHood)
+      return _find_bucket_robin_hood(table, ctrl, bucket_count, migrated, key,
+                                     hash, found_index);
+
+    const size_t mask = bucket_count - 1;
+    const size_t start_index = hash & mask;
     size_t probe_count = 0;
     size_t deleted_index = (size_t)-1;
     bool found_deleted_index = false;
 
-    while (probe_count <= bucket_count_) {
+    while (probe_count <= bucket_count) {
+      _count_probe_step();
       size_t triangle_number = (probe_count * (probe_count + 1)) / 2;
       size_t index = (start_index + triangle_number) & mask;
-      Entry& entry = table_[index];
+      if (index < migrated) {
+        ++probe_count;
+        continue;
+      }
+      const Entry& entry = table[index];
 
-      if (entry.key == *empty_key_) {
+      if (equal_(entry.key, *empty_key_)) {
         if (found_deleted_index)
           found_index = deleted_index;
         else
@@ -439,43 +1983,216 @@ refind_slot:
         return false;
       }
 
-      if (!found_deleted_index && deleted_key_ && entry.key == *deleted_key_) {
+      if (!found_deleted_index && deleted_key_ &&
+          equal_(entry.key, *deleted_key_)) {
         found_deleted_index = true;
         deleted_index = index;
       }
 
-      if (entry.key == key) {
+      if (_hash_matches(entry, hash) && equal_(entry.key, key)) {
         found_index = index;
         return true;
       }
 
-      ++index;
-      if (index == bucket_count_)
-        index = 0;
       ++probe_count;
     }
 
-    if (found_deleted_index) {
-      found_index = deleted_index;
-    } else {
-      throw std::runtime_error("rko_map hash table completely full");
+    found_index = deleted_index;
+    return false;
+  }
+
+  template <typename K>
+  bool _find_bucket_group(const Entry* table, const detail::ctrl_t* ctrl,
+                          const size_t bucket_count, const size_t migrated,
+                          const K& key, const size_t hash,
+                          size_t& found_index) const {
+    const size_t group_mask = bucket_count / detail::kGroupWidth - 1;
+    const detail::ctrl_t h2 = detail::h2(hash);
+    size_t group = hash & group_mask;
+    size_t insert_index = (size_t)-1;
+
+    for (size_t probe_count = 0; probe_count <= group_mask; ++probe_count) {
+      _count_probe_step();
+      group = (group + probe_count) & group_mask;
+      const size_t base = group * detail::kGroupWidth;
+      // kMigrateSlots is a multiple of the group width
+      if (base < migrated)
+        continue;
+      const detail::ctrl_group g(ctrl + base);
+
+      for (uint32_t match = g.match(h2); match; match &= match - 1) {
+        const size_t index = base + detail::count_trailing_zeros(match);
+        const Entry& entry = table[index];
+        if (_hash_matches(entry, hash) && equal_(entry.key, key)) {
+          found_index = index;
+          return true;
+        }
+      }
+
+      if (insert_index == (size_t)-1) {
+        const uint32_t free_slots = g.match_empty_or_deleted();
+        if (free_slots)
+          insert_index = base + detail::count_trailing_zeros(free_slots);
+      }
+      // a lookup never continues past a group that still has an empty slot
+      if (g.match_empty()) {
+        found_index = insert_index;
+        return false;
+      }
     }
+
+    found_index = insert_index;
     return false;
   }
 
+  // robin_hood_probing keeps distance + 1 in the control byte, 0 when empty
+  size_t _robin_hood_info(const size_t index) const {
+    return static_cast<uint8_t>(ctrl_[index]);
+  }
+
+  size_t _robin_hood_distance(const size_t index) const {
+    return _robin_hood_info(index) - 1;
+  }
+
+  size_t _probe_distance(const size_t index, const size_t hash) const {
+    return (index - hash) & (bucket_count_ - 1);
+  }
+
+  // Entries are ordered by distance along a run, so the lookup can stop at
+  // the first slot whose entry is closer to home than the key would be. On
+  // a miss found_index is where the key has to be inserted.
+  template <typename K>
+  bool _find_bucket_robin_hood(const Entry* table, const detail::ctrl_t* ctrl,
+                               const size_t bucket_count, const size_t migrated,
+                               const K& key, const size_t hash,
+                               size_t& found_index) const {
+    const size_t mask = bucket_count - 1;
+    size_t index = hash & mask;
+    for (size_t distance = 0; distance <= bucket_count; ++distance) {
+      _count_probe_step();
+      // the old entries that were here reached at least this far from home
+      if (kIncremental &&
+          (index < migrated || ctrl[index] == kRobinHoodErased)) {
+        index = (index + 1) & mask;
+        continue;
+      }
+      const size_t info = static_cast<uint8_t>(ctrl[index]);
+      if (info == 0 || info - 1 < distance) {
+        found_index = index;
+        return false;
+      }
+      const Entry& entry = table[index];
+      if (_hash_matches(entry, hash) && equal_(entry.key, key)) {
+        found_index = index;
+        return true;
+      }
+      index = (index + 1) & mask;
+    }
+    found_index = (size_t)-1;
+    return false;
+  }
+
+  // Frees up slot index for an entry with the given hash by shifting the
+  // rest of the run one slot further from home. Returns false, without
+  // moving anything, if some distance would no longer fit in a control byte.
+  bool _robin_hood_make_room(const size_t index, const size_t hash) {
+    const size_t mask = bucket_count_ - 1;
+    if (_probe_distance(index, hash) > kMaxProbeDistance)
+      return false;
+
+    size_t empty = index;
+    while (_robin_hood_info(empty) != 0) {
+      if (_robin_hood_distance(empty) >= kMaxProbeDistance)
+        return false;
+      empty = (empty + 1) & mask;
+      if (empty == index)
+        return false;
+    }
+
+    while (empty != index) {
+      const size_t prev = (empty - 1) & mask;
+      new (&table_[empty]) Entry(std::move(table_[prev]));
+      table_[prev].~Entry();
+      ctrl_[empty] = static_cast<detail::ctrl_t>(_robin_hood_info(prev) + 1);
+      empty = prev;
+    }
+    ctrl_[index] = 0;
+    return true;
+  }
+
+  // Backward shift deletion: every following entry that is not in its home
+  // slot moves back one, so no tombstone is needed.
+  void _robin_hood_erase(size_t index) {
+    const size_t mask = bucket_count_ - 1;
+    table_[index].~Entry();
+    size_t next = (index + 1) & mask;
+    while (_robin_hood_info(next) > 1) {
+      new (&table_[index]) Entry(std::move(table_[next]));
+      table_[next].~Entry();
+      ctrl_[index] = static_cast<detail::ctrl_t>(_robin_hood_info(next) - 1);
+      index = next;
+      next = (next + 1) & mask;
+    }
+    ctrl_[index] = 0;
+  }
+
+  // If the group still has an empty slot no probe ever went past it, so the
+  // erased slot can go straight back to empty instead of a tombstone.
+  detail::ctrl_t _erased_ctrl(const size_t index) const {
+    const size_t base = index & ~(detail::kGroupWidth - 1);
+    if (detail::ctrl_group(ctrl_ + base).match_empty())
+      return detail::kCtrlEmpty;
+    return detail::kCtrlDeleted;
+  }
+
+  Hash hasher_;
+  KeyEqual equal_;
+  Allocator allocator_;
   size_t bucket_count_;
+  // set by the constructor, reserve() and rehash(), shrinking stops here
+  size_t min_bucket_count_;
   size_t item_count_;
+  // erased slots of table_ that probes still have to go past, always 0 with
+  // robin_hood_probing
+  size_t tombstone_count_;
   float max_load_factor_;
   float min_load_factor_;
   std::unique_ptr<Key> empty_key_;
   std::unique_ptr<Key> deleted_key_;
   Entry* table_;
+  // one control byte per slot, only allocated with group_probing, which
+  // keeps hash bits there, and robin_hood_probing, which keeps distance + 1
+  detail::ctrl_t* ctrl_;
+  // the table being migrated from with IncrementalRehash, else nullptr
+  Entry* old_table_;
+  detail::ctrl_t* old_ctrl_;
+  size_t old_bucket_count_;
+  // slots of old_table_ before this one have been moved over
+  size_t migrated_;
+  // table rebuilds and the time spent in them, reported by stats()
+  size_t rehash_count_;
+  uint64_t rehash_nanoseconds_;
+#ifdef KOKOPUFFS_MAP_STATS
+  mutable detail::map_counters counters_;
+#endif
 #ifdef KOKOPUFFS_DEBUG
   bool has_set_empty_key_;
   bool has_set_deleted_key_;
 #endif
 };
 
+template <typename Key, typename Value, typename Hash, typename KeyEqual,
+          typename Policy, typename Allocator>
+const size_t map<Key, Value, Hash, KeyEqual, Policy, Allocator>::kMinBucketCount;
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual,
+          typename Policy, typename Allocator>
+const size_t map<Key, Value, Hash, KeyEqual, Policy, Allocator>::kBatchSize;
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual,
+          typename Policy, typename Allocator>
+const size_t map<Key, Value, Hash, KeyEqual, Policy, Allocator>::kMinRegionSize;
+
 #ifdef KOKOPUFFS_DEBUG
 #undef KOKOPUFFS_DEBUG
 #endif
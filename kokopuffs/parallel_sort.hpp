@@ -0,0 +1,399 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "algorithm.hpp"
+
+namespace kokopuffs {
+
+// ranges at most this long are sorted or merged by one thread
+static const size_t kParallelSortGrain = 1 << 14;
+// parallel_sort() switches from merge sort to sample sort at this many
+// elements per thread
+static const size_t kParallelSampleSortThreshold = 1 << 18;
+// sample sort draws this many samples per bucket
+static const size_t kSampleSortOversampling = 32;
+
+namespace detail {
+
+class task_pool;
+
+struct task_pool_slot {
+  const task_pool* pool;
+  unsigned index;
+};
+
+// which pool the current thread works for and which of its queues is its own
+inline task_pool_slot& current_task_pool_slot() {
+  static thread_local task_pool_slot slot = {nullptr, 0};
+  return slot;
+}
+
+// A fork-join pool of threads for the parallel sorts. Every thread has its
+// own deque of tasks: it pushes and pops at the back, so it works depth
+// first on what it just split off, and a thread that runs dry steals from
+// the front of another's, where the oldest and largest tasks are. The thread
+// that created the pool counts as its first thread and works while it waits
+// on a task_group. Idle workers sleep until a task is pushed.
+class task_pool {
+ public:
+  typedef std::function<void()> task;
+
+  explicit task_pool(const unsigned threads)
+      : queues_(std::max(1u, threads)), queued_(0), stop_(false) {
+    for (unsigned t = 1; t < queues_.size(); ++t)
+      workers_.push_back(std::thread([this, t]() { _work(t); }));
+  }
+
+  ~task_pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (size_t t = 0; t < workers_.size(); ++t)
+      workers_[t].join();
+  }
+
+  task_pool(const task_pool&) = delete;
+  task_pool& operator=(const task_pool&) = delete;
+
+  unsigned size() const { return static_cast<unsigned>(queues_.size()); }
+
+  void push(task t) {
+    queue& q = queues_[_own_queue()];
+    {
+      std::lock_guard<std::mutex> lock(q.mutex);
+      q.tasks.push_back(std::move(t));
+    }
+    queued_.fetch_add(1);
+    // a worker checks queued_ under sleep_mutex_ before it sleeps, so taking
+    // it here means the notify cannot fall between its check and its wait
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+  }
+
+  // runs a task from this thread's queue, or one stolen from another, and
+  // returns whether there was one
+  bool run_one() {
+    const unsigned self = _own_queue();
+    task t;
+    if (!_take(self, false, t)) {
+      for (unsigned i = 1; i < size(); ++i) {
+        if (_take((self + i) % size(), true, t))
+          break;
+      }
+    }
+    if (!t)
+      return false;
+    t();
+    return true;
+  }
+
+ private:
+  struct queue {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  unsigned _own_queue() const {
+    const task_pool_slot& slot = current_task_pool_slot();
+    return slot.pool == this ? slot.index : 0;
+  }
+
+  bool _take(const unsigned index, const bool steal, task& t) {
+    queue& q = queues_[index];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty())
+      return false;
+    if (steal) {
+      t = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    } else {
+      t = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    }
+    queued_.fetch_sub(1);
+    return true;
+  }
+
+  void _work(const unsigned index) {
+    task_pool_slot& slot = current_task_pool_slot();
+    slot.pool = this;
+    slot.index = index;
+    for (;;) {
+      if (run_one())
+        continue;
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      wake_.wait(lock, [this]() { return stop_ || queued_.load() != 0; });
+      if (stop_)
+        return;
+    }
+  }
+
+  std::vector<queue> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> queued_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stop_;
+};
+
+// Tasks pushed to a task_pool that wait() waits for, running queued tasks
+// meanwhile. The first exception a task throws is rethrown by wait().
+class task_group {
+ public:
+  explicit task_group(task_pool& pool) : pool_(pool), pending_(0) {}
+
+  // the tasks refer to the group, so it outlives them even when the code
+  // that was going to call wait() throws
+  ~task_group() { _drain(); }
+
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+  template <typename F>
+  void run(F f) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    pool_.push([this, f]() {
+      try {
+        f();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!error_)
+          error_ = std::current_exception();
+      }
+      pending_.fetch_sub(1, std::memory_order_release);
+    });
+  }
+
+  void wait() {
+    _drain();
+    if (error_)
+      std::rethrow_exception(error_);
+  }
+
+ private:
+  void _drain() {
+    while (pending_.load(std::memory_order_acquire) != 0) {
+      if (!pool_.run_one())
+        std::this_thread::yield();
+    }
+  }
+
+  task_pool& pool_;
+  std::atomic<size_t> pending_;
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+};
+
+inline unsigned sort_threads(const unsigned threads) {
+  return threads != 0 ? threads
+                      : std::max(1u, std::thread::hardware_concurrency());
+}
+
+}
+
+// Merges src[begin0, end0) and src[begin1, end1) into dst from out on. A
+// long merge is split at the middle of its longer range and where that
+// element would go in the other, and the two halves are merged in parallel.
+template <typename T>
+void _parallel_merge(detail::task_pool& pool, std::vector<T>& src,
+                     const int64_t begin0, const int64_t end0,
+                     const int64_t begin1, const int64_t end1,
+                     std::vector<T>& dst, const int64_t out) {
+  const int64_t n0 = end0 - begin0;
+  const int64_t n1 = end1 - begin1;
+  if (static_cast<size_t>(n0 + n1) <= kParallelSortGrain) {
+    _merge_ranges(src, begin0, end0, begin1, end1, dst, out);
+    return;
+  }
+
+  // ties stay with the first range to keep the merge stable
+  int64_t split0;
+  int64_t split1;
+  if (n0 >= n1) {
+    split0 = begin0 + n0 / 2;
+    split1 = std::lower_bound(src.begin() + begin1, src.begin() + end1,
+                              src[split0]) - src.begin();
+  } else {
+    split1 = begin1 + n1 / 2;
+    split0 = std::upper_bound(src.begin() + begin0, src.begin() + end0,
+                              src[split1]) - src.begin();
+  }
+
+  detail::task_group group(pool);
+  group.run([&]() {
+    _parallel_merge(pool, src, begin0, split0, begin1, split1, dst, out);
+  });
+  _parallel_merge(pool, src, split0, end0, split1, end1, dst,
+                  out + (split0 - begin0) + (split1 - begin1));
+  group.wait();
+}
+
+// Sorts arr[begin, end) into arr, or into scratch if to_scratch. Halves
+// are sorted in parallel into the other vector, so each level merges
+// from one into the other without copying back.
+template <typename T>
+void _parallel_mergesort(detail::task_pool& pool, std::vector<T>& arr,
+                         std::vector<T>& scratch, const int64_t begin,
+                         const int64_t end, const bool to_scratch) {
+  if (static_cast<size_t>(end - begin) <= kParallelSortGrain) {
+    _mergesort(arr, begin, end, scratch);
+    if (to_scratch)
+      std::move(arr.begin() + begin, arr.begin() + end,
+                scratch.begin() + begin);
+    return;
+  }
+
+  const int64_t mid = begin + (end - begin) / 2;
+  detail::task_group group(pool);
+  group.run([&]() {
+    _parallel_mergesort(pool, arr, scratch, begin, mid, !to_scratch);
+  });
+  _parallel_mergesort(pool, arr, scratch, mid, end, !to_scratch);
+  group.wait();
+
+  if (to_scratch)
+    _parallel_merge(pool, arr, begin, mid, mid, end, scratch, begin);
+  else
+    _parallel_merge(pool, scratch, begin, mid, mid, end, arr, begin);
+}
+
+// Stable merge sort on threads threads, hardware_concurrency() of them if
+// 0. Gives the same result as mergesort().
+template <typename T>
+void parallel_mergesort(std::vector<T>& arr, const unsigned threads = 0) {
+  const size_t n = arr.size();
+  const unsigned thread_count = detail::sort_threads(threads);
+  if (thread_count == 1 || n <= kParallelSortGrain) {
+    mergesort(arr);
+    return;
+  }
+  std::vector<T> scratch(n);
+  detail::task_pool pool(thread_count);
+  _parallel_mergesort(pool, arr, scratch, 0, n, false);
+}
+
+// Sample sort on threads threads, hardware_concurrency() of them if 0.
+// Splitters drawn from a sorted random sample cut the values into 8
+// buckets per thread. Each chunk of arr is classified in parallel, the
+// elements are moved to their buckets in a second vector, and the buckets
+// are pdqsorted in parallel. Every element moves once outside of its final
+// sort, where merge sort moves each log(threads) times. Not stable.
+template <typename T>
+void parallel_samplesort(std::vector<T>& arr, const unsigned threads = 0) {
+  const size_t n = arr.size();
+  const unsigned thread_count = detail::sort_threads(threads);
+  if (thread_count == 1 || n <= kParallelSortGrain) {
+    pdqsort(arr);
+    return;
+  }
+
+  const size_t buckets = std::min<size_t>(256, thread_count * 8);
+  std::minstd_rand re(static_cast<std::minstd_rand::result_type>(n));
+  std::vector<T> sample(buckets * kSampleSortOversampling);
+  for (size_t i = 0; i < sample.size(); ++i) {
+    const uint64_t r = (static_cast<uint64_t>(re()) << 31) ^ re();
+    sample[i] = arr[r % n];
+  }
+  pdqsort(sample);
+  std::vector<T> splitters(buckets - 1);
+  for (size_t b = 0; b + 1 < buckets; ++b)
+    splitters[b] = sample[(b + 1) * kSampleSortOversampling];
+
+  detail::task_pool pool(thread_count);
+  const size_t chunks = buckets;
+  const size_t chunk_size = (n + chunks - 1) / chunks;
+  std::vector<uint8_t> bucket_of(n);
+  // per chunk, the count of each bucket, then where its elements go
+  std::vector<size_t> offsets(chunks * buckets);
+  {
+    detail::task_group group(pool);
+    for (size_t c = 0; c < chunks; ++c) {
+      group.run([&, c]() {
+        size_t* const count = &offsets[c * buckets];
+        const size_t end = std::min(n, (c + 1) * chunk_size);
+        for (size_t i = c * chunk_size; i < end; ++i) {
+          const size_t b = std::upper_bound(splitters.begin(),
+                                            splitters.end(), arr[i]) -
+                           splitters.begin();
+          bucket_of[i] = static_cast<uint8_t>(b);
+          ++count[b];
+        }
+      });
+    }
+    group.wait();
+  }
+
+  std::vector<size_t> bucket_begin(buckets + 1);
+  size_t total = 0;
+  for (size_t b = 0; b < buckets; ++b) {
+    bucket_begin[b] = total;
+    for (size_t c = 0; c < chunks; ++c) {
+      const size_t count = offsets[c * buckets + b];
+      offsets[c * buckets + b] = total;
+      total += count;
+    }
+  }
+  bucket_begin[buckets] = total;
+
+  std::vector<T> scratch(n);
+  {
+    detail::task_group group(pool);
+    for (size_t c = 0; c < chunks; ++c) {
+      group.run([&, c]() {
+        size_t* const offset = &offsets[c * buckets];
+        const size_t end = std::min(n, (c + 1) * chunk_size);
+        for (size_t i = c * chunk_size; i < end; ++i)
+          scratch[offset[bucket_of[i]]++] = std::move(arr[i]);
+      });
+    }
+    group.wait();
+  }
+
+  {
+    detail::task_group group(pool);
+    for (size_t b = 0; b < buckets; ++b) {
+      const int64_t begin = bucket_begin[b];
+      const int64_t end = bucket_begin[b + 1];
+      if (end - begin < 2)
+        continue;
+      group.run([&, begin, end]() {
+        _pdqsort<T, std::is_arithmetic<T>::value>(scratch, begin, end,
+                                                  _log2(end - begin), true);
+      });
+    }
+    group.wait();
+  }
+  arr.swap(scratch);
+}
+
+// Sorts arr on threads threads, hardware_concurrency() of them if 0, with
+// parallel_samplesort() once there are kParallelSampleSortThreshold
+// elements per thread and parallel_mergesort() below that.
+template <typename T>
+void parallel_sort(std::vector<T>& arr, const unsigned threads = 0) {
+  const unsigned thread_count = detail::sort_threads(threads);
+  if (arr.size() >= thread_count * kParallelSampleSortThreshold)
+    parallel_samplesort(arr, thread_count);
+  else
+    parallel_mergesort(arr, thread_count);
+}
+
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "map.hpp"
+
+namespace kokopuffs {
+
+// Read-mostly map. The current table is an immutable kokopuffs::map that is
+// never written to once published; writers apply their changes to a copy
+// and swap it in with a single pointer store. Readers pin the table they
+// probe with an epoch, which costs them a store and a fence but no atomic
+// read-modify-write and no lock, and a replaced table is only freed once no
+// reader can still be probing it.
+//
+// Every update copies the whole table, so writers should batch as many
+// changes as they can into one update().
+//
+//   kokopuffs::rcu_map<int, int> routes;
+//   routes.update([](rcu_map<int, int>::map_type& m) { m[1] = 2; m.erase(3); });
+//
+//   // once per thread
+//   kokopuffs::rcu_map<int, int>::reader reader(routes);
+//   int next_hop;
+//   if (reader.find(1, next_hop)) ...
+template<typename Key, typename Value,
+         typename Hash = kokopuffs::hash<Key>,
+         typename KeyEqual = kokopuffs::equal_to<Key>,
+         typename Policy = map_policy<group_probing>,
+         typename Allocator = std::allocator<std::pair<const Key, Value> > >
+class rcu_map {
+  struct reader_slot {
+    reader_slot() : epoch(0) {}
+
+    // 0 while the reader is outside a lookup, else the epoch it started in
+    std::atomic<uint64_t> epoch;
+    // keeps readers from sharing cache lines with each other
+    char padding[56];
+  };
+
+ public:
+  typedef kokopuffs::map<Key, Value, Hash, KeyEqual, Policy, Allocator>
+      map_type;
+
+  // Per-thread handle for lookups. It must not outlive the map or be shared
+  // between threads.
+  class reader {
+   public:
+    explicit reader(rcu_map& m) : map_(m), slot_(m._register_reader()) {}
+
+    ~reader() {
+      map_._unregister_reader(slot_);
+    }
+
+    // Pins the current table and returns it. It stays valid, and unchanged,
+    // until unlock(), so several lookups can share one snapshot.
+    const map_type& lock() {
+      slot_->epoch.store(map_.epoch_.load(std::memory_order_acquire),
+                         std::memory_order_relaxed);
+      // the writer must see the epoch before this reader sees the table
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return *map_.current_.load(std::memory_order_acquire);
+    }
+
+    void unlock() {
+      slot_->epoch.store(0, std::memory_order_release);
+    }
+
+    // Copies key's value into value and returns true if it is in the map.
+    bool find(const Key& key, Value& value) {
+      const map_type& m = lock();
+      typename map_type::const_iterator it = m.find(key);
+      const bool found = it != m.end();
+      if (found)
+        value = it->value;
+      unlock();
+      return found;
+    }
+
+    bool contains(const Key& key) {
+      const bool found = lock().contains(key);
+      unlock();
+      return found;
+    }
+
+   private:
+    reader(const reader&);
+    reader& operator=(const reader&);
+
+    rcu_map& map_;
+    reader_slot* slot_;
+  };
+
+  explicit rcu_map(size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE,
+                   const Hash& hash = Hash(),
+                   const KeyEqual& equal = KeyEqual(),
+                   const Allocator& alloc = Allocator())
+      : current_(new map_type(initial_table_size, hash, equal, alloc)),
+        epoch_(1) {}
+
+  // No reader may be left.
+  ~rcu_map() {
+    delete current_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < retired_.size(); ++i)
+      delete retired_[i].second;
+  }
+
+  // Calls f(map_type&) on a copy of the current table and publishes the
+  // copy. Writers are serialized, readers are never blocked.
+  template <typename F>
+  void update(F f) {
+    std::lock_guard<std::mutex> guard(writer_mutex_);
+    const map_type* old = current_.load(std::memory_order_relaxed);
+    std::unique_ptr<map_type> next(new map_type(*old));
+    f(*next);
+    current_.store(next.release(), std::memory_order_seq_cst);
+    // readers that start in this epoch or later can only see the new table
+    const uint64_t retire_epoch =
+        epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+    retired_.push_back(std::make_pair(retire_epoch, old));
+    _reclaim();
+  }
+
+  template <typename M>
+  void insert_or_assign(const Key& key, M&& obj) {
+    update([&key, &obj](map_type& m) {
+      m.insert_or_assign(key, std::forward<M>(obj));
+    });
+  }
+
+  void erase(const Key& key) {
+    update([&key](map_type& m) { m.erase(key); });
+  }
+
+  // Number of replaced tables still waiting for readers to move on.
+  size_t retired_count() const {
+    std::lock_guard<std::mutex> guard(writer_mutex_);
+    return retired_.size();
+  }
+
+ private:
+  rcu_map(const rcu_map&);
+  rcu_map& operator=(const rcu_map&);
+
+  reader_slot* _register_reader() {
+    std::lock_guard<std::mutex> guard(writer_mutex_);
+    readers_.push_back(new reader_slot);
+    return readers_.back();
+  }
+
+  void _unregister_reader(reader_slot* slot) {
+    std::lock_guard<std::mutex> guard(writer_mutex_);
+    for (size_t i = 0; i < readers_.size(); ++i) {
+      if (readers_[i] == slot) {
+        readers_[i] = readers_.back();
+        readers_.pop_back();
+        break;
+      }
+    }
+    delete slot;
+  }
+
+  // Frees every retired table that no active reader can still be probing.
+  // A reader that started before a table was retired may still hold it.
+  void _reclaim() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < readers_.size(); ++i) {
+      const uint64_t epoch = readers_[i]->epoch.load(std::memory_order_acquire);
+      if (epoch != 0 && epoch < oldest)
+        oldest = epoch;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      if (retired_[i].first <= oldest)
+        delete retired_[i].second;
+      else
+        retired_[kept++] = retired_[i];
+    }
+    retired_.resize(kept);
+  }
+
+  std::atomic<const map_type*> current_;
+  std::atomic<uint64_t> epoch_;
+  mutable std::mutex writer_mutex_;
+  std::vector<reader_slot*> readers_;
+  // replaced tables and the epoch they were replaced in
+  std::vector<std::pair<uint64_t, const map_type*> > retired_;
+};
+
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+#include "allocator.hpp"
+#include "map.hpp"
+
+namespace kokopuffs {
+
+// Open addressing hash set, a kokopuffs::map whose slots only hold the key.
+// It takes the same policies, so the default quadratic_probing needs
+// set_empty_key() (and set_deleted_key() before erasing) like map does.
+template<typename Key,
+         typename Hash = kokopuffs::hash<Key>,
+         typename KeyEqual = kokopuffs::equal_to<Key>,
+         typename Policy = map_policy<>,
+         typename Allocator = std::allocator<Key> >
+class set {
+ public:
+  typedef kokopuffs::map<Key, detail::set_value, Hash, KeyEqual, Policy,
+                         Allocator> map_type;
+
+  // Forward iterator over the keys, which cannot be modified through it.
+  class const_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Key value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Key* pointer;
+    typedef const Key& reference;
+
+    const_iterator() {}
+
+    reference operator*() const {
+      return it_->key;
+    }
+
+    pointer operator->() const {
+      return &it_->key;
+    }
+
+    const_iterator& operator++() {
+      ++it_;
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator old(*this);
+      ++it_;
+      return old;
+    }
+
+    friend bool operator==(const const_iterator& lhs,
+                           const const_iterator& rhs) {
+      return lhs.it_ == rhs.it_;
+    }
+
+    friend bool operator!=(const const_iterator& lhs,
+                           const const_iterator& rhs) {
+      return lhs.it_ != rhs.it_;
+    }
+
+   private:
+    friend class set;
+
+    explicit const_iterator(typename map_type::const_iterator it) : it_(it) {}
+
+    typename map_type::const_iterator it_;
+  };
+
+  typedef const_iterator iterator;
+
+  explicit set(size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE,
+               const Hash& hash = Hash(),
+               const KeyEqual& equal = KeyEqual(),
+               const Allocator& alloc = Allocator())
+      : map_(initial_table_size, hash, equal, alloc) {}
+
+  void set_empty_key(const Key& key) {
+    map_.set_empty_key(key);
+  }
+
+  void set_deleted_key(const Key& key) {
+    map_.set_deleted_key(key);
+  }
+
+  // Returns the key's position and whether it was inserted.
+  std::pair<iterator, bool> insert(const Key& key) {
+    return _wrap(map_.try_emplace(key));
+  }
+
+  std::pair<iterator, bool> insert(Key&& key) {
+    return _wrap(map_.try_emplace(std::move(key)));
+  }
+
+  // Like the map's range insert, forward ranges reserve room for every key
+  // up front.
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+    _reserve_for(first, last,
+                 typename std::iterator_traits<InputIt>::iterator_category());
+    for (; first != last; ++first)
+      map_.try_emplace(*first);
+  }
+
+  size_t erase(const Key& key) {
+    return map_.erase(key);
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, size_t>::type
+  erase(const K& key) {
+    return map_.erase(key);
+  }
+
+  const_iterator begin() const {
+    return const_iterator(map_.begin());
+  }
+
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  const_iterator end() const {
+    return const_iterator(map_.end());
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+  const_iterator find(const Key& key) const {
+    return const_iterator(map_.find(key));
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, const_iterator>::type
+  find(const K& key) const {
+    return const_iterator(map_.find(key));
+  }
+
+  size_t count(const Key& key) const {
+    return map_.count(key);
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, size_t>::type
+  count(const K& key) const {
+    return map_.count(key);
+  }
+
+  bool contains(const Key& key) const {
+    return map_.contains(key);
+  }
+
+  template <typename K>
+  typename detail::enable_transparent<Hash, KeyEqual, K, bool>::type
+  contains(const K& key) const {
+    return map_.contains(key);
+  }
+
+  size_t size() const noexcept {
+    return map_.size();
+  }
+
+  bool empty() const noexcept {
+    return map_.empty();
+  }
+
+  size_t bucket_count() const noexcept {
+    return map_.bucket_count();
+  }
+
+  float load_factor() const noexcept {
+    return map_.load_factor();
+  }
+
+  map_stats stats() const {
+    return map_.stats();
+  }
+
+  void rehash(size_t n) {
+    map_.rehash(n);
+  }
+
+  void reserve(size_t n) {
+    map_.reserve(n);
+  }
+
+  void compact() {
+    map_.compact();
+  }
+
+  void max_load_factor(float z) {
+    map_.max_load_factor(z);
+  }
+
+  void min_load_factor(float z) {
+    map_.min_load_factor(z);
+  }
+
+  Allocator get_allocator() const {
+    return map_.get_allocator();
+  }
+
+ private:
+  static std::pair<iterator, bool> _wrap(
+      const std::pair<typename map_type::iterator, bool>& result) {
+    return std::make_pair(iterator(result.first), result.second);
+  }
+
+  template <typename InputIt>
+  void _reserve_for(InputIt first, InputIt last, std::forward_iterator_tag) {
+    reserve(size() + static_cast<size_t>(std::distance(first, last)));
+  }
+
+  template <typename InputIt>
+  void _reserve_for(InputIt, InputIt, std::input_iterator_tag) {}
+
+  map_type map_;
+};
+
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "map.hpp"
+
+// On-disk snapshots of a kokopuffs::map that are queried in place.
+//
+// write_snapshot() lays the entries out as a group_probing table, control
+// bytes followed by the slots, and snapshot_view mmaps the file read-only and
+// probes it directly, so opening one costs no more than the page faults of
+// the lookups, and every process mapping the same file shares its pages.
+//
+// Keys and values have to be trivially copyable, except for std::string
+// keys, which are stored as an offset and size into a blob at the end of the
+// file. The hasher must give the same results in every process, which the
+// kokopuffs::hash defaults do (std::hash makes no such promise).
+//
+// The file is in native byte order, and has to be read by a build with the
+// same group width (16 slots with SSE2, 32 with AVX2); snapshot_view refuses
+// anything else.
+
+namespace kokopuffs {
+
+namespace detail {
+
+static const char kSnapshotMagic[8] = {'k', 'o', 'k', 'o', 's', 'n', 'a', 'p'};
+static const uint32_t kSnapshotVersion = 1;
+static const uint32_t kSnapshotByteOrder = 0x01020304;
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t hash_bits;
+  uint32_t group_width;
+  // sizeof(Key), or 0 for keys in the string blob
+  uint32_t key_size;
+  uint32_t value_size;
+  uint64_t bucket_count;
+  uint64_t item_count;
+  uint64_t ctrl_offset;
+  uint64_t slots_offset;
+  uint64_t blob_offset;
+  uint64_t blob_size;
+};
+
+template <typename Key, typename Value>
+struct snapshot_slot {
+  static const uint32_t kKeySize = sizeof(Key);
+
+  Key key;
+  Value value;
+};
+
+template <typename Value>
+struct snapshot_slot<std::string, Value> {
+  static const uint32_t kKeySize = 0;
+
+  uint64_t key_offset;
+  uint64_t key_size;
+  Value value;
+};
+
+inline uint64_t snapshot_align(uint64_t offset) {
+  return (offset + 63) & ~uint64_t(63);
+}
+
+template <typename Key, typename Value>
+void set_snapshot_key(snapshot_slot<Key, Value>& slot, const Key& key,
+                      std::string&) {
+  slot.key = key;
+}
+
+template <typename Value>
+void set_snapshot_key(snapshot_slot<std::string, Value>& slot,
+                      const std::string& key, std::string& blob) {
+  slot.key_offset = blob.size();
+  slot.key_size = key.size();
+  blob += key;
+}
+
+}  // namespace detail
+
+// Writes every entry of m to path, replacing the file.
+template <typename Key, typename Value, typename Hash, typename KeyEqual,
+          typename Policy, typename Allocator>
+void write_snapshot(
+    const map<Key, Value, Hash, KeyEqual, Policy, Allocator>& m,
+    const std::string& path) {
+  typedef detail::snapshot_slot<Key, Value> slot;
+  static_assert(std::is_trivially_copyable<Value>::value,
+                "snapshot values must be trivially copyable");
+  static_assert(std::is_same<Key, std::string>::value ||
+                    std::is_trivially_copyable<Key>::value,
+                "snapshot keys must be trivially copyable or std::string");
+
+  // same sizing as map::reserve() with the default max load factor
+  const size_t bucket_count = std::max(
+      detail::next_power_of_two(m.size() * 2), detail::kGroupWidth);
+  std::vector<detail::ctrl_t> ctrl(bucket_count, detail::kCtrlEmpty);
+  std::vector<slot> slots(bucket_count);
+  std::string blob;
+
+  const size_t group_mask = bucket_count / detail::kGroupWidth - 1;
+  for (typename map<Key, Value, Hash, KeyEqual, Policy,
+                    Allocator>::const_iterator it = m.begin();
+       it != m.end(); ++it) {
+    const size_t hash = m.get_hash(it->key);
+    size_t group = hash & group_mask;
+    size_t index;
+    for (size_t probe_count = 0; ; ++probe_count) {
+      group = (group + probe_count) & group_mask;
+      const size_t base = group * detail::kGroupWidth;
+      const uint32_t empty = detail::ctrl_group(&ctrl[base]).match_empty();
+      if (empty) {
+        index = base + detail::count_trailing_zeros(empty);
+        break;
+      }
+    }
+    ctrl[index] = detail::h2(hash);
+    detail::set_snapshot_key(slots[index], it->key, blob);
+    slots[index].value = it->value;
+  }
+
+  detail::snapshot_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, detail::kSnapshotMagic, sizeof(header.magic));
+  header.version = detail::kSnapshotVersion;
+  header.byte_order = detail::kSnapshotByteOrder;
+  header.hash_bits = sizeof(size_t) * 8;
+  header.group_width = detail::kGroupWidth;
+  header.key_size = slot::kKeySize;
+  header.value_size = sizeof(Value);
+  header.bucket_count = bucket_count;
+  header.item_count = m.size();
+  header.ctrl_offset = detail::snapshot_align(sizeof(header));
+  header.slots_offset = detail::snapshot_align(header.ctrl_offset + bucket_count);
+  header.blob_offset = detail::snapshot_align(
+      header.slots_offset + bucket_count * sizeof(slot));
+  header.blob_size = blob.size();
+
+  FILE* file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    throw std::runtime_error("kokopuffs::write_snapshot() cannot open " + path);
+  std::vector<char> padding(64, 0);
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && std::fwrite(&padding[0], 1, header.ctrl_offset - sizeof(header),
+                         file) == header.ctrl_offset - sizeof(header);
+  ok = ok && std::fwrite(&ctrl[0], 1, bucket_count, file) == bucket_count;
+  const size_t ctrl_end = header.ctrl_offset + bucket_count;
+  ok = ok && std::fwrite(&padding[0], 1, header.slots_offset - ctrl_end,
+                         file) == header.slots_offset - ctrl_end;
+  ok = ok && std::fwrite(&slots[0], sizeof(slot), bucket_count, file) ==
+                 bucket_count;
+  const size_t slots_end = header.slots_offset + bucket_count * sizeof(slot);
+  ok = ok && std::fwrite(&padding[0], 1, header.blob_offset - slots_end,
+                         file) == header.blob_offset - slots_end;
+  ok = ok && (blob.empty() ||
+              std::fwrite(blob.data(), 1, blob.size(), file) == blob.size());
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok)
+    throw std::runtime_error("kokopuffs::write_snapshot() cannot write " + path);
+}
+
+// Read-only view of a file written by write_snapshot(), with the same Key,
+// Value and Hash. Lookups probe the mapped file directly.
+template <typename Key, typename Value,
+          typename Hash = kokopuffs::hash<Key>,
+          typename KeyEqual = kokopuffs::equal_to<Key> >
+class snapshot_view {
+  typedef detail::snapshot_slot<Key, Value> slot;
+
+ public:
+  explicit snapshot_view(const std::string& path,
+                         const Hash& hash = Hash(),
+                         const KeyEqual& equal = KeyEqual())
+      : hasher_(hash), equal_(equal), data_(nullptr), size_(0) {
+    _map_file(path);
+    try {
+      _check_header(path);
+    } catch (...) {
+      _unmap_file();
+      throw;
+    }
+    ctrl_ = reinterpret_cast<const detail::ctrl_t*>(data_ +
+                                                    header().ctrl_offset);
+    slots_ = reinterpret_cast<const slot*>(data_ + header().slots_offset);
+    blob_ = data_ + header().blob_offset;
+  }
+
+  ~snapshot_view() {
+    _unmap_file();
+  }
+
+  // Pointer into the mapped file, or nullptr if key is not in the snapshot.
+  // It stays valid as long as the view.
+  template <typename K>
+  const Value* find(const K& key) const {
+    const size_t hash = hasher_(key);
+    const size_t group_mask = header().bucket_count / detail::kGroupWidth - 1;
+    const detail::ctrl_t h2 = detail::h2(hash);
+    size_t group = hash & group_mask;
+
+    for (size_t probe_count = 0; probe_count <= group_mask; ++probe_count) {
+      group = (group + probe_count) & group_mask;
+      const size_t base = group * detail::kGroupWidth;
+      const detail::ctrl_group g(ctrl_ + base);
+      for (uint32_t match = g.match(h2); match; match &= match - 1) {
+        const slot& s = slots_[base + detail::count_trailing_zeros(match)];
+        if (_key_equals(s, key, std::is_same<Key, std::string>()))
+          return &s.value;
+      }
+      if (g.match_empty())
+        return nullptr;
+    }
+    return nullptr;
+  }
+
+  template <typename K>
+  bool contains(const K& key) const {
+    return find(key) != nullptr;
+  }
+
+  size_t size() const {
+    return header().item_count;
+  }
+
+ private:
+  snapshot_view(const snapshot_view&);
+  snapshot_view& operator=(const snapshot_view&);
+
+  const detail::snapshot_header& header() const {
+    return *reinterpret_cast<const detail::snapshot_header*>(data_);
+  }
+
+  void _map_file(const std::string& path) {
+#ifdef KOKOPUFFS_HAS_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("kokopuffs::snapshot_view cannot open " + path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      throw std::runtime_error("kokopuffs::snapshot_view cannot map " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    void* p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("kokopuffs::snapshot_view cannot map " + path);
+    data_ = static_cast<const char*>(p);
+#else
+    // no mmap, so fall back to reading the whole file in
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      throw std::runtime_error("kokopuffs::snapshot_view cannot open " + path);
+    std::fseek(file, 0, SEEK_END);
+    size_ = static_cast<size_t>(std::ftell(file));
+    std::fseek(file, 0, SEEK_SET);
+    char* buffer = static_cast<char*>(::operator new(size_));
+    const bool ok = std::fread(buffer, 1, size_, file) == size_;
+    std::fclose(file);
+    data_ = buffer;
+    if (!ok) {
+      _unmap_file();
+      throw std::runtime_error("kokopuffs::snapshot_view cannot read " + path);
+    }
+#endif
+  }
+
+  void _unmap_file() {
+    if (data_ == nullptr)
+      return;
+#ifdef KOKOPUFFS_HAS_MMAP
+    ::munmap(const_cast<char*>(data_), size_);
+#else
+    ::operator delete(const_cast<char*>(data_));
+#endif
+    data_ = nullptr;
+  }
+
+  void _check_header(const std::string& path) const {
+    const detail::snapshot_header& h = header();
+    const bool ok =
+        size_ >= sizeof(h) &&
+        std::memcmp(h.magic, detail::kSnapshotMagic, sizeof(h.magic)) == 0 &&
+        h.version == detail::kSnapshotVersion &&
+        h.byte_order == detail::kSnapshotByteOrder &&
+        h.hash_bits == sizeof(size_t) * 8 &&
+        h.group_width == detail::kGroupWidth &&
+        h.key_size == slot::kKeySize &&
+        h.value_size == sizeof(Value) &&
+        h.bucket_count >= detail::kGroupWidth &&
+        (h.bucket_count & (h.bucket_count - 1)) == 0 &&
+        h.slots_offset >= h.ctrl_offset + h.bucket_count &&
+        h.blob_offset >= h.slots_offset + h.bucket_count * sizeof(slot) &&
+        h.blob_offset + h.blob_size <= size_;
+    if (!ok)
+      throw std::runtime_error("kokopuffs::snapshot_view " + path +
+                               " is not a compatible snapshot");
+  }
+
+  template <typename K>
+  bool _key_equals(const slot& s, const K& key, std::false_type) const {
+    return equal_(s.key, key);
+  }
+
+  // string keys live in the blob
+  template <typename K>
+  bool _key_equals(const slot& s, const K& key, std::true_type) const {
+    const std::pair<const char*, size_t> chars = detail::string_chars(key);
+    return s.key_size == chars.second &&
+           std::memcmp(blob_ + s.key_offset, chars.first, chars.second) == 0;
+  }
+
+  Hash hasher_;
+  KeyEqual equal_;
+  const char* data_;
+  size_t size_;
+  const detail::ctrl_t* ctrl_;
+  const slot* slots_;
+  const char* blob_;
+};
+
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "map.hpp"
+
+namespace kokopuffs {
+
+// Map with string keys that stores them without std::string.
+//
+// Keys of up to kInlineKeySize bytes are kept in the slot itself, longer ones
+// in a contiguous append-only key arena that the slot points into. Each slot
+// also keeps the key's length and the low 32 bits of its hash, so a probe
+// only reads key bytes once the group_probing tag, the length and the hash
+// prefix have all matched, and for short keys those bytes are on the slot's
+// own cache line. The tag comes from the top 7 bits, so the prefix filters
+// on bits of its own, and a resize places entries by their prefix instead
+// of hashing the keys again. Lookups take anything detail::string_chars() accepts: std::string,
+// const char*, or std::string_view in C++17. Keys hash like
+// kokopuffs::hash<std::string>.
+//
+// Erased long keys stay in the arena until the next resize, which only
+// copies the live ones over.
+template <typename Value>
+class string_map {
+ public:
+  static const size_t kInlineKeySize = 16;
+
+  explicit string_map(size_t initial_table_size = KOKOPUFFS_MAP_INTIAL_SIZE)
+      : bucket_count_(std::max(detail::next_power_of_two(initial_table_size),
+                               detail::kGroupWidth)),
+        item_count_(0),
+        used_count_(0) {
+    _create_table(bucket_count_);
+  }
+
+  string_map(const string_map& other)
+      : bucket_count_(other.bucket_count_),
+        item_count_(0),
+        used_count_(0) {
+    _create_table(bucket_count_);
+    other._copy_into(*this);
+  }
+
+  string_map& operator=(const string_map& other) {
+    if (&other != this) {
+      string_map copy(other);
+      swap(copy);
+    }
+    return *this;
+  }
+
+  string_map(string_map&& other)
+      : bucket_count_(0),
+        item_count_(0),
+        used_count_(0),
+        ctrl_(nullptr),
+        slots_(nullptr) {
+    swap(other);
+  }
+
+  string_map& operator=(string_map&& other) {
+    swap(other);
+    return *this;
+  }
+
+  ~string_map() {
+    _delete_table(ctrl_, slots_, bucket_count_);
+  }
+
+  void swap(string_map& other) {
+    std::swap(bucket_count_, other.bucket_count_);
+    std::swap(item_count_, other.item_count_);
+    std::swap(used_count_, other.used_count_);
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    arena_.swap(other.arena_);
+  }
+
+  template <typename K>
+  Value& operator[](const K& key) {
+    // the insert may resize, so slots_ must only be read afterwards
+    const size_t index = _find_or_insert(detail::string_chars(key)).first;
+    return slots_[index].value;
+  }
+
+  // Returns true if key was inserted, false if its value was replaced.
+  template <typename K, typename M>
+  bool insert_or_assign(const K& key, M&& obj) {
+    const std::pair<size_t, bool> result =
+        _find_or_insert(detail::string_chars(key), std::forward<M>(obj));
+    if (!result.second)
+      slots_[result.first].value = std::forward<M>(obj);
+    return result.second;
+  }
+
+  // Pointer to key's value, or nullptr if it is missing. Inserts may move
+  // values, so it is only valid until the next insert.
+  template <typename K>
+  Value* find(const K& key) {
+    const size_t index = _find_index(detail::string_chars(key));
+    return index == kNotFound ? nullptr : &slots_[index].value;
+  }
+
+  template <typename K>
+  const Value* find(const K& key) const {
+    const size_t index = _find_index(detail::string_chars(key));
+    return index == kNotFound ? nullptr : &slots_[index].value;
+  }
+
+  template <typename K>
+  Value& at(const K& key) {
+    Value* value = find(key);
+    if (value == nullptr)
+      throw std::out_of_range("kokopuffs::string_map.at() key not found");
+    return *value;
+  }
+
+  template <typename K>
+  const Value& at(const K& key) const {
+    const Value* value = find(key);
+    if (value == nullptr)
+      throw std::out_of_range("kokopuffs::string_map.at() key not found");
+    return *value;
+  }
+
+  template <typename K>
+  bool contains(const K& key) const {
+    return _find_index(detail::string_chars(key)) != kNotFound;
+  }
+
+  template <typename K>
+  size_t count(const K& key) const {
+    return contains(key) ? 1 : 0;
+  }
+
+  template <typename K>
+  size_t erase(const K& key) {
+    const size_t index = _find_index(detail::string_chars(key));
+    if (index == kNotFound)
+      return 0;
+    slots_[index].value.~Value();
+    // same rule as map's group_probing erase
+    const size_t base = index & ~(detail::kGroupWidth - 1);
+    if (detail::ctrl_group(ctrl_ + base).match_empty()) {
+      ctrl_[index] = detail::kCtrlEmpty;
+      --used_count_;
+    } else {
+      ctrl_[index] = detail::kCtrlDeleted;
+    }
+    --item_count_;
+    return 1;
+  }
+
+  // Calls f(const char* key, size_t size, const Value& value) for every
+  // entry. The key is not null terminated.
+  template <typename F>
+  void visit_all(F f) const {
+    for (size_t i = 0; i < bucket_count_; ++i) {
+      if (detail::ctrl_is_full(ctrl_[i]))
+        f(_key_data(slots_[i]), slots_[i].size, slots_[i].value);
+    }
+  }
+
+  // Makes room for n keys in total without any further resize.
+  void reserve(size_t n) {
+    const size_t count = detail::next_power_of_two(n + n / 7 + 1);
+    if (count > bucket_count_)
+      _resize(count);
+  }
+
+  size_t size() const noexcept {
+    return item_count_;
+  }
+
+  bool empty() const noexcept {
+    return item_count_ == 0;
+  }
+
+  size_t bucket_count() const noexcept {
+    return bucket_count_;
+  }
+
+  float load_factor() const noexcept {
+    return item_count_ / static_cast<float>(bucket_count_);
+  }
+
+  // bytes of long keys in the arena, erased ones included
+  size_t key_arena_size() const noexcept {
+    return arena_.size();
+  }
+
+ private:
+  static const size_t kNotFound = static_cast<size_t>(-1);
+
+  struct slot {
+    uint32_t hash;
+    uint32_t size;
+    union {
+      char chars[kInlineKeySize];
+      uint64_t offset;
+    } key;
+    Value value;
+  };
+
+  typedef std::pair<const char*, size_t> chars;
+
+  // The low bits also pick the group, so a prefix is all a resize needs to
+  // place an entry while there are at most 2^32 groups.
+  static uint32_t _hash_prefix(const uint64_t hash) {
+    return static_cast<uint32_t>(hash);
+  }
+
+  // the group_probing tag, from the top bits of the 64-bit hash even where
+  // size_t is narrower, so it never overlaps the prefix
+  static detail::ctrl_t _h2(const uint64_t hash) {
+    return static_cast<detail::ctrl_t>(hash >> 57);
+  }
+
+  const char* _key_data(const slot& s) const {
+    return s.size <= kInlineKeySize ? s.key.chars : &arena_[s.key.offset];
+  }
+
+  void _create_table(const size_t bucket_count) {
+    ctrl_ = static_cast<detail::ctrl_t*>(::operator new(bucket_count));
+    std::memset(ctrl_, detail::kCtrlEmpty, bucket_count);
+    slots_ = static_cast<slot*>(::operator new(bucket_count * sizeof(slot)));
+  }
+
+  static void _delete_table(detail::ctrl_t* ctrl, slot* slots,
+                            const size_t bucket_count) {
+    for (size_t i = 0; i < bucket_count; ++i) {
+      if (detail::ctrl_is_full(ctrl[i]))
+        slots[i].value.~Value();
+    }
+    ::operator delete(ctrl);
+    ::operator delete(slots);
+  }
+
+  // Same group probe as map's group_probing, with the length and the hash
+  // prefix checked before any key bytes.
+  size_t _find_index(const chars& key) const {
+    return _find_index(key, wyhash(key.first, key.second));
+  }
+
+  size_t _find_index(const chars& key, const uint64_t hash) const {
+    const size_t group_mask = bucket_count_ / detail::kGroupWidth - 1;
+    const detail::ctrl_t h2 = _h2(hash);
+    const uint32_t prefix = _hash_prefix(hash);
+    size_t group = static_cast<size_t>(hash) & group_mask;
+
+    for (size_t probe_count = 0; probe_count <= group_mask; ++probe_count) {
+      group = (group + probe_count) & group_mask;
+      const size_t base = group * detail::kGroupWidth;
+      const detail::ctrl_group g(ctrl_ + base);
+      for (uint32_t match = g.match(h2); match; match &= match - 1) {
+        const size_t index = base + detail::count_trailing_zeros(match);
+        const slot& s = slots_[index];
+        if (s.hash == prefix && s.size == key.second &&
+            std::memcmp(_key_data(s), key.first, key.second) == 0)
+          return index;
+      }
+      if (g.match_empty())
+        return kNotFound;
+    }
+    return kNotFound;
+  }
+
+  // First free slot on hash's probe sequence. Reusing a tombstone is fine
+  // since the caller has already made sure the key is not in the table.
+  size_t _find_free_slot(const uint64_t hash) const {
+    const size_t group_mask = bucket_count_ / detail::kGroupWidth - 1;
+    size_t group = static_cast<size_t>(hash) & group_mask;
+    for (size_t probe_count = 0; ; ++probe_count) {
+      group = (group + probe_count) & group_mask;
+      const size_t base = group * detail::kGroupWidth;
+      const uint32_t free_slots =
+          detail::ctrl_group(ctrl_ + base).match_empty_or_deleted();
+      if (free_slots)
+        return base + detail::count_trailing_zeros(free_slots);
+    }
+  }
+
+  template <typename... Args>
+  std::pair<size_t, bool> _find_or_insert(const chars& key, Args&&... args) {
+    const uint64_t hash = wyhash(key.first, key.second);
+    const size_t found = _find_index(key, hash);
+    if (found != kNotFound)
+      return std::make_pair(found, false);
+
+    // tombstones count towards the load, so probes always end at an empty
+    // slot; a resize to the same size just clears them
+    if ((used_count_ + 1) * 8 > bucket_count_ * 7)
+      _resize(item_count_ * 2 >= bucket_count_ ? bucket_count_ * 2
+                                               : bucket_count_);
+
+    const size_t index = _find_free_slot(hash);
+    slot& s = slots_[index];
+    new (&s.value) Value(std::forward<Args>(args)...);
+    if (ctrl_[index] == detail::kCtrlEmpty)
+      ++used_count_;
+    ctrl_[index] = _h2(hash);
+    s.hash = _hash_prefix(hash);
+    s.size = static_cast<uint32_t>(key.second);
+    if (key.second <= kInlineKeySize) {
+      std::memcpy(s.key.chars, key.first, key.second);
+    } else {
+      s.key.offset = arena_.size();
+      arena_.insert(arena_.end(), key.first, key.first + key.second);
+    }
+    ++item_count_;
+    return std::make_pair(index, true);
+  }
+
+  // Moves every entry into a fresh table, and the long keys into a fresh
+  // arena without the erased ones. The group comes from the stored hash
+  // prefix and the tag is copied over, so keys are only hashed again in a
+  // table of more than 2^32 groups.
+  void _resize(const size_t new_bucket_count) {
+    detail::ctrl_t* old_ctrl = ctrl_;
+    slot* old_slots = slots_;
+    const size_t old_bucket_count = bucket_count_;
+    std::vector<char> old_arena;
+    old_arena.swap(arena_);
+
+    bucket_count_ = new_bucket_count;
+    used_count_ = item_count_;
+    _create_table(bucket_count_);
+    const bool rehash_keys =
+        static_cast<uint64_t>(bucket_count_ / detail::kGroupWidth) >
+        (uint64_t(1) << 32);
+
+    for (size_t i = 0; i < old_bucket_count; ++i) {
+      if (!detail::ctrl_is_full(old_ctrl[i]))
+        continue;
+      slot& old_slot = old_slots[i];
+      const char* key = old_slot.size <= kInlineKeySize
+                            ? old_slot.key.chars
+                            : &old_arena[old_slot.key.offset];
+      const uint64_t hash =
+          rehash_keys ? wyhash(key, old_slot.size) : old_slot.hash;
+      const size_t index = _find_free_slot(hash);
+      slot& s = slots_[index];
+      new (&s.value) Value(std::move(old_slot.value));
+      old_slot.value.~Value();
+      ctrl_[index] = old_ctrl[i];
+      s.hash = old_slot.hash;
+      s.size = old_slot.size;
+      if (old_slot.size <= kInlineKeySize) {
+        s.key = old_slot.key;
+      } else {
+        s.key.offset = arena_.size();
+        arena_.insert(arena_.end(), key, key + old_slot.size);
+      }
+    }
+    ::operator delete(old_ctrl);
+    ::operator delete(old_slots);
+  }
+
+  void _copy_into(string_map& other) const {
+    for (size_t i = 0; i < bucket_count_; ++i) {
+      if (detail::ctrl_is_full(ctrl_[i])) {
+        const slot& s = slots_[i];
+        other._find_or_insert(chars(_key_data(s), s.size), s.value);
+      }
+    }
+  }
+
+  size_t bucket_count_;
+  size_t item_count_;
+  // full slots plus tombstones
+  size_t used_count_;
+  detail::ctrl_t* ctrl_;
+  slot* slots_;
+  std::vector<char> arena_;
+};
+
+template <typename Value>
+const size_t string_map<Value>::kInlineKeySize;
+
+}
@@ -1,13 +1,35 @@
 #include "kokopuffs/map.hpp"
+#include "kokopuffs/concurrent_map.hpp"
+#include "kokopuffs/rcu_map.hpp"
+#include "kokopuffs/snapshot.hpp"
+#include "kokopuffs/string_map.hpp"
+#include "kokopuffs/set.hpp"
+#include "kokopuffs/flat_int_map.hpp"
+#include "kokopuffs/btree_map.hpp"
 #include "kokopuffs/max_heap.hpp"
 #include "kokopuffs/min_heap.hpp"
 #include "kokopuffs/algorithm.hpp"
+#include "kokopuffs/parallel_sort.hpp"
 #include "Stopwatch.hpp"
 
 #include <string>
 #include <iostream>
 #include <vector>
+#include <memory>
 #include <random>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cmath>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAS_MALLINFO2
+#endif
 
 using namespace kokopuffs;
 
@@ -93,6 +115,1371 @@ void test_map() {
   smap._debug();
 }
 
+// Random inserts and erases checked against std::unordered_map, then
+// through a copy and a move of the map.
+template <typename Map>
+void check_random_ops(const char* name) {
+  Map m;
+  std::unordered_map<std::string, int> expected;
+  std::minstd_rand re(42);
+  std::uniform_int_distribution<int> key_dist(0, 5000);
+
+  for (int i = 0; i < 200000; ++i) {
+    const std::string key = std::to_string(key_dist(re));
+    if (i % 3 == 0) {
+      if (m.erase(key) != expected.erase(key))
+        throw std::runtime_error(std::string(name) + " erase mismatch");
+    } else {
+      m[key] = i;
+      expected[key] = i;
+    }
+  }
+
+  Map copy(m);
+  Map moved;
+  moved = std::move(m);
+  if (copy.size() != expected.size() || moved.size() != expected.size())
+    throw std::runtime_error(std::string(name) + " size mismatch");
+  for (const auto& kv : expected) {
+    if (copy[kv.first] != kv.second || moved[kv.first] != kv.second)
+      throw std::runtime_error(std::string(name) + " value mismatch");
+  }
+  std::cout << name << " map matched std::unordered_map\n";
+}
+
+void test_map_probing() {
+  check_random_ops<
+      kokopuffs::map<std::string, int, kokopuffs::hash<std::string>,
+                     kokopuffs::equal_to<std::string>,
+                     kokopuffs::map_policy<kokopuffs::group_probing> > >(
+      "group_probing");
+  check_random_ops<
+      kokopuffs::map<std::string, int, kokopuffs::hash<std::string>,
+                     kokopuffs::equal_to<std::string>,
+                     kokopuffs::map_policy<kokopuffs::robin_hood_probing> > >(
+      "robin_hood_probing");
+}
+
+void test_map_integer_keys() {
+  kokopuffs::map<uint64_t, int, kokopuffs::hash<uint64_t>,
+                 kokopuffs::equal_to<uint64_t>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > m;
+  kokopuffs::map<uint64_t, int> dense;
+  dense.set_empty_key(~0ull);
+  dense.set_deleted_key(~0ull - 1);
+
+  // multiples of a power of two would all land in a few buckets without
+  // mixing
+  for (uint64_t i = 0; i < 100000; ++i) {
+    m[i << 12] = static_cast<int>(i);
+    dense[i << 12] = static_cast<int>(i);
+  }
+  for (uint64_t i = 0; i < 100000; i += 2) {
+    m.erase(i << 12);
+    dense.erase(i << 12);
+  }
+  if (m.size() != 50000 || dense.size() != 50000)
+    throw std::runtime_error("integer key size mismatch");
+  for (uint64_t i = 1; i < 100000; i += 2) {
+    if (m[i << 12] != static_cast<int>(i) ||
+        dense[i << 12] != static_cast<int>(i))
+      throw std::runtime_error("integer key value mismatch");
+  }
+  std::cout << "integer keyed maps ok\n";
+}
+
+void test_map_heterogeneous_lookup() {
+  kokopuffs::map<std::string, int> m;
+  m.set_empty_key("");
+  m.set_deleted_key("<deleted>");
+  m["foo"] = 1;
+  m["bar"] = 2;
+
+  // a slice of a larger buffer, looked up without building a std::string
+  const char* buffer = "foo bar";
+  if (!m.contains("foo") || m.count(buffer + 4) != 1 || m.contains("fizz"))
+    throw std::runtime_error("heterogeneous contains mismatch");
+#ifdef KOKOPUFFS_HAS_STRING_VIEW
+  if (!m.contains(std::string_view(buffer, 3)))
+    throw std::runtime_error("string_view contains mismatch");
+#endif
+  if (m.erase("foo") != 1 || m.erase("foo") != 0 || m.size() != 1)
+    throw std::runtime_error("heterogeneous erase mismatch");
+  std::cout << "heterogeneous lookup ok\n";
+}
+
+template <typename Map>
+void check_find_and_iterators(Map& m) {
+  for (int i = 0; i < 1000; ++i)
+    m[std::to_string(i)] = i;
+  for (int i = 0; i < 1000; i += 2)
+    m.erase(std::to_string(i));
+
+  // misses must not insert or resize
+  const size_t bucket_count = m.bucket_count();
+  for (int i = 1000; i < 100000; ++i) {
+    if (m.find(std::to_string(i)) != m.end() || m.contains(std::to_string(i)))
+      throw std::runtime_error("find hit a missing key");
+  }
+  if (m.size() != 500 || m.bucket_count() != bucket_count)
+    throw std::runtime_error("find mutated the map");
+
+  typename Map::iterator it = m.find("7");
+  if (it == m.end() || it->key != "7" || it->value != 7 || m.at("7") != 7)
+    throw std::runtime_error("find returned the wrong entry");
+  it->value = 70;
+  const Map& cm = m;
+  if (cm.at("7") != 70)
+    throw std::runtime_error("write through iterator lost");
+  bool threw = false;
+  try {
+    cm.at("8");
+  } catch (const std::out_of_range&) {
+    threw = true;
+  }
+  if (!threw)
+    throw std::runtime_error("at() did not throw on a missing key");
+
+  long sum = 0;
+  for (const auto& entry : cm)
+    sum += entry.value;
+  const long odd = std::count_if(
+      m.begin(), m.end(),
+      [](const typename Map::Entry& entry) { return entry.value % 2 == 1; });
+  typename Map::const_iterator first = m.begin();
+  if (sum != 250000 - 7 + 70 || odd != 499 || first == cm.end())
+    throw std::runtime_error("iteration mismatch");
+}
+
+void test_map_find_and_iterators() {
+  kokopuffs::map<std::string, int> dense;
+  dense.set_empty_key("");
+  dense.set_deleted_key("<deleted>");
+  check_find_and_iterators(dense);
+
+  kokopuffs::map<std::string, int, kokopuffs::hash<std::string>,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > m;
+  check_find_and_iterators(m);
+
+  kokopuffs::map<std::string, int, kokopuffs::hash<std::string>,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing> > robin;
+  check_find_and_iterators(robin);
+  std::cout << "find and iterators ok\n";
+}
+
+// counts copies so tests can check that the map only ever moves values
+struct copy_counter {
+  static int copies;
+
+  copy_counter() {}
+  explicit copy_counter(int n) : payload(n, n) {}
+  copy_counter(const copy_counter& other) : payload(other.payload) {
+    ++copies;
+  }
+  copy_counter(copy_counter&& other) : payload(std::move(other.payload)) {}
+  copy_counter& operator=(const copy_counter& other) {
+    payload = other.payload;
+    ++copies;
+    return *this;
+  }
+  copy_counter& operator=(copy_counter&& other) {
+    payload = std::move(other.payload);
+    return *this;
+  }
+
+  std::vector<int> payload;
+};
+int copy_counter::copies = 0;
+
+template <typename Map>
+void check_emplace(Map& m) {
+  copy_counter::copies = 0;
+  for (int i = 0; i < 10000; ++i) {
+    std::string key = std::to_string(i);
+    if (i % 3 == 0)
+      m.try_emplace(std::move(key), i);
+    else if (i % 3 == 1)
+      m.emplace(std::move(key), copy_counter(i));
+    else
+      m[std::move(key)] = copy_counter(i);
+  }
+  // existing keys: try_emplace leaves the value alone, insert_or_assign
+  // replaces it
+  if (m.try_emplace("5", 0).second || m.at("5").payload.size() != 5)
+    throw std::runtime_error("try_emplace replaced an existing value");
+  if (m.insert_or_assign("5", copy_counter(1)).second ||
+      m.at("5").payload.size() != 1 ||
+      !m.insert_or_assign("new", copy_counter(2)).second)
+    throw std::runtime_error("insert_or_assign mismatch");
+  if (copy_counter::copies != 0 || m.size() != 10001)
+    throw std::runtime_error("emplace or resize copied values");
+}
+
+void test_map_emplace() {
+  kokopuffs::map<std::string, copy_counter> dense;
+  dense.set_empty_key("");
+  check_emplace(dense);
+
+  kokopuffs::map<std::string, copy_counter, kokopuffs::hash<std::string>,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > m;
+  check_emplace(m);
+
+  kokopuffs::map<std::string, copy_counter, kokopuffs::hash<std::string>,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing> > robin;
+  check_emplace(robin);
+
+  // move-only values work too
+  kokopuffs::map<std::string, std::unique_ptr<int>,
+                 kokopuffs::hash<std::string>,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > ptrs;
+  for (int i = 0; i < 1000; ++i)
+    ptrs.try_emplace(std::to_string(i), new int(i));
+  if (*ptrs.at("999") != 999)
+    throw std::runtime_error("move-only value mismatch");
+  std::cout << "emplace ok\n";
+}
+
+// wraps the default string hash and counts how often it runs
+struct counting_hash {
+  static size_t calls;
+
+  size_t operator()(const std::string& key) const {
+    ++calls;
+    return kokopuffs::hash<std::string>()(key);
+  }
+};
+size_t counting_hash::calls = 0;
+
+template <kokopuffs::store_hash_mode StoreHash>
+size_t count_hash_calls() {
+  kokopuffs::map<std::string, int, counting_hash,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::group_probing, StoreHash> > m;
+  counting_hash::calls = 0;
+  for (int i = 0; i < 100000; ++i)
+    m[std::to_string(i)] = i;
+  for (int i = 0; i < 100000; ++i) {
+    if (m.at(std::to_string(i)) != i)
+      throw std::runtime_error("stored hash lookup mismatch");
+  }
+  return counting_hash::calls;
+}
+
+void test_map_store_hash() {
+  // one hash per insert and one per lookup, none during resizes
+  if (count_hash_calls<kokopuffs::store_hash_always>() != 200000)
+    throw std::runtime_error("stored hashes were recomputed");
+  if (count_hash_calls<kokopuffs::store_hash_never>() <= 200000)
+    throw std::runtime_error("resize did not rehash without stored hashes");
+
+  kokopuffs::map<std::string, int> dense;
+  dense.set_empty_key("");
+  dense.set_deleted_key("<deleted>");
+  for (int i = 0; i < 1000; ++i)
+    dense[std::to_string(i)] = i;
+  for (int i = 0; i < 1000; i += 2)
+    dense.erase(std::to_string(i));
+  for (int i = 0; i < 1000; ++i) {
+    if (dense.contains(std::to_string(i)) != (i % 2 == 1))
+      throw std::runtime_error("stored hash dense lookup mismatch");
+  }
+  std::cout << "stored hashes ok\n";
+}
+
+// Alternates between growing and shrinking the map, and checks every entry
+// through lookups and iteration, including while old tables are migrating.
+template <typename Map>
+void check_incremental_rehash(Map& m, const char* name) {
+  std::unordered_map<int, int> expected;
+  std::minstd_rand re(7);
+  std::uniform_int_distribution<int> key_dist(0, 20000);
+
+  for (int i = 0; i < 300000; ++i) {
+    const int key = key_dist(re);
+    const bool shrinking = (i / 50000) % 2 == 1;
+    if (shrinking ? i % 4 != 0 : i % 3 == 0) {
+      if (m.erase(key) != expected.erase(key))
+        throw std::runtime_error(std::string(name) + " erase mismatch");
+    } else {
+      m[key] = i;
+      expected[key] = i;
+    }
+
+    if (i % 1000 != 0)
+      continue;
+    const Map& cm = m;
+    size_t n = 0;
+    for (const auto& entry : cm) {
+      auto it = expected.find(entry.key);
+      if (it == expected.end() || it->second != entry.value)
+        throw std::runtime_error(std::string(name) + " iteration mismatch");
+      ++n;
+    }
+    if (n != expected.size() || cm.size() != expected.size())
+      throw std::runtime_error(std::string(name) + " size mismatch");
+    for (const auto& kv : expected) {
+      if (cm.find(kv.first) == cm.end() || cm.at(kv.first) != kv.second)
+        throw std::runtime_error(std::string(name) + " lookup mismatch");
+    }
+  }
+
+  Map copy(m);
+  for (const auto& kv : expected) {
+    if (copy.at(kv.first) != kv.second)
+      throw std::runtime_error(std::string(name) + " copy mismatch");
+  }
+}
+
+void test_map_incremental_rehash() {
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::quadratic_probing,
+                                       kokopuffs::store_hash_auto, true> >
+      dense;
+  dense.set_empty_key(-1);
+  dense.set_deleted_key(-2);
+  check_incremental_rehash(dense, "quadratic_probing");
+
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing,
+                                       kokopuffs::store_hash_auto, true> >
+      group;
+  check_incremental_rehash(group, "group_probing");
+
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing,
+                                       kokopuffs::store_hash_always, true> >
+      robin;
+  check_incremental_rehash(robin, "robin_hood_probing");
+  std::cout << "incremental rehash ok\n";
+}
+
+// tracks the bytes allocated through it, so tests can check nothing leaks,
+// and the number of allocations made through any of them
+long counted_allocations = 0;
+
+template <typename T>
+struct counting_allocator {
+  typedef T value_type;
+
+  explicit counting_allocator(long* live) : live(live) {}
+
+  template <typename U>
+  counting_allocator(const counting_allocator<U>& other) : live(other.live) {}
+
+  T* allocate(size_t n) {
+    *live += n * sizeof(T);
+    ++counted_allocations;
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    *live -= n * sizeof(T);
+    ::operator delete(p);
+  }
+
+  template <typename U>
+  bool operator==(const counting_allocator<U>& other) const {
+    return live == other.live;
+  }
+
+  template <typename U>
+  bool operator!=(const counting_allocator<U>& other) const {
+    return live != other.live;
+  }
+
+  long* live;
+};
+
+template <typename Map>
+void check_int_map(Map& m, int n) {
+  for (int i = 0; i < n; ++i)
+    m[i] = i * 2;
+  for (int i = 0; i < n; i += 2)
+    m.erase(i);
+  if (m.size() != static_cast<size_t>(n / 2))
+    throw std::runtime_error("allocator map size mismatch");
+  for (int i = 1; i < n; i += 2) {
+    if (m.at(i) != i * 2)
+      throw std::runtime_error("allocator map value mismatch");
+  }
+}
+
+void test_map_allocators() {
+  typedef kokopuffs::map<int, int, kokopuffs::hash<int>,
+                         kokopuffs::equal_to<int>,
+                         kokopuffs::map_policy<kokopuffs::group_probing>,
+                         counting_allocator<char> > counted_map;
+  long live = 0;
+  {
+    counted_map m(16, kokopuffs::hash<int>(), kokopuffs::equal_to<int>(),
+                  counting_allocator<char>(&live));
+    check_int_map(m, 100000);
+    counted_map copy(m);
+    counted_map moved(std::move(m));
+    if (live <= 0 || copy.get_allocator().live != &live)
+      throw std::runtime_error("allocator was not used");
+  }
+  if (live != 0)
+    throw std::runtime_error("allocator leaked");
+
+  kokopuffs::arena arena;
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing>,
+                 kokopuffs::arena_allocator<char> >
+      scratch(16, kokopuffs::hash<int>(), kokopuffs::equal_to<int>(),
+              kokopuffs::arena_allocator<char>(arena));
+  check_int_map(scratch, 100000);
+  if (arena.block_count() == 0)
+    throw std::runtime_error("arena was not used");
+
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::quadratic_probing>,
+                 kokopuffs::huge_page_allocator<char> > huge;
+  huge.set_empty_key(-1);
+  huge.set_deleted_key(-2);
+  check_int_map(huge, 1000000);
+  std::cout << "allocators ok\n";
+}
+
+void test_map_reserve() {
+  typedef kokopuffs::map<int, int, kokopuffs::hash<int>,
+                         kokopuffs::equal_to<int>,
+                         kokopuffs::map_policy<kokopuffs::group_probing> >
+      int_map;
+
+  // sizes are rounded up, and a presized table does not shrink back
+  int_map sized(1000);
+  sized[1] = 1;
+  if (sized.bucket_count() != 1024)
+    throw std::runtime_error("initial size not rounded to a power of two");
+
+  int_map m;
+  m.reserve(100000);
+  const size_t reserved = m.bucket_count();
+  if (reserved < 200000 || (reserved & (reserved - 1)) != 0)
+    throw std::runtime_error("reserve() bucket count");
+  for (int i = 0; i < 100000; ++i)
+    m[i] = i;
+  if (m.bucket_count() != reserved)
+    throw std::runtime_error("reserved map resized");
+
+  for (int i = 0; i < 100000; i += 4)
+    m.erase(i);
+  m.rehash(0);
+  if (m.bucket_count() != 262144 || m.size() != 75000 || m.at(7) != 7)
+    throw std::runtime_error("rehash(0) did not shrink to fit");
+
+  std::vector<std::pair<int, int> > snapshot;
+  for (int i = 0; i < 500000; ++i)
+    snapshot.push_back(std::make_pair(i, -i));
+  snapshot.push_back(std::make_pair(3, 3));
+  long live = 0;
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing>,
+                 counting_allocator<char> >
+      loaded(16, kokopuffs::hash<int>(), kokopuffs::equal_to<int>(),
+             counting_allocator<char>(&live));
+  const long allocations = counted_allocations;
+  loaded.insert(snapshot.begin(), snapshot.end());
+  if (loaded.size() != 500000 || loaded.at(3) != -3)
+    throw std::runtime_error("range insert mismatch");
+  // one table and its control bytes
+  if (counted_allocations - allocations != 2 || live <= 0)
+    throw std::runtime_error("range insert did not presize");
+  std::cout << "reserve ok\n";
+}
+
+template <typename Map>
+void check_batch(Map& m) {
+  std::vector<int> keys;
+  std::vector<int> values;
+  std::minstd_rand re(9);
+  std::uniform_int_distribution<int> key_dist(0, 60000);
+  for (int i = 0; i < 50000; ++i) {
+    keys.push_back(key_dist(re));
+    values.push_back(i);
+  }
+  std::unordered_map<int, int> expected;
+  for (size_t i = 0; i < keys.size(); ++i)
+    expected.insert(std::make_pair(keys[i], values[i]));
+
+  // an odd count, so the last batch is partial
+  const size_t size = m.size();
+  const size_t inserted = m.insert_batch(keys.data(), values.data(), 49999);
+  m.insert_batch(keys.data() + 49999, values.data() + 49999, 1);
+  if (m.size() != size + expected.size() || inserted + 1 < expected.size())
+    throw std::runtime_error("insert_batch size mismatch");
+
+  std::vector<int> lookups;
+  for (int i = -100; i < 61000; ++i)
+    lookups.push_back(i);
+  std::vector<typename Map::iterator> found(lookups.size());
+  m.find_batch(lookups.data(), lookups.size(), found.data());
+  const Map& const_m = m;
+  std::vector<typename Map::const_iterator> const_found(lookups.size());
+  const_m.find_batch(lookups.data(), lookups.size(), const_found.data());
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    std::unordered_map<int, int>::const_iterator it =
+        expected.find(lookups[i]);
+    if (it == expected.end()) {
+      if (found[i] != m.end() || const_found[i] != const_m.end())
+        throw std::runtime_error("find_batch found a missing key");
+    } else if (found[i] == m.end() || found[i]->value != it->second ||
+               const_found[i] != typename Map::const_iterator(found[i])) {
+      throw std::runtime_error("find_batch mismatch");
+    }
+  }
+}
+
+void test_map_batch() {
+  kokopuffs::map<int, int> quadratic;
+  quadratic.set_empty_key(-1);
+  check_batch(quadratic);
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > group;
+  check_batch(group);
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing> > robin;
+  check_batch(robin);
+  // lookups that have to check the old table as well
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing,
+                                       kokopuffs::store_hash_auto, true> >
+      incremental;
+  std::vector<int> old_keys;
+  // just past a resize, so most of these are still in the old table
+  for (int i = 0; i < 1030; ++i) {
+    incremental[100000 + i] = i;
+    old_keys.push_back(100000 + i);
+  }
+  std::vector<decltype(incremental)::iterator> old_found(old_keys.size());
+  incremental.find_batch(old_keys.data(), old_keys.size(), old_found.data());
+  for (size_t i = 0; i < old_keys.size(); ++i) {
+    if (old_found[i] == incremental.end() ||
+        old_found[i]->value != static_cast<int>(i))
+      throw std::runtime_error("find_batch missed the old table");
+  }
+  check_batch(incremental);
+  std::cout << "batched lookups ok\n";
+}
+
+template <typename Map>
+void check_parallel_build(Map& m) {
+  std::vector<std::pair<int, int> > pairs;
+  std::minstd_rand re(10);
+  // enough pairs to take several rounds of slices, with repeats across them
+  std::uniform_int_distribution<int> key_dist(0, 450000);
+  for (int i = 0; i < 600000; ++i)
+    pairs.push_back(std::make_pair(key_dist(re), i));
+  // existing keys and the first of repeated ones win
+  std::unordered_map<int, int> expected;
+  for (int i = 0; i < 5000; ++i) {
+    m[i * 3] = -i;
+    expected[i * 3] = -i;
+  }
+  for (size_t i = 0; i < pairs.size(); ++i)
+    expected.insert(pairs[i]);
+
+  m.parallel_insert(pairs.begin(), pairs.end(), 4);
+  for (int pass = 0; pass < 2; ++pass) {
+    if (m.size() != expected.size())
+      throw std::runtime_error("parallel build size mismatch");
+    size_t visited = 0;
+    for (typename Map::const_iterator it = m.begin(); it != m.end(); ++it) {
+      if (expected.at(it->key) != it->value)
+        throw std::runtime_error("parallel build value mismatch");
+      ++visited;
+    }
+    for (const auto& kv : expected) {
+      if (m.at(kv.first) != kv.second)
+        throw std::runtime_error("parallel build lookup mismatch");
+    }
+    if (visited != expected.size() || m.contains(-1))
+      throw std::runtime_error("parallel build iteration mismatch");
+    m.parallel_rehash(m.bucket_count() * 4, 3);
+  }
+}
+
+void test_map_parallel_build() {
+  kokopuffs::map<int, int> quadratic;
+  quadratic.set_empty_key(-1);
+  check_parallel_build(quadratic);
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > group;
+  check_parallel_build(group);
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing> > robin;
+  check_parallel_build(robin);
+  std::cout << "parallel build ok\n";
+}
+
+template <typename Map>
+void check_stats(Map& m, const char* name) {
+  for (int i = 0; i < 100000; ++i)
+    m[i] = i;
+  for (int i = 0; i < 100000; i += 3)
+    m.erase(i);
+
+  const kokopuffs::map_stats s = m.stats();
+  size_t counted = 0;
+  size_t total = 0;
+  for (size_t d = 0; d < s.probe_length_histogram.size(); ++d) {
+    counted += s.probe_length_histogram[d];
+    total += d * s.probe_length_histogram[d];
+  }
+  if (s.size != m.size() || counted != m.size() ||
+      s.probe_length_histogram.size() != s.max_probe_length + 1 ||
+      std::abs(s.mean_probe_length - total / double(counted)) > 1e-9)
+    throw std::runtime_error(std::string(name) + " probe length stats");
+  if (s.bucket_count != m.bucket_count() || s.load_factor != m.load_factor() ||
+      s.bytes_used < s.bucket_count * sizeof(typename Map::Entry))
+    throw std::runtime_error(std::string(name) + " occupancy stats");
+  if (s.rehash_count == 0 || s.rehash_nanoseconds == 0)
+    throw std::runtime_error(std::string(name) + " rehash stats");
+  std::cout << name << ": max probe " << s.max_probe_length << ", mean "
+            << s.mean_probe_length << ", " << s.tombstones << " tombstones, "
+            << s.rehash_count << " rehashes in "
+            << s.rehash_nanoseconds / 1000000.0 << " ms\n";
+}
+
+void test_map_stats() {
+  kokopuffs::map<int, int> quadratic;
+  quadratic.set_empty_key(-1);
+  quadratic.set_deleted_key(-2);
+  check_stats(quadratic, "quadratic_probing");
+  if (quadratic.stats().tombstones == 0)
+    throw std::runtime_error("erases left no tombstones");
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > group;
+  check_stats(group, "group_probing");
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing> > robin;
+  check_stats(robin, "robin_hood_probing");
+  if (robin.stats().tombstones != 0)
+    throw std::runtime_error("robin_hood_probing left tombstones");
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing,
+                                       kokopuffs::store_hash_auto, true> >
+      incremental;
+  check_stats(incremental, "incremental");
+  std::cout << "stats ok\n";
+}
+
+// Keeps about 1000 keys live while always inserting new ones, which used to
+// fill the table with tombstones until every probe scanned most of it.
+template <typename Map>
+void check_churn(Map& m, const char* name) {
+  for (int i = 0; i < 1000; ++i)
+    m[i] = i;
+  const size_t bucket_count = m.bucket_count();
+  size_t max_probe_length = 0;
+  for (int i = 1000; i < 1000000; ++i) {
+    m.erase(i - 1000);
+    m[i] = i;
+    if (i % 50000 == 0)
+      max_probe_length = std::max(max_probe_length,
+                                  m.stats().max_probe_length);
+  }
+  const kokopuffs::map_stats s = m.stats();
+  if (m.size() != 1000 || m.bucket_count() != bucket_count ||
+      s.size + s.tombstones > s.bucket_count * 3 / 4 ||
+      max_probe_length > 16)
+    throw std::runtime_error(std::string(name) + " churn built up tombstones");
+
+  for (int i = 999000; i < 999900; ++i)
+    m.erase(i);
+  m.compact();
+  if (m.stats().tombstones != 0 || m.size() != 100 || m.at(999950) != 999950)
+    throw std::runtime_error(std::string(name) + " compact() mismatch");
+  std::cout << name << " churn: max probe " << max_probe_length << ", "
+            << s.rehash_count << " rehashes\n";
+}
+
+void test_map_compaction() {
+  kokopuffs::map<int, int> quadratic;
+  quadratic.set_empty_key(-1);
+  quadratic.set_deleted_key(-2);
+  check_churn(quadratic, "quadratic_probing");
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > group;
+  check_churn(group, "group_probing");
+  kokopuffs::map<int, int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing,
+                                       kokopuffs::store_hash_auto, true> >
+      incremental;
+  check_churn(incremental, "incremental");
+  std::cout << "compaction ok\n";
+}
+
+// Writers insert and erase their own key ranges while readers look up keys
+// that never change, so every read has one right answer.
+void test_concurrent_map() {
+  kokopuffs::concurrent_map<int, int> m(16);
+  const int kStable = 10000;
+  for (int i = 0; i < kStable; ++i)
+    m.insert_or_assign(i, i);
+
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([&m, &failed, t]() {
+      const int base = kStable + t * 100000;
+      for (int i = 0; i < 100000; ++i) {
+        if (!m.insert_or_assign(base + i, i))
+          failed = true;
+        if (i % 2 == 0 && m.erase(base + i) != 1)
+          failed = true;
+      }
+    }));
+    threads.push_back(std::thread([&m, &failed, t]() {
+      int value;
+      for (int i = 0; i < 200000; ++i) {
+        const int key = (i * 7 + t) % kStable;
+        if (!m.find(key, value) || value != key)
+          failed = true;
+        if (!m.visit(key, [key, &failed](const int& v) {
+              if (v != key)
+                failed = true;
+            }))
+          failed = true;
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  if (failed || m.size() != kStable + 4 * 50000)
+    throw std::runtime_error("concurrent_map mismatch");
+  long sum = 0;
+  m.visit_all([&sum](const int&, const int& v) { sum += v; });
+  if (sum != static_cast<long>(kStable - 1) * kStable / 2 +
+                 4 * (50000L * 99999 / 2 + 25000))
+    throw std::runtime_error("concurrent_map visit_all mismatch");
+  std::cout << "concurrent_map ok\n";
+}
+
+// Every update sets all keys to the same version, so a reader that ever sees
+// two versions in one snapshot saw a table being written to.
+void test_rcu_map() {
+  typedef kokopuffs::rcu_map<int, int> rcu_map;
+  rcu_map m;
+  const int kKeys = 64;
+  m.update([](rcu_map::map_type& table) {
+    for (int i = 0; i < kKeys; ++i)
+      table[i] = 0;
+  });
+
+  std::atomic<bool> failed(false);
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t) {
+    readers.push_back(std::thread([&m, &failed, &done]() {
+      rcu_map::reader reader(m);
+      int last_version = 0;
+      while (!done) {
+        const rcu_map::map_type& table = reader.lock();
+        // key 0 is erased while the readers run, the others never are
+        const int version = table.at(kKeys - 1);
+        for (int i = 0; i < kKeys - 1; ++i) {
+          rcu_map::map_type::const_iterator it = table.find(i);
+          if (it == table.end() ? i != 0 : it->value != version)
+            failed = true;
+        }
+        reader.unlock();
+        // a newer table is never followed by an older one
+        if (version < last_version)
+          failed = true;
+        last_version = version;
+        int value;
+        if (!reader.find(kKeys - 1, value) || value < version)
+          failed = true;
+      }
+    }));
+  }
+
+  for (int version = 1; version <= 2000; ++version) {
+    if (version == 1000) {
+      m.insert_or_assign(kKeys, 1);
+      m.erase(0);
+    }
+    m.update([version](rcu_map::map_type& table) {
+      for (int i = version < 1000 ? 0 : 1; i < kKeys; ++i)
+        table[i] = version;
+    });
+  }
+  done = true;
+  for (size_t i = 0; i < readers.size(); ++i)
+    readers[i].join();
+
+  rcu_map::reader reader(m);
+  int value;
+  if (failed || reader.contains(0) || !reader.find(kKeys, value) ||
+      value != 1)
+    throw std::runtime_error("rcu_map mismatch");
+  // with no reader inside a lookup, the next update frees everything
+  m.update([](rcu_map::map_type&) {});
+  if (m.retired_count() != 0)
+    throw std::runtime_error("rcu_map did not reclaim old tables");
+  std::cout << "rcu_map ok\n";
+}
+
+void test_snapshot() {
+  const std::string path = "kokopuffs_snapshot_test.bin";
+
+  kokopuffs::map<uint64_t, double, kokopuffs::hash<uint64_t>,
+                 kokopuffs::equal_to<uint64_t>,
+                 kokopuffs::map_policy<kokopuffs::robin_hood_probing> > numbers;
+  for (uint64_t i = 0; i < 100000; ++i)
+    numbers[i * 3] = i / 2.0;
+  kokopuffs::write_snapshot(numbers, path);
+  {
+    kokopuffs::snapshot_view<uint64_t, double> view(path);
+    if (view.size() != numbers.size())
+      throw std::runtime_error("snapshot size mismatch");
+    for (uint64_t i = 0; i < 300000; ++i) {
+      const double* value = view.find(i);
+      if ((i % 3 == 0) != (value != nullptr) ||
+          (value && *value != numbers.at(i)))
+        throw std::runtime_error("snapshot lookup mismatch");
+    }
+  }
+
+  kokopuffs::map<std::string, int, kokopuffs::hash<std::string>,
+                 kokopuffs::equal_to<std::string>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > words;
+  for (int i = 0; i < 20000; ++i)
+    words[std::to_string(i) + "-word"] = i;
+  words[""] = -1;
+  kokopuffs::write_snapshot(words, path);
+  {
+    kokopuffs::snapshot_view<std::string, int> view(path);
+    for (int i = 0; i < 20000; ++i) {
+      const int* value = view.find(std::to_string(i) + "-word");
+      if (value == nullptr || *value != i)
+        throw std::runtime_error("snapshot string lookup mismatch");
+    }
+    if (!view.contains("") || view.contains("20000-word") ||
+        *view.find("7-word") != 7)
+      throw std::runtime_error("snapshot string lookup mismatch");
+  }
+
+  // a view with the wrong value type has to refuse the file
+  bool threw = false;
+  try {
+    kokopuffs::snapshot_view<std::string, double> view(path);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  std::remove(path.c_str());
+  if (!threw)
+    throw std::runtime_error("snapshot_view accepted a mismatched file");
+  std::cout << "snapshot ok\n";
+}
+
+void test_string_map() {
+  kokopuffs::string_map<int> m;
+  std::unordered_map<std::string, int> expected;
+  std::minstd_rand re(3);
+  std::uniform_int_distribution<int> key_dist(0, 5000);
+
+  // both inline and arena keys
+  for (int i = 0; i < 200000; ++i) {
+    const int n = key_dist(re);
+    const std::string key = n % 2 ? std::to_string(n)
+                                  : "a much longer key that lives in the arena " +
+                                        std::to_string(n);
+    if (i % 3 == 0) {
+      if (m.erase(key) != expected.erase(key))
+        throw std::runtime_error("string_map erase mismatch");
+    } else if (i % 3 == 1) {
+      m[key] = i;
+      expected[key] = i;
+    } else {
+      const bool inserted = m.insert_or_assign(key, i);
+      if (inserted != expected.insert(std::make_pair(key, i)).second)
+        throw std::runtime_error("string_map insert_or_assign mismatch");
+      expected[key] = i;
+    }
+  }
+
+  kokopuffs::string_map<int> copy(m);
+  kokopuffs::string_map<int> moved(std::move(m));
+  size_t visited = 0;
+  moved.visit_all([&](const char* key, size_t size, const int& value) {
+    if (expected.at(std::string(key, size)) != value)
+      throw std::runtime_error("string_map visit_all mismatch");
+    ++visited;
+  });
+  if (visited != expected.size() || copy.size() != expected.size())
+    throw std::runtime_error("string_map size mismatch");
+  for (const auto& kv : expected) {
+    if (copy.at(kv.first) != kv.second || *moved.find(kv.first) != kv.second)
+      throw std::runtime_error("string_map lookup mismatch");
+  }
+  if (copy.contains("no such key") || copy.find("5001") != nullptr)
+    throw std::runtime_error("string_map found a missing key");
+
+  kokopuffs::string_map<int> reserved;
+  reserved.reserve(100000);
+  const size_t bucket_count = reserved.bucket_count();
+  for (int i = 0; i < 100000; ++i)
+    reserved[std::to_string(i)] = i;
+  if (reserved.bucket_count() != bucket_count || reserved.at("99999") != 99999)
+    throw std::runtime_error("string_map reserve mismatch");
+  std::cout << "string_map ok\n";
+}
+
+void test_set() {
+  typedef kokopuffs::map<std::string, char> string_char_map;
+  typedef kokopuffs::set<std::string> string_set;
+  if (sizeof(string_set::map_type::Entry) >= sizeof(string_char_map::Entry))
+    throw std::runtime_error("set entries are no smaller than map entries");
+
+  string_set s;
+  s.set_empty_key("");
+  s.set_deleted_key("\x01");
+  std::unordered_map<std::string, bool> expected;
+  std::minstd_rand re(5);
+  std::uniform_int_distribution<int> key_dist(1, 3000);
+  for (int i = 0; i < 50000; ++i) {
+    const std::string key = std::to_string(key_dist(re));
+    if (i % 4 == 0) {
+      if (s.erase(key) != expected.erase(key))
+        throw std::runtime_error("set erase mismatch");
+    } else {
+      const std::pair<string_set::iterator, bool> result = s.insert(key);
+      if (result.second != expected.insert(std::make_pair(key, true)).second ||
+          *result.first != key)
+        throw std::runtime_error("set insert mismatch");
+    }
+  }
+  size_t visited = 0;
+  for (string_set::const_iterator it = s.begin(); it != s.end(); ++it) {
+    if (!expected.count(*it))
+      throw std::runtime_error("set iterated over a missing key");
+    ++visited;
+  }
+  if (visited != expected.size() || s.size() != expected.size())
+    throw std::runtime_error("set size mismatch");
+  if (s.contains("0") || s.find("3001") != s.end() || s.count("3001"))
+    throw std::runtime_error("set found a missing key");
+
+  kokopuffs::set<int, kokopuffs::hash<int>, kokopuffs::equal_to<int>,
+                 kokopuffs::map_policy<kokopuffs::group_probing> > ints;
+  std::vector<int> values;
+  for (int i = 0; i < 1000; ++i)
+    values.push_back(i % 500);
+  ints.insert(values.begin(), values.end());
+  if (ints.size() != 500 || !ints.contains(499) || ints.contains(500))
+    throw std::runtime_error("set range insert mismatch");
+  std::cout << "set ok\n";
+}
+
+template <typename Key>
+void check_flat_int_map() {
+  kokopuffs::flat_int_map<Key, int> m;
+  std::unordered_map<Key, int> expected;
+  std::minstd_rand re(8);
+  std::uniform_int_distribution<int> key_dist(0, 20000);
+  for (int i = 0; i < 300000; ++i) {
+    const Key key = static_cast<Key>(key_dist(re)) * 7919;
+    if (i % 3 == 0) {
+      if (m.erase(key) != expected.erase(key))
+        throw std::runtime_error("flat_int_map erase mismatch");
+    } else if (i % 3 == 1) {
+      m[key] = i;
+      expected[key] = i;
+    } else {
+      const bool inserted = m.insert_or_assign(key, i);
+      if (inserted != expected.insert(std::make_pair(key, i)).second)
+        throw std::runtime_error("flat_int_map insert_or_assign mismatch");
+      expected[key] = i;
+    }
+  }
+
+  kokopuffs::flat_int_map<Key, int> copy(m);
+  size_t visited = 0;
+  m.visit_all([&](Key key, const int& value) {
+    if (expected.at(key) != value)
+      throw std::runtime_error("flat_int_map visit_all mismatch");
+    ++visited;
+  });
+  if (visited != expected.size() || copy.size() != expected.size())
+    throw std::runtime_error("flat_int_map size mismatch");
+  for (const auto& kv : expected) {
+    if (copy.at(kv.first) != kv.second || !m.contains(kv.first))
+      throw std::runtime_error("flat_int_map lookup mismatch");
+  }
+  for (int i = 0; i < 20000; ++i) {
+    const Key key = static_cast<Key>(i) * 7919 + 1;
+    if (m.contains(key) || m.find(key) != nullptr)
+      throw std::runtime_error("flat_int_map found a missing key");
+  }
+
+  bool threw = false;
+  try {
+    m[m.empty_key()] = 1;
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  if (!threw || m.contains(m.empty_key()))
+    throw std::runtime_error("flat_int_map accepted the empty key");
+}
+
+void test_flat_int_map() {
+  check_flat_int_map<uint32_t>();
+  check_flat_int_map<int64_t>();
+
+  // sequential ids, every one of them present
+  kokopuffs::flat_int_set<uint64_t> ids(16, 0);
+  ids.reserve(1000000);
+  const size_t bucket_count = ids.bucket_count();
+  for (uint64_t id = 1; id <= 1000000; ++id)
+    ids.insert(id);
+  if (ids.bucket_count() != bucket_count || ids.size() != 1000000)
+    throw std::runtime_error("flat_int_set reserve mismatch");
+  for (uint64_t id = 0; id <= 1000001; ++id) {
+    if (ids.contains(id) != (id >= 1 && id <= 1000000))
+      throw std::runtime_error("flat_int_set lookup mismatch");
+  }
+  for (uint64_t id = 1; id <= 1000000; id += 2)
+    ids.erase(id);
+  for (uint64_t id = 1; id <= 1000000; ++id) {
+    if (ids.contains(id) != (id % 2 == 0))
+      throw std::runtime_error("flat_int_set erase mismatch");
+  }
+  std::cout << "flat_int_map ok\n";
+}
+
+// Random inserts and erases checked against std::map, including the order
+// of iteration in both directions and lower_bound()/upper_bound().
+template <typename Key, typename Make>
+void check_btree_map(const char* name, Make make_key) {
+  kokopuffs::btree_map<Key, int> m;
+  std::map<Key, int> expected;
+  std::minstd_rand re(11);
+  std::uniform_int_distribution<int> key_dist(-20000, 20000);
+  for (int i = 0; i < 300000; ++i) {
+    const Key key = make_key(key_dist(re));
+    if (i % 3 == 0) {
+      if (m.erase(key) != expected.erase(key))
+        throw std::runtime_error(std::string(name) + " btree erase mismatch");
+    } else {
+      m[key] = i;
+      expected[key] = i;
+    }
+  }
+
+  kokopuffs::btree_map<Key, int> copy(m);
+  if (m.size() != expected.size() || copy.size() != expected.size())
+    throw std::runtime_error(std::string(name) + " btree size mismatch");
+  typename std::map<Key, int>::const_iterator e = expected.begin();
+  for (typename kokopuffs::btree_map<Key, int>::const_iterator it = m.begin();
+       it != m.end(); ++it, ++e) {
+    if (it->key != e->first || it->value != e->second ||
+        copy.at(e->first) != e->second)
+      throw std::runtime_error(std::string(name) + " btree order mismatch");
+  }
+  typename std::map<Key, int>::const_reverse_iterator r = expected.rbegin();
+  for (typename kokopuffs::btree_map<Key, int>::iterator it = m.end();
+       it != m.begin(); ++r) {
+    --it;
+    if (it->key != r->first)
+      throw std::runtime_error(std::string(name) + " btree reverse mismatch");
+  }
+  for (int i = -20100; i < 20100; i += 7) {
+    const Key key = make_key(i);
+    typename kokopuffs::btree_map<Key, int>::iterator lower =
+        m.lower_bound(key);
+    typename kokopuffs::btree_map<Key, int>::iterator upper =
+        m.upper_bound(key);
+    typename std::map<Key, int>::iterator expected_lower =
+        expected.lower_bound(key);
+    typename std::map<Key, int>::iterator expected_upper =
+        expected.upper_bound(key);
+    if ((lower == m.end()) != (expected_lower == expected.end()) ||
+        (upper == m.end()) != (expected_upper == expected.end()) ||
+        (lower != m.end() && lower->key != expected_lower->first) ||
+        (upper != m.end() && upper->key != expected_upper->first))
+      throw std::runtime_error(std::string(name) + " btree bound mismatch");
+  }
+
+  // erasing everything collapses the tree level by level
+  for (typename std::map<Key, int>::const_iterator it = expected.begin();
+       it != expected.end(); ++it)
+    m.erase(it->first);
+  if (!m.empty() || m.begin() != m.end() || m.bytes_used() != sizeof(m))
+    throw std::runtime_error(std::string(name) + " btree not empty");
+  std::cout << name << " btree_map matched std::map\n";
+}
+
+// Bytes malloc has handed out, including its own rounding and headers, or
+// 0 where that can't be asked for.
+size_t heap_in_use() {
+#ifdef HAS_MALLINFO2
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// int key whose copies throw once copies_left runs out
+struct fragile_key {
+  static long copies_left;
+
+  fragile_key(int k = 0) : k(k) {}
+
+  fragile_key(const fragile_key& other) : k(other.k) {
+    _count_copy();
+  }
+
+  fragile_key& operator=(const fragile_key& other) {
+    _count_copy();
+    k = other.k;
+    return *this;
+  }
+
+  bool operator<(const fragile_key& other) const {
+    return k < other.k;
+  }
+
+  void _count_copy() {
+    if (copies_left-- == 0)
+      throw std::runtime_error("fragile_key copy");
+  }
+
+  int k;
+};
+
+long fragile_key::copies_left = 0;
+
+// A bulk load that throws part way, while appending leaves or while
+// building the levels above them, leaves the map empty and frees every
+// node it made.
+void check_btree_bulk_load_throws() {
+  fragile_key::copies_left = 1 << 30;
+  std::vector<std::pair<fragile_key, int> > entries;
+  for (int i = 0; i < 20000; ++i)
+    entries.push_back(std::make_pair(fragile_key(i), i));
+  fragile_key::copies_left = 1 << 30;
+  {
+    kokopuffs::btree_map<fragile_key, int> m;
+    m.assign_sorted(entries.begin(), entries.end());
+  }
+  const long copies = (1 << 30) - fragile_key::copies_left;
+  for (long limit = 0; limit < copies; limit += copies / 97 + 1) {
+    kokopuffs::btree_map<fragile_key, int> m;
+    const size_t heap_before = heap_in_use();
+    fragile_key::copies_left = limit;
+    bool threw = false;
+    try {
+      m.assign_sorted(entries.begin(), entries.end());
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    fragile_key::copies_left = 1 << 30;
+    if (!threw || !m.empty() || m.bytes_used() != sizeof(m) ||
+        heap_in_use() != heap_before)
+      throw std::runtime_error("btree assign_sorted leaked when a copy threw");
+  }
+}
+
+void test_btree_map() {
+  check_btree_map<int>("int", [](int i) { return i; });
+  check_btree_map<uint64_t>("uint64_t", [](int i) {
+    return static_cast<uint64_t>(i) * 0x9E3779B97F4A7C15ull;
+  });
+  check_btree_map<std::string>("string", [](int i) {
+    return std::to_string(i);
+  });
+
+  std::vector<std::pair<int, int> > sorted;
+  for (int i = 0; i < 100000; ++i)
+    sorted.push_back(std::make_pair(i * 2, i));
+  kokopuffs::btree_map<int, int> loaded;
+  loaded.assign_sorted(sorted.begin(), sorted.end());
+  if (loaded.size() != sorted.size() || loaded.at(1000) != 500 ||
+      loaded.lower_bound(1001)->key != 1002 || loaded.contains(1001))
+    throw std::runtime_error("btree assign_sorted mismatch");
+  for (int i = 0; i < 200000; i += 3)
+    loaded.erase(i);
+  for (int i = 1; i < 2000; i += 2)
+    loaded[i] = -i;
+  int previous = -1;
+  for (kokopuffs::btree_map<int, int>::const_iterator it = loaded.begin();
+       it != loaded.end(); ++it) {
+    if (it->key <= previous)
+      throw std::runtime_error("btree out of order after bulk load");
+    previous = it->key;
+  }
+  // the out of order key comes after several leaves are full
+  std::swap(sorted[1000], sorted[1001]);
+  loaded.clear();
+  const size_t heap_before = heap_in_use();
+  bool threw = false;
+  try {
+    loaded.assign_sorted(sorted.begin(), sorted.end());
+  } catch (const std::invalid_argument&) {
+    threw = true;
+  }
+  if (!threw || !loaded.empty())
+    throw std::runtime_error("btree assign_sorted took unsorted keys");
+  if (heap_in_use() != heap_before)
+    throw std::runtime_error("btree assign_sorted leaked on unsorted keys");
+  check_btree_bulk_load_throws();
+
+  // keys inserted in order fill each leaf like assign_sorted() does, and
+  // the short nodes left along the right edge still rebalance
+  kokopuffs::btree_map<int, int> appended;
+  std::vector<std::pair<int, int> > in_order;
+  for (int i = 0; i < 100000; ++i) {
+    appended[i] = i;
+    in_order.push_back(std::make_pair(i, i));
+  }
+  kokopuffs::btree_map<int, int> bulk;
+  bulk.assign_sorted(in_order.begin(), in_order.end());
+  if (appended.bytes_used() > bulk.bytes_used() * 101 / 100)
+    throw std::runtime_error("btree in order inserts left leaves half full");
+  for (int i = 99999; i >= 0; i -= 3)
+    appended.erase(i);
+  int next = 1;
+  for (kokopuffs::btree_map<int, int>::const_iterator it = appended.begin();
+       it != appended.end(); ++it, next += next % 3 == 1 ? 1 : 2) {
+    if (it->key != next || it->value != next)
+      throw std::runtime_error("btree mismatch after erasing appended keys");
+  }
+  if (next != 100000 || appended.size() != 66666)
+    throw std::runtime_error("btree lost appended keys");
+
+  kokopuffs::btree_set<int> set;
+  for (int i = 100; i > 0; --i)
+    set.insert(i * 10);
+  if (set.size() != 100 || *set.lower_bound(15) != 20 ||
+      *set.upper_bound(20) != 30 || *set.begin() != 10 ||
+      *--set.end() != 1000 || !set.insert(5).second || set.insert(5).second)
+    throw std::runtime_error("btree_set mismatch");
+
+  // timestamps, looked up in random order
+  Stopwatch watch;
+  const int n = 1000000;
+  std::vector<int64_t> keys(n);
+  std::minstd_rand re(12);
+  for (int i = 0; i < n; ++i)
+    keys[i] = 1500000000000ll + i * 1000ll + re() % 1000;
+  std::vector<int64_t> lookups(keys);
+  std::shuffle(lookups.begin(), lookups.end(), re);
+
+  std::map<int64_t, int64_t> std_map;
+  watch.Start();
+  for (int i = 0; i < n; ++i)
+    std_map[lookups[i]] = i;
+  std::cout << "inserted " << n << " into std::map in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  kokopuffs::btree_map<int64_t, int64_t> btree;
+  watch.Start();
+  for (int i = 0; i < n; ++i)
+    btree[lookups[i]] = i;
+  std::cout << "inserted " << n << " into btree_map in "
+            << watch.StopResultMilliseconds() << " ms\n";
+
+  int64_t sum = 0;
+  watch.Start();
+  for (int i = 0; i < n; ++i)
+    sum += std_map.lower_bound(lookups[i] - 1)->second;
+  std::cout << "lower_bound on std::map in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  watch.Start();
+  for (int i = 0; i < n; ++i)
+    sum -= btree.lower_bound(lookups[i] - 1)->value;
+  std::cout << "lower_bound on btree_map in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  if (sum != 0)
+    throw std::runtime_error("btree_map and std::map disagree");
+  std_map.clear();
+  btree.clear();
+
+  // Memory as malloc sees it, so std::map's nodes count with malloc's
+  // rounding. Timestamps mostly arrive in order, which fills every leaf.
+  const int big = 10000000;
+  size_t before = heap_in_use();
+  size_t std_map_bytes = 0;
+  {
+    std::map<int64_t, int64_t> ordered;
+    for (int i = 0; i < big; ++i)
+      ordered.emplace_hint(ordered.end(), 1500000000000ll + i * 1000ll, i);
+    std_map_bytes = heap_in_use() - before;
+  }
+  before = heap_in_use();
+  size_t btree_bytes = 0;
+  {
+    kokopuffs::btree_map<int64_t, int64_t> ordered;
+    for (int i = 0; i < big; ++i)
+      ordered[1500000000000ll + i * 1000ll] = i;
+    btree_bytes = heap_in_use() - before;
+    if (btree_bytes == 0)
+      btree_bytes = ordered.bytes_used();
+  }
+  std::cout << big << " keys in order: std::map " << std_map_bytes / (1 << 20)
+            << " MB, btree_map " << btree_bytes / (1 << 20) << " MB\n";
+  if (std_map_bytes != 0 && btree_bytes * 2 > std_map_bytes)
+    throw std::runtime_error("btree_map not half the size of std::map");
+  std::cout << "btree_map ok\n";
+}
+
+uint32_t fnv1a(const std::string& key) {
+  uint32_t hash = 2166136261; // offset_basis
+  for (size_t i = 0; i < key.size(); ++i) {
+    hash ^= static_cast<uint8_t>(key[i]);
+    hash *= 16777619; // FNV_prime
+  }
+  return hash;
+}
+
+void test_hash() {
+  Stopwatch watch;
+
+  std::minstd_rand re(42);
+  std::uniform_int_distribution<int> length_dist(64, 200);
+  std::uniform_int_distribution<int> char_dist('a', 'z');
+  std::vector<std::string> urls(100000);
+  for (std::string& url : urls) {
+    url = "https://example.com/";
+    const int length = length_dist(re);
+    while (static_cast<int>(url.size()) < length)
+      url.push_back(static_cast<char>(char_dist(re)));
+  }
+
+  size_t sum = 0;
+  watch.Start();
+  for (int round = 0; round < 10; ++round)
+    for (const std::string& url : urls)
+      sum += fnv1a(url);
+  std::cout << "hashed urls via fnv1a in " << watch.StopResultMilliseconds() << " ms\n";
+
+  kokopuffs::hash<std::string> hasher;
+  watch.Start();
+  for (int round = 0; round < 10; ++round)
+    for (const std::string& url : urls)
+      sum += hasher(url);
+  std::cout << "hashed urls via kokopuffs::hash in " << watch.StopResultMilliseconds() << " ms\n";
+
+  std::hash<std::string> std_hasher;
+  watch.Start();
+  for (int round = 0; round < 10; ++round)
+    for (const std::string& url : urls)
+      sum += std_hasher(url);
+  std::cout << "hashed urls via std::hash in " << watch.StopResultMilliseconds() << " ms\n";
+
+  if (sum == 0)
+    std::cout << "\n";
+}
+
 void test_sort() {
   Stopwatch watch;
   
@@ -142,6 +1529,20 @@ void test_sort() {
     throw std::runtime_error("quicksort sorted numbers mismatch");
   }
   std::cout << "sorted via quicksort in " << watch.StopResultMilliseconds() << " ms\n";
+
+  std::vector<int> pdqsorted_nums(orignums);
+  watch.Start();
+  kokopuffs::pdqsort(pdqsorted_nums);
+  if (pdqsorted_nums != std_sorted_nums)
+    throw std::runtime_error("pdqsort sorted numbers mismatch");
+  std::cout << "sorted via pdqsort in " << watch.StopResultMilliseconds() << " ms\n";
+
+  std::vector<int> radix_sorted_nums(orignums);
+  watch.Start();
+  kokopuffs::radix_sort(radix_sorted_nums);
+  if (radix_sorted_nums != std_sorted_nums)
+    throw std::runtime_error("radix_sort sorted numbers mismatch");
+  std::cout << "sorted via radix_sort in " << watch.StopResultMilliseconds() << " ms\n";
   
   std::vector<int> mergesorted_nums(orignums);
   watch.Start();
@@ -151,8 +1552,370 @@ void test_sort() {
   std::cout << "sorted via mergesort in " << watch.StopResultMilliseconds() << " ms\n";
 }
 
+// Sorts a copy of input with sort, checks it against expected and prints
+// how long it took.
+template <typename T, typename Sort>
+void check_sort(const char* name, const char* distribution,
+                const std::vector<T>& input, const std::vector<T>& expected,
+                Sort sort) {
+  Stopwatch watch;
+  std::vector<T> nums(input);
+  watch.Start();
+  sort(nums);
+  const double ms = watch.StopResultMilliseconds();
+  if (nums != expected)
+    throw std::runtime_error(std::string(name) + " mismatch on " +
+                             distribution + " input");
+  std::cout << "  " << name << " in " << ms << " ms\n";
+}
+
+// The inputs that trip up naive quicksorts: presorted runs, organ pipes,
+// and lots of duplicates.
+std::vector<std::pair<std::string, std::vector<int> > > sort_inputs(
+    const int n) {
+  std::minstd_rand re(43);
+  std::uniform_int_distribution<int> uniform_dist;
+  std::vector<std::pair<std::string, std::vector<int> > > inputs;
+  std::vector<int> nums(n);
+  for (int i = 0; i < n; ++i)
+    nums[i] = uniform_dist(re);
+  inputs.push_back(std::make_pair("random", nums));
+  for (int i = 0; i < n; ++i)
+    nums[i] = i;
+  inputs.push_back(std::make_pair("sorted", nums));
+  for (int i = 0; i < n; ++i)
+    nums[i] = n - i;
+  inputs.push_back(std::make_pair("reversed", nums));
+  for (int i = 0; i < n; ++i)
+    nums[i] = i < n / 2 ? i : n - i;
+  inputs.push_back(std::make_pair("organ pipe", nums));
+  for (int i = 0; i < n; ++i)
+    nums[i] = i;
+  for (int i = 0; i < n / 100; ++i)
+    std::swap(nums[re() % n], nums[re() % n]);
+  inputs.push_back(std::make_pair("nearly sorted", nums));
+  for (int i = 0; i < n; ++i)
+    nums[i] = re() % 16;
+  inputs.push_back(std::make_pair("16 distinct", nums));
+  for (int i = 0; i < n; ++i)
+    nums[i] = 7;
+  inputs.push_back(std::make_pair("all equal", nums));
+  return inputs;
+}
+
+void test_sort_distributions() {
+  const std::vector<std::pair<std::string, std::vector<int> > > inputs =
+      sort_inputs(1000000);
+  for (size_t d = 0; d < inputs.size(); ++d) {
+    const char* distribution = inputs[d].first.c_str();
+    const std::vector<int>& input = inputs[d].second;
+    std::vector<int> expected(input);
+    std::sort(expected.begin(), expected.end());
+    std::cout << "sorting 1000000 " << distribution << " ints\n";
+    check_sort("std::sort", distribution, input, expected,
+               [](std::vector<int>& v) { std::sort(v.begin(), v.end()); });
+    check_sort("quicksort", distribution, input, expected,
+               [](std::vector<int>& v) { kokopuffs::quicksort(v); });
+    check_sort("pdqsort", distribution, input, expected,
+               [](std::vector<int>& v) { kokopuffs::pdqsort(v); });
+    check_sort("radix_sort", distribution, input, expected,
+               [](std::vector<int>& v) { kokopuffs::radix_sort(v); });
+    check_sort("mergesort", distribution, input, expected,
+               [](std::vector<int>& v) { kokopuffs::mergesort(v); });
+  }
+}
+
+// Every length around the insertion sort and ninther cutoffs, with few
+// distinct values so that runs of duplicates end up in most ranges, and
+// strings to take pdqsort's branching partition.
+void test_sort_small() {
+  std::minstd_rand re(44);
+  for (int n = 0; n < 600; ++n) {
+    std::vector<int> nums(n);
+    std::vector<std::string> strs(n);
+    for (int i = 0; i < n; ++i) {
+      nums[i] = re() % (n / 4 + 1);
+      strs[i] = std::to_string(re() % (n + 1));
+    }
+    std::vector<int> expected(nums);
+    std::sort(expected.begin(), expected.end());
+    std::vector<std::string> expected_strs(strs);
+    std::sort(expected_strs.begin(), expected_strs.end());
+
+    std::vector<int> sorted(nums);
+    kokopuffs::quicksort(sorted);
+    if (sorted != expected)
+      throw std::runtime_error("quicksort mismatch on small input");
+    sorted = nums;
+    kokopuffs::pdqsort(sorted);
+    if (sorted != expected)
+      throw std::runtime_error("pdqsort mismatch on small input");
+    std::vector<std::string> sorted_strs(strs);
+    kokopuffs::pdqsort(sorted_strs);
+    if (sorted_strs != expected_strs)
+      throw std::runtime_error("pdqsort mismatch on strings");
+  }
+  std::cout << "small sorts ok\n";
+}
+
+struct timestamped_event {
+  int64_t timestamp;
+  int id;
+
+  bool operator==(const timestamped_event& rhs) const {
+    return timestamp == rhs.timestamp && id == rhs.id;
+  }
+  bool operator!=(const timestamped_event& rhs) const {
+    return !(*this == rhs);
+  }
+};
+
+// Checks radix_sort() against std::stable_sort() on n values drawn by
+// next(re).
+template <typename T, typename Next>
+void check_radix_sort(const char* name, const int n, Next next) {
+  std::minstd_rand re(45);
+  std::vector<T> nums(n);
+  for (int i = 0; i < n; ++i)
+    nums[i] = next(re);
+  std::vector<T> expected(nums);
+  std::stable_sort(expected.begin(), expected.end());
+  kokopuffs::radix_sort(nums);
+  if (nums != expected)
+    throw std::runtime_error(std::string("radix_sort mismatch on ") + name);
+}
+
+void test_radix_sort() {
+  check_radix_sort<int>("ints", 100000, [](std::minstd_rand& re) {
+    return static_cast<int>(re() * 2654435761u);
+  });
+  check_radix_sort<int64_t>("int64s", 100000, [](std::minstd_rand& re) {
+    return static_cast<int64_t>((uint64_t(re()) << 33) ^ re()) - (int64_t(1) << 40);
+  });
+  check_radix_sort<uint64_t>("small uint64s", 100000, [](std::minstd_rand& re) {
+    return uint64_t(re() % 1000);
+  });
+  check_radix_sort<uint8_t>("bytes", 1000, [](std::minstd_rand& re) {
+    return static_cast<uint8_t>(re());
+  });
+  check_radix_sort<int16_t>("int16s", 1000, [](std::minstd_rand& re) {
+    return static_cast<int16_t>(re());
+  });
+  check_radix_sort<float>("floats", 100000, [](std::minstd_rand& re) {
+    return (static_cast<float>(re()) - 1e9f) * 1e-3f;
+  });
+  check_radix_sort<double>("doubles", 100000, [](std::minstd_rand& re) {
+    return re() % 10 == 0 ? 0.0 : std::ldexp(static_cast<double>(re()) - 1e9, re() % 200 - 100);
+  });
+
+  // sorting by a key has to keep equal keys in order
+  std::minstd_rand re(46);
+  std::vector<timestamped_event> events(100000);
+  for (size_t i = 0; i < events.size(); ++i) {
+    events[i].timestamp = static_cast<int64_t>(re() % 5000) - 2500;
+    events[i].id = static_cast<int>(i);
+  }
+  std::vector<timestamped_event> expected(events);
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const timestamped_event& a, const timestamped_event& b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  kokopuffs::radix_sort(
+      events, [](const timestamped_event& e) { return e.timestamp; });
+  if (events != expected)
+    throw std::runtime_error("radix_sort by key is not stable");
+
+  // strings with long shared prefixes, empty strings, and bytes above 127
+  std::vector<std::string> strs;
+  for (int i = 0; i < 200000; ++i) {
+    std::string s;
+    switch (re() % 4) {
+      case 0:
+        s = "https://example.com/items/" + std::to_string(re() % 100000);
+        break;
+      case 1:
+        s = std::to_string(re());
+        break;
+      case 2:
+        s.assign(re() % 4, static_cast<char>(0xe0 + re() % 4));
+        break;
+      default:
+        break;
+    }
+    strs.push_back(s);
+  }
+  std::vector<std::string> expected_strs(strs);
+  Stopwatch watch;
+  watch.Start();
+  std::sort(expected_strs.begin(), expected_strs.end());
+  std::cout << "sorted 200000 strings via std::sort in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  watch.Start();
+  kokopuffs::radix_sort(strs);
+  std::cout << "sorted 200000 strings via radix_sort in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  if (strs != expected_strs)
+    throw std::runtime_error("radix_sort mismatch on strings");
+  std::cout << "radix_sort ok\n";
+}
+
+// ordered by key alone, so sorting them shows whether equal keys kept
+// their order
+struct keyed_record {
+  int key;
+  int position;
+
+  bool operator<(const keyed_record& rhs) const { return key < rhs.key; }
+  bool operator==(const keyed_record& rhs) const {
+    return key == rhs.key && position == rhs.position;
+  }
+  bool operator!=(const keyed_record& rhs) const { return !(*this == rhs); }
+};
+
+void test_parallel_sort() {
+  const unsigned thread_counts[] = {1, 2, 4, 7};
+  const std::vector<std::pair<std::string, std::vector<int> > > inputs =
+      sort_inputs(300000);
+  for (size_t d = 0; d < inputs.size(); ++d) {
+    const std::string& distribution = inputs[d].first;
+    std::vector<int> expected(inputs[d].second);
+    std::sort(expected.begin(), expected.end());
+    for (unsigned threads : thread_counts) {
+      std::vector<int> nums(inputs[d].second);
+      kokopuffs::parallel_mergesort(nums, threads);
+      if (nums != expected)
+        throw std::runtime_error("parallel_mergesort mismatch on " +
+                                 distribution + " input");
+      nums = inputs[d].second;
+      kokopuffs::parallel_samplesort(nums, threads);
+      if (nums != expected)
+        throw std::runtime_error("parallel_samplesort mismatch on " +
+                                 distribution + " input");
+      nums = inputs[d].second;
+      kokopuffs::parallel_sort(nums, threads);
+      if (nums != expected)
+        throw std::runtime_error("parallel_sort mismatch on " +
+                                 distribution + " input");
+    }
+  }
+
+  // sizes around the grain, where the merges start to split
+  std::minstd_rand re(47);
+  const size_t sizes[] = {0, 1, kokopuffs::kParallelSortGrain,
+                          kokopuffs::kParallelSortGrain + 1,
+                          3 * kokopuffs::kParallelSortGrain + 17};
+  for (size_t n : sizes) {
+    std::vector<keyed_record> records(n);
+    for (size_t i = 0; i < n; ++i) {
+      records[i].key = static_cast<int>(re() % 1000);
+      records[i].position = static_cast<int>(i);
+    }
+    std::vector<keyed_record> expected(records);
+    std::stable_sort(expected.begin(), expected.end());
+    for (unsigned threads : thread_counts) {
+      std::vector<keyed_record> sorted(records);
+      kokopuffs::parallel_mergesort(sorted, threads);
+      if (sorted != expected)
+        throw std::runtime_error("parallel_mergesort is not stable");
+    }
+  }
+
+  const std::vector<int>& random = inputs[0].second;
+  std::vector<int> expected(random);
+  Stopwatch watch;
+  watch.Start();
+  kokopuffs::pdqsort(expected);
+  std::cout << "sorted 300000 ints via pdqsort in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  std::vector<int> nums(random);
+  watch.Start();
+  kokopuffs::parallel_sort(nums);
+  std::cout << "sorted 300000 ints via parallel_sort on "
+            << std::thread::hardware_concurrency() << " threads in "
+            << watch.StopResultMilliseconds() << " ms\n";
+  if (nums != expected)
+    throw std::runtime_error("parallel_sort mismatch");
+  std::cout << "parallel_sort ok\n";
+}
+
+void test_mergesort() {
+  // keys from a few values, laid out as random data, as ascending and
+  // descending runs of random lengths with ties inside them, and as every
+  // length around the minimum run
+  std::minstd_rand re(48);
+  std::vector<std::vector<keyed_record> > inputs;
+  std::vector<keyed_record> records(100000);
+  for (size_t i = 0; i < records.size(); ++i)
+    records[i].key = static_cast<int>(re() % 100);
+  inputs.push_back(records);
+  for (size_t i = 0; i < records.size();) {
+    const size_t run = std::min<size_t>(records.size() - i, 1 + re() % 3000);
+    const bool descending = re() % 2 == 0;
+    int key = static_cast<int>(re() % 1000);
+    for (size_t j = 0; j < run; ++j, ++i) {
+      records[i].key = key;
+      if (re() % 4 != 0)
+        key += descending ? -1 : 1;
+    }
+  }
+  inputs.push_back(records);
+  for (int n = 0; n < 300; ++n) {
+    std::vector<keyed_record> small(n);
+    for (int i = 0; i < n; ++i)
+      small[i].key = static_cast<int>(re() % 8);
+    inputs.push_back(small);
+  }
+
+  std::vector<keyed_record> buffer(records.size());
+  const keyed_record* const buffer_data = buffer.data();
+  for (size_t in = 0; in < inputs.size(); ++in) {
+    std::vector<keyed_record>& input = inputs[in];
+    for (size_t i = 0; i < input.size(); ++i)
+      input[i].position = static_cast<int>(i);
+    std::vector<keyed_record> expected(input);
+    std::stable_sort(expected.begin(), expected.end());
+    std::vector<keyed_record> sorted(input);
+    kokopuffs::mergesort(sorted);
+    if (sorted != expected)
+      throw std::runtime_error("mergesort is not stable");
+    sorted = input;
+    kokopuffs::mergesort(sorted, buffer);
+    if (sorted != expected)
+      throw std::runtime_error("mergesort with a buffer is not stable");
+  }
+  if (buffer.data() != buffer_data)
+    throw std::runtime_error("mergesort reallocated a big enough buffer");
+  std::cout << "mergesort ok\n";
+}
+
 int main() {
   /* test_map(); */
+  test_map_probing();
+  test_map_integer_keys();
+  test_map_heterogeneous_lookup();
+  test_map_find_and_iterators();
+  test_map_emplace();
+  test_map_store_hash();
+  test_map_incremental_rehash();
+  test_map_allocators();
+  test_map_reserve();
+  test_map_batch();
+  test_map_parallel_build();
+  test_map_stats();
+  test_map_compaction();
+  test_concurrent_map();
+  test_rcu_map();
+  test_snapshot();
+  test_string_map();
+  test_set();
+  test_flat_int_map();
+  test_btree_map();
+  test_hash();
   test_sort();
+  test_sort_distributions();
+  test_sort_small();
+  test_radix_sort();
+  test_parallel_sort();
+  test_mergesort();
   return 0;
 }